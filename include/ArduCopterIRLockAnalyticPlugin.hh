@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#ifndef _GAZEBO_ARDUCOPTERIRLOCKANALYTIC_PLUGIN_HH_
+#define _GAZEBO_ARDUCOPTERIRLOCKANALYTIC_PLUGIN_HH_
+
+#include <string>
+#include <memory>
+
+#include <ignition/math/Vector3.hh>
+
+#include "gazebo/common/Plugin.hh"
+#include "gazebo/common/UpdateInfo.hh"
+#include "gazebo/util/system.hh"
+
+namespace gazebo
+{
+  // Forward declare private class.
+  class ArduCopterIRLockAnalyticPluginPrivate;
+
+  /// \brief Fiducial detection without rendering, for headless servers.
+  /// The fiducial positions are projected through a pinhole model of the
+  /// IRLock camera and occlusion is tested with physics ray casts, so the
+  /// same packets as ArduCopterIRLockPlugin are sent without a camera
+  /// sensor. A model plugin of the vehicle carrying the camera.
+  ///
+  /// <fiducial>      model name of a beacon, repeated for each beacon
+  /// <linkName>      link carrying the camera, canonical link by default
+  /// <cameraPose>    camera pose in the link frame, looking along x as a
+  ///                 gazebo camera does, 0 0 0 0 0 0
+  /// <hfov>          horizontal field of view, rad, 1.047
+  /// <imageWidth>    image width, pixels, 320
+  /// <imageHeight>   image height, pixels, 240
+  /// <updateRate>    detections per second of sim time, 0 for every
+  ///                 step, 20
+  /// <irlock_addr>, <irlock_port>, <irlock_packet> as for
+  ///                 ArduCopterIRLockPlugin
+  class GAZEBO_VISIBLE ArduCopterIRLockAnalyticPlugin : public ModelPlugin
+  {
+    /// \brief Constructor
+    public: ArduCopterIRLockAnalyticPlugin();
+
+    /// \brief Destructor
+    public: virtual ~ArduCopterIRLockAnalyticPlugin();
+
+    // Documentation Inherited.
+    public: virtual void Load(physics::ModelPtr _model, sdf::ElementPtr _sdf);
+
+    /// \brief Detect and publish the fiducials, at the update rate.
+    /// \param[in] _info Update information.
+    private: void OnUpdate(const common::UpdateInfo &_info);
+
+    /// \brief Test the line of sight from the camera to a fiducial.
+    /// \param[in] _start Camera position.
+    /// \param[in] _end Fiducial position.
+    /// \param[in] _index Index of the fiducial.
+    /// \return True if nothing but the vehicle itself or the fiducial is
+    /// hit first.
+    private: bool LineOfSight(const ignition::math::Vector3d &_start,
+        const ignition::math::Vector3d &_end, const size_t _index);
+
+    /// \internal
+    /// \brief Pointer to private data.
+    private: std::unique_ptr<ArduCopterIRLockAnalyticPluginPrivate> dataPtr;
+  };
+}
+#endif
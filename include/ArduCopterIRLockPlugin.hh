@@ -30,6 +30,18 @@ namespace gazebo
   class ArduCopterIRLockPluginPrivate;
 
   /// \brief A camera sensor plugin for fiducial detection
+  ///
+  /// <fiducial>      visual name of a beacon, repeated for each beacon
+  /// <irlock_addr>   address targets are sent to, 127.0.0.1
+  /// <irlock_port>   port targets are sent to, 9005
+  /// <irlock_packet> target (default) sends one irlockPacket per visible
+  ///                 beacon, frame one packet per camera frame with every
+  ///                 visible beacon and a frame sequence number
+  /// <detectionRate> detections per second of sim time, lower than the
+  ///                 camera rate, 0 (default) for every frame
+  /// <occlusionCacheTime> seconds an occlusion result is reused while its
+  ///                 beacon moves less than 2 pixels in the image, saving
+  ///                 the id pass, 0 (default) to test every detection
   class GAZEBO_VISIBLE ArduCopterIRLockPlugin : public SensorPlugin
   {
     /// \brief Constructor
@@ -51,12 +63,9 @@ namespace gazebo
         unsigned int _width, unsigned int _height, unsigned int _depth,
         const std::string &_format);
 
-    /// \brief Publish the result
-    /// \param[in] _name Name of fiducial
-    /// \param[in] _x x position in image
-    /// \param[in] _y y position in image
-    public: virtual void Publish(const std::string &_fiducial, unsigned int _x,
-        unsigned int _y);
+    /// \brief Publish the targets found in the last frame, one packet
+    /// per target, or one frame packet with irlock_packet frame
+    public: virtual void Publish();
 
     /// \internal
     /// \brief Pointer to private data.
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTBRIDGE_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTBRIDGE_HH_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <memory>
+#include <gazebo/common/SingletonT.hh>
+
+namespace gazebo
+{
+  // Forward declare private data class
+  class ArduPilotBridgePrivate;
+
+  /// \brief Process-wide receiver of ArduPilot servo packets.
+  ///
+  /// A single I/O thread waits on the servo sockets of every registered
+  /// vehicle with epoll, drains them as soon as packets land and keeps the
+  /// newest packet of each vehicle ready for its plugin. The world update
+  /// thread only consumes ready commands, so with N vehicles the step time
+  /// follows the slowest vehicle instead of the sum of N blocking receives.
+  ///
+  /// Only available on Linux, Register fails elsewhere.
+  class ArduPilotBridge : public common::SingletonT<ArduPilotBridge>
+  {
+    /// \brief Constructor.
+    private: ArduPilotBridge();
+
+    /// \brief Destructor.
+    private: virtual ~ArduPilotBridge();
+
+    /// \brief Start servicing a non-blocking datagram socket.
+    /// The socket must not be read by anyone else until Unregister.
+    /// \param[in] _fd Socket handle.
+    /// \param[in] _packetSize Maximum size of a packet.
+    /// \return Vehicle id, -1 on failure.
+    public: int Register(const int _fd, const size_t _packetSize);
+
+    /// \brief Stop servicing a vehicle.
+    /// \param[in] _id Vehicle id returned by Register.
+    public: void Unregister(const int _id);
+
+    /// \brief Consume the newest packet received for a vehicle.
+    /// \param[in] _id Vehicle id returned by Register.
+    /// \param[out] _buf Buffer that receives the packet.
+    /// \param[in] _size Size of the buffer.
+    /// \param[in] _timeoutMs Milliseconds to wait for a packet.
+    /// \param[out] _dropped Number of packets received since the last
+    /// call and superseded by the returned one.
+    /// \return Size of the packet, -1 if none arrived in time.
+    public: ssize_t Recv(const int _id, void *_buf, const size_t _size,
+        const uint32_t _timeoutMs, unsigned int &_dropped);
+
+    /// \brief I/O thread loop.
+    private: void Run();
+
+    /// \brief Private data pointer.
+    private: std::unique_ptr<ArduPilotBridgePrivate> dataPtr;
+
+    /// \brief This is a singleton class.
+    private: friend class common::SingletonT<ArduPilotBridge>;
+  };
+}
+#endif
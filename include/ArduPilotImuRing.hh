@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTIMURING_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTIMURING_HH_
+
+#include <atomic>
+#include <cstdint>
+#include "include/ArduPilotProtocol.hh"
+
+namespace gazebo
+{
+  /// \brief Lock-free single-producer / single-consumer ring of imu
+  /// samples, filled by the sensor thread and emptied by the physics
+  /// thread when it sends a state packet.
+  ///
+  /// A sample pushed while the ring is full is dropped and counted, the
+  /// sensor thread never waits.
+  class ArduPilotImuRing
+  {
+    /// \brief Queue a sample, producer only.
+    /// \param[in] _sample Imu sample.
+    /// \return False if the ring was full and the sample dropped.
+    public: bool Push(const ImuBatchSample &_sample)
+    {
+      const uint32_t pushed = this->head.load(std::memory_order_relaxed);
+      if (pushed - this->tail.load(std::memory_order_acquire) >= kCapacity)
+      {
+        this->overflows.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      this->samples[pushed % kCapacity] = _sample;
+      this->head.store(pushed + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// \brief Oldest queued sample, consumer only.
+    /// \return Null if the ring is empty.
+    public: const ImuBatchSample *Front() const
+    {
+      const uint32_t popped = this->tail.load(std::memory_order_relaxed);
+      if (popped == this->head.load(std::memory_order_acquire))
+      {
+        return nullptr;
+      }
+      return &this->samples[popped % kCapacity];
+    }
+
+    /// \brief Release the sample returned by Front, consumer only.
+    public: void Pop()
+    {
+      this->tail.store(this->tail.load(std::memory_order_relaxed) + 1,
+          std::memory_order_release);
+    }
+
+    /// \brief Number of samples dropped because the ring was full.
+    public: uint64_t Overflows() const
+    {
+      return this->overflows.load(std::memory_order_relaxed);
+    }
+
+    /// \brief Number of samples the ring holds, a power of two.
+    public: static const uint32_t kCapacity = 64;
+
+    /// \brief Number of samples ever pushed, written by the producer.
+    private: std::atomic<uint32_t> head{0};
+
+    /// \brief Number of samples ever popped, written by the consumer.
+    private: std::atomic<uint32_t> tail{0};
+
+    /// \brief Number of samples dropped, written by the producer.
+    private: std::atomic<uint64_t> overflows{0};
+
+    /// \brief Sample storage.
+    private: ImuBatchSample samples[kCapacity];
+  };
+}
+#endif
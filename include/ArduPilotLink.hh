@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTLINK_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTLINK_HH_
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "include/ArduPilotProtocol.hh"
+#include "include/ArduPilotSocket.hh"
+
+namespace gazebo
+{
+  // Forward declare the transports
+  class ArduPilotShm;
+  class ArduPilotSender;
+
+  /// \brief State packet with room for a trailing imu batch, right after
+  /// the fields of the fdm_version in use
+  struct ArduPilotStateBuffer
+  {
+    /// \brief State packet
+    fdmPacketExt pkt;
+
+    /// \brief Room for the imu batch after an extended packet
+    uint8_t tail[kFdmPacketMaxSize - sizeof(fdmPacketExt)];
+  };
+
+  /// \brief Packet exchange with ArduPilot SITL, without any Gazebo
+  /// dependency: servo packet receive, drain, parse and frame ordering,
+  /// state packet layout and send, over UDP, shared memory, the shared
+  /// ArduPilotBridge or the ArduPilotSender thread.
+  ///
+  /// ArduPilotPlugin runs one per vehicle on the physics thread, and
+  /// ArduPilotBench drives the same class without Gazebo.
+  class ArduPilotLink
+  {
+    /// \brief Constructor.
+    public: ArduPilotLink();
+
+    /// \brief Destructor, stops the sender and leaves the bridge before
+    /// closing the transport.
+    public: ~ArduPilotLink();
+
+    /// \brief Exchange packets over UDP.
+    /// \param[in] _listenAddr Address servo packets are received on.
+    /// \param[in] _portIn Port servo packets are received on.
+    /// \param[in] _fdmAddr Address state packets are sent to.
+    /// \param[in] _portOut Port state packets are sent to.
+    /// \return False if a socket could not be set up.
+    public: bool OpenUdp(const std::string &_listenAddr,
+        const uint16_t _portIn, const std::string &_fdmAddr,
+        const uint16_t _portOut);
+
+    /// \brief Exchange packets over shared memory, gazebo side.
+    /// \param[in] _name Shared memory object name.
+    /// \return False if the object could not be created.
+    public: bool OpenShm(const std::string &_name);
+
+    /// \brief Receive the servo packets on the process-wide
+    /// ArduPilotBridge I/O thread. UDP only, after OpenUdp.
+    /// \return False if the bridge is not available.
+    public: bool UseBridge();
+
+    /// \brief Send the state packets from an ArduPilotSender thread.
+    public: void UseSender();
+
+    /// \brief Wait for a servo packet and keep the newest queued one.
+    /// \param[in] _timeoutMs Milliseconds to wait.
+    /// \return Size of the packet in ServoPacket(), -1 if none arrived.
+    public: ssize_t Receive(const uint32_t _timeoutMs);
+
+    /// \brief Take a servo packet that did not come from the transport,
+    /// e.g. a replayed one, as if it was received.
+    /// \param[in] _buf Packet.
+    /// \param[in] _size Size of the packet.
+    /// \return Size of the packet in ServoPacket(), -1 if too large.
+    public: ssize_t Inject(const void *_buf, const size_t _size);
+
+    /// \brief Last received servo packet.
+    public: const uint8_t *ServoPacket() const;
+
+    /// \brief Number of queued servo packets the last Receive dropped in
+    /// favour of a newer one.
+    public: unsigned int Drained() const;
+
+    /// \brief Parse the last received servo packet, the servo packet
+    /// layout follows whatever ArduPilot sends.
+    /// \param[in] _size Size returned by Receive or Inject.
+    /// \param[out] _servo View of the packet, valid until the next
+    /// Receive or Inject.
+    /// \return False if the packet is malformed or of an unsupported
+    /// version.
+    public: bool Parse(const ssize_t _size, ServoCommand &_servo);
+
+    /// \brief Check the frame number of a parsed packet against the last
+    /// accepted one, and count the frames lost in between.
+    /// \param[in] _servo Packet returned by Parse.
+    /// \return False for a duplicate or reordered versioned frame, which
+    /// must not be applied.
+    public: bool Accept(const ServoCommand &_servo);
+
+    /// \brief True if the last Parse saw ArduPilot switch servo packet
+    /// layout.
+    public: bool VersionChanged() const;
+
+    /// \brief Servo packet layout used by ArduPilot, 0 for legacy, -1
+    /// until the first packet.
+    public: int ServoPacketVersion() const;
+
+    /// \brief Forget the last frame number, the next versioned frame is
+    /// accepted whatever its number. For a reconnect.
+    public: void ResetFrames();
+
+    /// \brief State packet, filled in place by the caller.
+    public: fdmPacketExt &State();
+
+    /// \brief Lay out the state packet for an fdm_version, with an imu
+    /// batch right after its fields.
+    /// \param[in] _fdmVersion 1 for fdmPacket, 2 for fdmPacketExt.
+    /// \param[in] _samples Imu batch, oldest first, null for no batch.
+    /// \param[in] _count Number of samples, at most kImuBatchMaxSamples.
+    /// \return Size of the packet.
+    public: size_t FinishState(const int _fdmVersion,
+        const ImuBatchSample *_samples, const uint16_t _count);
+
+    /// \brief Send the state packet.
+    /// \param[in] _size Size returned by FinishState.
+    public: void SendState(const size_t _size);
+
+    /// \brief Total number of servo packets received.
+    public: uint64_t Received() const;
+
+    /// \brief Total number of stale servo packets drained and dropped.
+    public: uint64_t Dropped() const;
+
+    /// \brief Versioned servo frames that never arrived.
+    public: uint64_t FramesLost() const;
+
+    /// \brief Versioned servo frames received late or twice.
+    public: uint64_t FramesOutOfOrder() const;
+
+    /// \brief True if the state packets are sent from an ArduPilotSender
+    /// thread.
+    public: bool Async() const;
+
+    /// \brief State packets replaced before the sender thread sent them,
+    /// 0 without UseSender.
+    public: uint64_t Coalesced() const;
+
+    /// \brief Send a packet on the transport.
+    /// \param[in] _buf Packet.
+    /// \param[in] _size Size of the packet.
+    private: void Send(const void *_buf, const size_t _size);
+
+    /// \brief Socket servo packets are received on
+    private: ArduPilotSocketPrivate socketIn;
+
+    /// \brief Socket state packets are sent on
+    private: ArduPilotSocketPrivate socketOut;
+
+    /// \brief Shared memory transport, replaces the sockets when set
+    private: std::unique_ptr<ArduPilotShm> shm;
+
+    /// \brief Sender thread when set, destroyed before the transport
+    private: std::unique_ptr<ArduPilotSender> sender;
+
+    /// \brief Id in the shared ArduPilotBridge, -1 when not used
+    private: int bridgeId = -1;
+
+    /// \brief Servo packet receive buffer
+    private: uint8_t servoBuffer[kServoPacketMaxSize];
+
+    /// \brief State packet, sent from the beginning
+    private: ArduPilotStateBuffer state;
+
+    /// \brief Packets drained by the last Receive
+    private: unsigned int drained = 0;
+
+    /// \brief Servo packet layout, 0 for legacy, -1 until the first one
+    private: int servoPacketVersion = -1;
+
+    /// \brief True if the last Parse changed servoPacketVersion
+    private: bool versionChanged = false;
+
+    /// \brief True once lastFrame holds a received frame number
+    private: bool frameValid = false;
+
+    /// \brief Frame number of the last accepted versioned servo packet
+    private: uint32_t lastFrame = 0;
+
+    /// \brief Total number of servo packets received
+    private: uint64_t received = 0;
+
+    /// \brief Total number of servo packets drained and dropped
+    private: uint64_t dropped = 0;
+
+    /// \brief Versioned servo frames that never arrived
+    private: uint64_t framesLost = 0;
+
+    /// \brief Versioned servo frames received late or twice
+    private: uint64_t framesOutOfOrder = 0;
+  };
+}
+#endif
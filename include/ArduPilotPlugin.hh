@@ -17,6 +17,7 @@
 #ifndef GAZEBO_PLUGINS_ARDUPILOTPLUGIN_HH_
 #define GAZEBO_PLUGINS_ARDUPILOTPLUGIN_HH_
 
+#include <chrono>
 #include <sdf/sdf.hh>
 #include <gazebo/common/common.hh>
 #include <gazebo/physics/physics.hh>
@@ -26,6 +27,10 @@ namespace gazebo
   // Forward declare private data class
   class ArduPilotSocketPrivate;
   class ArduPilotPluginPrivate;
+  struct fdmPacket;
+  enum class ConnectionState : uint8_t;
+  enum class ArduPilotRecordType : uint32_t;
+  struct ArduPilotRecord;
 
   /// \brief Interface ArduPilot from ardupilot stack
   /// modeled after SITL/SIM_*
@@ -36,7 +41,8 @@ namespace gazebo
   ///    channel            attribute, ardupilot control channel
   ///    multiplier         command multiplier
   ///    <!-- output to Gazebo -->
-  ///    type               type of control, VELOCITY, POSITION or EFFORT
+  ///    type               type of control, VELOCITY, POSITION, EFFORT or
+  ///                       ROTOR (virtual rotor, see below)
   ///    <p_gain>           velocity pid p gain
   ///    <i_gain>           velocity pid i gain
   ///    <d_gain>           velocity pid d gain
@@ -46,12 +52,105 @@ namespace gazebo
   ///    <cmd_min>          velocity pid min command torque
   ///    <jointName>        motor joint, torque applied here
   ///    <turningDirection> rotor turning direction, 'cw' or 'ccw'
-  ///    frequencyCutoff    filter incoming joint state
-  ///    samplingRate       sampling rate for filtering incoming joint state
+  ///    frequencyCutoff    low pass the joint state fed to the pid, Hz
+  ///    samplingRate       filter sampling rate, defaults to controlRate
   ///    <rotorVelocitySlowdownSim> for rotor aliasing problem, experimental
+  ///    <!-- ROTOR only: the command is the rotor velocity target in rad/s,
+  ///         no joint is needed, nothing spins -->
+  ///    <linkName>         link receiving thrust and drag torque
+  ///    <rotorPose>        rotor pose in the link frame, thrust along z
+  ///    <motorConstant>    thrust per squared rotor velocity, N/(rad/s)^2
+  ///    <momentConstant>   drag torque per thrust, m
+  ///    <timeConstantUp>   motor spin up time constant, s
+  ///    <timeConstantDown> motor spin down time constant, s
+  ///    <maxRotVelocity>   rotor velocity limit, rad/s
+  ///    <rotorDragCoefficient> in-plane drag per rotor velocity per in-plane
+  ///                       airspeed, N s^2/(rad m), 0 by default
+  ///    <rollingMomentCoefficient> blade flapping moment per rotor velocity
+  ///                       per in-plane airspeed, N s^2/rad, 0 by default
+  /// <instance>          index of the vehicle in the world, 0 by default.
+  ///                     $ARDUPILOT_GAZEBO_INSTANCE, the offset of the
+  ///                     whole world, is added to it, and fdm_port_in and
+  ///                     fdm_port_out shift by instancePortStride * the
+  ///                     sum, like SITL -I
+  /// <instancePortStride> port shift per instance, 10. In a world of N
+  ///                     vehicles 10 ports apart and without <instance>,
+  ///                     set it to 10 * N in every plugin block so an
+  ///                     offset moves all of them, vehicle k of offset n
+  ///                     then uses the ports of SITL -I (n * N + k). Load
+  ///                     fails if a port would pass 65535
+  /// <fdm_transport>     udp (default), or shm to exchange packets with
+  ///                     ArduPilot through shared memory on the same host
+  /// <fdm_shm_name>      shared memory name, /ardupilot_gazebo_<fdm_port_in>
+  /// <fdm_rate>          Hz, exchange packets with ArduPilot every n-th
+  ///                     physics step only, 0 (default) for every step
+  /// <controlRate>       Hz, run the motor controllers every n-th physics
+  ///                     step only and hold their output in between,
+  ///                     0 (default) for every step
   /// <imuName>     scoped name for the imu sensor
-  /// <connectionTimeoutMaxCount> timeout before giving up on
-  ///                             controller synchronization
+  /// <imuMode>     sensor (default) sends what the imu last measured,
+  ///               step the newest sample measured by the end of the step,
+  ///               batch also appends an ImuBatchHeader and every sample
+  ///               measured since the previous state packet,
+  ///               kinematic computes the imu from the imu link state at
+  ///               every exchange, without the sensor, see below
+  /// <imuLinkName> kinematic imu link, defaults to the imu sensor parent,
+  ///               or the canonical link without imu sensor
+  /// <imuPose>     kinematic imu pose in the link frame, defaults to the
+  ///               imu sensor pose
+  /// <imuAccelNoise> accelerometer white noise stddev, m/s^2, 0
+  /// <imuGyroNoise>  gyro white noise stddev, rad/s, 0
+  /// <imuAccelBias>  accelerometer constant bias, m/s^2, 0 0 0
+  /// <imuGyroBias>   gyro constant bias, rad/s, 0 0 0
+  /// <imuAccelBiasStd> accelerometer Gauss-Markov bias stddev, m/s^2, 0
+  /// <imuAccelBiasTau> accelerometer Gauss-Markov bias time constant, s,
+  ///                   100
+  /// <imuGyroBiasStd>  gyro Gauss-Markov bias stddev, rad/s, 0
+  /// <imuGyroBiasTau>  gyro Gauss-Markov bias time constant, s, 100
+  /// <imuAccelVibration> accelerometer vibration amplitude per rotor at
+  ///                     vibrationRefVelocity, m/s^2, 0 0 0
+  /// <imuGyroVibration>  gyro vibration amplitude per rotor at
+  ///                     vibrationRefVelocity, rad/s, 0 0 0
+  /// <vibrationRefVelocity> rotor velocity of the vibration amplitudes,
+  ///                        which scale with its square, rad/s, 1000
+  /// <imuNoiseSeed>  imu error seed, 0
+  /// <statsPeriod> seconds between hot path statistics reports: per phase
+  ///               latency p50/p99/max, packet counters and real time
+  ///               factor. 0 (default) disables instrumentation.
+  /// <statsTopic>  topic of the reports, ~/<model>/ardupilot_stats
+  /// <statsFile>   optional csv file the reports are appended to
+  /// <fdm_version> 1 (default) legacy state packet, 2 extended state
+  ///               packet with gps, rangefinder and airspeed
+  /// <gpsName>     scoped name for the gps sensor, fdm_version 2
+  /// <rangefinderName> scoped name for the rangefinder, fdm_version 2
+  /// <connectionTimeoutMaxCount> missed servo packets in degraded state
+  ///                             before giving up on controller
+  ///                             synchronization, 10
+  /// <lockstep>          block every step until the servo packet arrives,
+  ///                     do not sleep while ArduPilot is offline
+  /// <lockstepTimeoutMs> max wait for a servo packet once online, 1000 ms
+  /// <offlineTimeoutMs>  max wait for a servo packet while offline,
+  ///                     1 ms, or 0 ms in lockstep
+  /// <handshakeFrames>   servo packets in a row confirming ArduPilot is
+  ///                     online, 2
+  /// <degradedTimeoutMs> max wait for a servo packet after one was missed,
+  ///                     the last command keeps being applied, 10 ms
+  /// <degradedWallTimeout> wall seconds without servo packets before
+  ///                     going offline, 1, 0 for no deadline
+  /// <degradedSimTimeout> sim seconds without servo packets before going
+  ///                     offline, 0 for no deadline
+  /// <asyncSend>         send state packets from a dedicated thread, the
+  ///                     physics step never waits on the socket
+  /// <sharedBridge>      receive servo packets on the process-wide
+  ///                     ArduPilotBridge I/O thread, for multi-vehicle worlds
+  /// <recordFile>        log every servo packet received, state packet
+  ///                     sent and connection state transition to this
+  ///                     binary file
+  /// <replayFile>        feed the servo packets of a recordFile back
+  ///                     instead of talking to ArduPilot, and compare the
+  ///                     state packets with the recorded ones. The
+  ///                     degradedWallTimeout deadline is taken from the
+  ///                     recorded connection state transitions
   class GAZEBO_VISIBLE ArduPilotPlugin : public ModelPlugin
   {
     /// \brief Constructor.
@@ -67,18 +166,112 @@ namespace gazebo
     /// \param[in] _info Update information provided by the server.
     private: void OnUpdate();
 
+    /// \brief Publish hot path statistics once per statsPeriod.
+    /// \param[in] _simTime Current sim time.
+    private: void PublishStats(const common::Time &_simTime);
+
     /// \brief Update PID Joint controllers.
     /// \param[in] _dt time step size since last update.
     private: void ApplyMotorForces(const double _dt);
 
+    /// \brief Apply the last controller outputs again, between two
+    /// controller updates.
+    private: void HoldMotorForces();
+
+    /// \brief Integrate the virtual rotor motor models and compute the
+    /// rotor aerodynamics.
+    /// \param[in] _dt time since the last controller update.
+    private: void UpdateRotors(const double _dt);
+
+    /// \brief Apply the virtual rotor thrust and torque to their links.
+    private: void ApplyRotorForces();
+
+    /// \brief Physics steps per update of a process running at _rate.
+    /// \param[in] _stepSize Physics step size in seconds.
+    /// \param[in] _rate Process rate in Hz, 0 for every step.
+    /// \param[in] _name Sdf parameter name, for log messages.
+    /// \return Decimation, at least 1.
+    private: unsigned int Decimation(const double _stepSize,
+        const double _rate, const std::string &_name) const;
+
     /// \brief Reset PID Joint controllers.
     private: void ResetPIDs();
 
     /// \brief Receive motor commands from ArduPilot
-    private: void ReceiveMotorCommand();
+    /// \param[in] _simTime Current sim time.
+    private: void ReceiveMotorCommand(const common::Time &_simTime);
+
+    /// \brief Find the imu link and mounting of the kinematic imu.
+    /// \param[in] _sdf Plugin sdf.
+    /// \return False if there is no imu link.
+    private: bool InitKinematicImu(sdf::ElementPtr _sdf);
+
+    /// \brief Compute the imu fields of the state packet from the imu
+    /// link state.
+    /// \param[in] _simTime Current sim time.
+    /// \param[out] _pkt State packet.
+    private: void KinematicImu(const common::Time &_simTime,
+        fdmPacket &_pkt);
+
+    /// \brief Take the imu samples measured up to this step from the
+    /// sensor queue, keep the newest and batch them for imuMode batch.
+    /// \param[in] _simTime Current sim time.
+    private: void TakeImuSamples(const common::Time &_simTime);
+
+    /// \brief Discard the imu samples measured up to this step while
+    /// OFFLINE, only the newest is held.
+    /// \param[in] _simTime Current sim time.
+    private: void DropImuSamples(const common::Time &_simTime);
+
+    /// \brief Add the configured sensor errors to the imu fields of the
+    /// state packet, and to every sample of the imu batch.
+    /// \param[in] _simTime Current sim time.
+    /// \param[in,out] _pkt State packet.
+    private: void ApplyImuErrors(const common::Time &_simTime,
+        fdmPacket &_pkt);
+
+    /// \brief Log a packet, reports the first one that cannot be logged.
+    /// \param[in] _type Kind of packet.
+    /// \param[in] _simTime Current sim time.
+    /// \param[in] _buf Packet.
+    /// \param[in] _size Size of the packet.
+    private: void Record(const ArduPilotRecordType _type,
+        const common::Time &_simTime, const void *_buf, const size_t _size);
+
+    /// \brief Read the next replayed packet.
+    /// \param[in] _type Kind of packet expected.
+    /// \param[in] _simTime Current sim time.
+    /// \param[out] _record Replayed packet.
+    /// \return False once the replay is over or out of sync.
+    private: bool NextRecord(const ArduPilotRecordType _type,
+        const common::Time &_simTime, ArduPilotRecord &_record);
+
+    /// \brief Check the next replayed packet is a transition of the
+    /// recording to a connection state.
+    /// \param[in] _state Connection state.
+    /// \return True if the recording moved to _state at this point.
+    private: bool RecordedTransition(const ConnectionState _state) const;
+
+    /// \brief Move the connection state machine to a new state, record
+    /// the transition or check it against the replayed one.
+    /// \param[in] _state New state.
+    /// \param[in] _simTime Current sim time.
+    private: void SetConnectionState(const ConnectionState _state,
+        const common::Time &_simTime);
+
+    /// \brief Handle a servo packet that did not arrive in time.
+    /// \param[in] _simTime Current sim time.
+    private: void ServoTimeout(const common::Time &_simTime);
 
     /// \brief Send state to ArduPilot
-    private: void SendState() const;
+    /// \param[in] _simTime Current sim time, the packet timestamp.
+    private: void SendState(const common::Time &_simTime);
+
+    /// \brief Accumulate wall time spent waiting for ArduPilot and
+    /// periodically report it.
+    /// \param[in] _stall Time spent waiting for the last servo packet.
+    private: void AccountStallTime(
+        const std::chrono::steady_clock::duration _stall);
 
     /// \brief Init ardupilot socket
     private: bool InitArduPilotSockets(sdf::ElementPtr _sdf) const;
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTPROTOCOL_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTPROTOCOL_HH_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <cstring>
+
+#define MAX_MOTORS 255
+
+namespace gazebo
+{
+  /// \brief A servo packet, legacy layout.
+  struct ServoPacket
+  {
+    /// \brief Motor speed data.
+    /// should rename to servo_command here and in ArduPilot SIM_Gazebo.cpp
+    float motorSpeed[MAX_MOTORS] = {0.0f};
+  };
+
+  /// \brief Magic number starting a versioned servo packet.
+  /// As a float it is a NaN, which is never a valid command, so it can not
+  /// be mistaken for the first channel of a legacy ServoPacket.
+  static const uint32_t kServoPacketMagic = 0x7fa5a7e0;
+
+  /// \brief Current version of the versioned servo packet.
+  static const uint16_t kServoPacketVersion = 1;
+
+  /// \brief Header of a versioned servo packet, followed by channelCount
+  /// float commands. Only the channels in use are sent.
+  struct ServoPacketHeader
+  {
+    /// \brief kServoPacketMagic
+    uint32_t magic;
+
+    /// \brief kServoPacketVersion
+    uint16_t version;
+
+    /// \brief Number of channels following the header
+    uint16_t channelCount;
+
+    /// \brief Frame sequence number, incremented for every packet sent
+    uint32_t frameCount;
+  };
+
+  static_assert(sizeof(ServoPacketHeader) == 12,
+      "ServoPacketHeader is a wire format, it must not be padded");
+
+  /// \brief Largest servo packet, in either layout.
+  static const size_t kServoPacketMaxSize =
+    sizeof(ServoPacketHeader) + sizeof(ServoPacket);
+
+  /// \brief View of a received servo packet, in either layout.
+  struct ServoCommand
+  {
+    /// \brief Read a channel.
+    /// \param[in] _channel Channel index, less than channelCount.
+    /// \return The channel command.
+    public: float Channel(const unsigned int _channel) const
+    {
+      float value;
+      memcpy(&value, this->data + _channel * sizeof(float), sizeof(value));
+      return value;
+    }
+
+    /// \brief First channel
+    public: const uint8_t *data = nullptr;
+
+    /// \brief Number of channels received
+    public: uint16_t channelCount = 0;
+
+    /// \brief True for a versioned packet, false for a legacy one
+    public: bool versioned = false;
+
+    /// \brief Frame sequence number, versioned packets only
+    public: uint32_t frameCount = 0;
+  };
+
+  /// \brief Decode a servo packet.
+  /// \param[in] _buf Received packet.
+  /// \param[in] _size Size of the received packet.
+  /// \param[out] _cmd View of the packet, valid as long as _buf.
+  /// \return False if the packet is versioned but malformed or of an
+  /// unsupported version.
+  inline bool ParseServoPacket(const void *_buf, const size_t _size,
+      ServoCommand &_cmd)
+  {
+    const uint8_t *buf = static_cast<const uint8_t *>(_buf);
+
+    uint32_t magic = 0;
+    if (_size >= sizeof(ServoPacketHeader))
+    {
+      memcpy(&magic, buf, sizeof(magic));
+    }
+
+    if (magic != kServoPacketMagic)
+    {
+      _cmd.data = buf;
+      _cmd.channelCount = static_cast<uint16_t>(_size / sizeof(float));
+      _cmd.versioned = false;
+      _cmd.frameCount = 0;
+      return true;
+    }
+
+    ServoPacketHeader header;
+    memcpy(&header, buf, sizeof(header));
+    if (header.version != kServoPacketVersion ||
+        header.channelCount > MAX_MOTORS ||
+        _size < sizeof(header) + header.channelCount * sizeof(float))
+    {
+      return false;
+    }
+
+    _cmd.data = buf + sizeof(header);
+    _cmd.channelCount = header.channelCount;
+    _cmd.versioned = true;
+    _cmd.frameCount = header.frameCount;
+    return true;
+  }
+
+  /// \brief Flight Dynamics Model packet that is sent back to the ArduPilot
+  struct fdmPacket
+  {
+    /// \brief packet timestamp
+    double timestamp;
+
+    /// \brief IMU angular velocity
+    double imuAngularVelocityRPY[3];
+
+    /// \brief IMU linear acceleration
+    double imuLinearAccelerationXYZ[3];
+
+    /// \brief IMU quaternion orientation
+    double imuOrientationQuat[4];
+
+    /// \brief Model velocity in NED frame
+    double velocityXYZ[3];
+
+    /// \brief Model position in NED frame
+    double positionXYZ[3];
+  };
+
+  /// \brief Extended Flight Dynamics Model packet, fdm_version 2.
+  /// Starts with the fdmPacket fields, receivers tell them apart by size.
+  struct fdmPacketExt : public fdmPacket
+  {
+    /// \brief Model latitude in WGS84 system
+    double latitude = 0.0;
+
+    /// \brief Model longitude in WGS84 system
+    double longitude = 0.0;
+
+    /// \brief Model altitude from GPS
+    double altitude = 0.0;
+
+    /// \brief Model estimated from airspeed sensor (e.g. Pitot) in m/s
+    double airspeed = 0.0;
+
+    /// \brief Battery voltage. Default to -1 to use sitl estimator.
+    double battery_voltage = -1.0;
+
+    /// \brief Battery Current.
+    double battery_current = 0.0;
+
+    /// \brief Model rangefinder value. Default to -1 to use sitl rangefinder.
+    double rangefinder = -1.0;
+  };
+
+  static_assert(sizeof(fdmPacket) == 17 * sizeof(double) &&
+      sizeof(fdmPacketExt) == 24 * sizeof(double),
+      "fdmPacket is a wire format, it must not be padded");
+
+  /// \brief Magic number starting an imu batch
+  static const uint32_t kImuBatchMagic = 0x42554d49;
+
+  /// \brief Current version of the imu batch
+  static const uint16_t kImuBatchVersion = 1;
+
+  /// \brief Most imu samples in a batch
+  static const uint16_t kImuBatchMaxSamples = 32;
+
+  /// \brief Header of an imu batch, appended to a state packet with
+  /// imuMode batch, followed by sampleCount ImuBatchSample, oldest first.
+  struct ImuBatchHeader
+  {
+    /// \brief kImuBatchMagic
+    uint32_t magic;
+
+    /// \brief kImuBatchVersion
+    uint16_t version;
+
+    /// \brief Number of samples following the header
+    uint16_t sampleCount;
+  };
+
+  /// \brief An imu sample, in the frames of the state packet fields
+  struct ImuBatchSample
+  {
+    /// \brief Sim time of the measurement
+    double timestamp;
+
+    /// \brief IMU angular velocity
+    double imuAngularVelocityRPY[3];
+
+    /// \brief IMU linear acceleration
+    double imuLinearAccelerationXYZ[3];
+  };
+
+  static_assert(sizeof(ImuBatchHeader) == 8 &&
+      sizeof(ImuBatchSample) == 7 * sizeof(double),
+      "ImuBatchSample is a wire format, it must not be padded");
+
+  /// \brief Largest state packet, extended and with a full imu batch.
+  static const size_t kFdmPacketMaxSize = sizeof(fdmPacketExt) +
+    sizeof(ImuBatchHeader) + kImuBatchMaxSamples * sizeof(ImuBatchSample);
+}
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTRECORDER_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTRECORDER_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace gazebo
+{
+  // Forward declare file layout
+  struct ArduPilotRecordHeader;
+  struct ArduPilotRecordFile;
+
+  /// \brief Kind of a recorded packet
+  enum class ArduPilotRecordType : uint32_t
+  {
+    /// \brief Servo packet received from ArduPilot, empty if none arrived
+    SERVO = 1,
+
+    /// \brief State packet sent to ArduPilot
+    STATE = 2,
+
+    /// \brief Connection state transition, the new state as a uint32_t
+    CONNECTION = 3
+  };
+
+  /// \brief A recorded packet, pointing into the mapped file
+  struct ArduPilotRecord
+  {
+    /// \brief Kind of packet
+    ArduPilotRecordType type;
+
+    /// \brief Sim time of the step the packet was exchanged
+    double simTime;
+
+    /// \brief Packet data
+    const uint8_t *data;
+
+    /// \brief Packet size, 0 for a missed servo packet
+    uint32_t size;
+  };
+
+  /// \brief Append-only binary log of the packets exchanged with ArduPilot.
+  ///
+  /// The log file is memory mapped and grown in large chunks, so recording
+  /// a packet is a copy into the page cache. The physics thread only makes
+  /// system calls when the log grows, which doubles its size and so
+  /// happens rarely. The committed size in the file header is updated
+  /// after every packet: a log left behind by a crashed gzserver is
+  /// readable up to the last packet.
+  ///
+  /// Only available on Linux, Open fails elsewhere.
+  class ArduPilotRecorder
+  {
+    /// \brief Constructor.
+    public: ArduPilotRecorder();
+
+    /// \brief Destructor, trim the file to the recorded size and close it.
+    public: ~ArduPilotRecorder();
+
+    /// \brief Create (or truncate) a log file.
+    /// \param[in] _path Log file path.
+    /// \return True on success.
+    public: bool Open(const std::string &_path);
+
+    /// \brief Append a packet.
+    /// \param[in] _type Kind of packet.
+    /// \param[in] _simTime Sim time of the step.
+    /// \param[in] _buf Packet data, may be null if _size is 0.
+    /// \param[in] _size Packet size.
+    /// \return False if the log could not grow, the packet is lost.
+    public: bool Write(const ArduPilotRecordType _type,
+        const double _simTime, const void *_buf, const size_t _size);
+
+    /// \brief Number of packets recorded.
+    public: uint64_t Count() const;
+
+    /// \brief Map the file with a new capacity.
+    /// \param[in] _capacity File size in bytes, not smaller than the
+    /// current one.
+    /// \return True on success, false with the current mapping kept.
+    private: bool Grow(const size_t _capacity);
+
+    /// \brief File descriptor, -1 when closed.
+    private: int fd = -1;
+
+    /// \brief Mapped file.
+    private: ArduPilotRecordFile *file = nullptr;
+
+    /// \brief Mapped size of the file.
+    private: size_t capacity = 0;
+  };
+
+  /// \brief Reads back a log written by ArduPilotRecorder.
+  ///
+  /// Only available on Linux, Open fails elsewhere.
+  class ArduPilotReplay
+  {
+    /// \brief Constructor.
+    public: ArduPilotReplay();
+
+    /// \brief Destructor, unmap the log.
+    public: ~ArduPilotReplay();
+
+    /// \brief Map a log file.
+    /// \param[in] _path Log file path.
+    /// \return True on success.
+    public: bool Open(const std::string &_path);
+
+    /// \brief Read the next packet.
+    /// \param[out] _record Next packet, valid until the replay is destroyed.
+    /// \return False at the end of the log.
+    public: bool Next(ArduPilotRecord &_record);
+
+    /// \brief Read the next packet without moving past it.
+    /// \param[out] _record Next packet, valid until the replay is destroyed.
+    /// \return False at the end of the log.
+    public: bool Peek(ArduPilotRecord &_record) const;
+
+    /// \brief Number of packets in the log.
+    public: uint64_t Count() const;
+
+    /// \brief Number of packets read so far.
+    public: uint64_t Position() const;
+
+    /// \brief Mapped file.
+    private: const ArduPilotRecordFile *file = nullptr;
+
+    /// \brief Mapped size.
+    private: size_t mapped = 0;
+
+    /// \brief End of the committed records, offset in the file.
+    private: size_t end = 0;
+
+    /// \brief Offset of the next record in the file.
+    private: size_t offset = 0;
+
+    /// \brief Number of packets read so far.
+    private: uint64_t position = 0;
+  };
+}
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTSENDER_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTSENDER_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace gazebo
+{
+  // Forward declare private data class
+  class ArduPilotSenderPrivate;
+
+  /// \brief Sends state packets to ArduPilot from its own thread, so a
+  /// slow or full socket never delays the physics step.
+  ///
+  /// The physics thread publishes a snapshot of the packet and returns.
+  /// Snapshots go through a lock-free single-producer / single-consumer
+  /// triple buffer: the producer writes its back slot and swaps it with
+  /// the pending slot, the sender thread swaps the pending slot with its
+  /// front slot and sends it. Neither side ever waits for the other; a
+  /// snapshot published before the previous one was picked up replaces
+  /// it and is counted as coalesced. The sender thread sleeps on a
+  /// condition variable, only notified when it is actually asleep.
+  class ArduPilotSender
+  {
+    /// \brief Function actually sending a packet.
+    public: using SendFunction = std::function<void(const void *, size_t)>;
+
+    /// \brief Constructor, starts the sender thread.
+    /// \param[in] _send Called from the sender thread for every packet.
+    /// \param[in] _maxSize Largest packet that will be published.
+    public: ArduPilotSender(const SendFunction &_send, const size_t _maxSize);
+
+    /// \brief Destructor, stops the sender thread. A snapshot still
+    /// pending is dropped.
+    public: ~ArduPilotSender();
+
+    /// \brief Hand a packet to the sender thread. Never blocks.
+    /// Only one thread may publish.
+    /// \param[in] _buf Packet.
+    /// \param[in] _size Size of the packet, at most _maxSize.
+    public: void Publish(const void *_buf, const size_t _size);
+
+    /// \brief Number of packets published.
+    public: uint64_t Published() const;
+
+    /// \brief Number of packets replaced by a newer one before being sent.
+    public: uint64_t Coalesced() const;
+
+    /// \brief Sender thread loop.
+    private: void Run();
+
+    /// \brief Private data pointer.
+    private: std::unique_ptr<ArduPilotSenderPrivate> dataPtr;
+  };
+}
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTSENSORERRORS_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTSENSORERRORS_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gazebo
+{
+  /// \brief Error model of one imu sensor, accelerometer or gyro.
+  /// All standard deviations and amplitudes in the sensor unit.
+  struct ImuErrorModel
+  {
+    /// \brief White noise standard deviation
+    double noise = 0.0;
+
+    /// \brief Constant bias, per axis
+    double bias[3] = {0.0, 0.0, 0.0};
+
+    /// \brief Stationary standard deviation of the Gauss-Markov bias
+    double biasStd = 0.0;
+
+    /// \brief Correlation time of the Gauss-Markov bias, s
+    double biasTau = 100.0;
+
+    /// \brief Vibration amplitude per axis, for a rotor at the reference
+    /// velocity. Scales with the square of the rotor velocity.
+    double vibration[3] = {0.0, 0.0, 0.0};
+  };
+
+  /// \brief Counter-based random numbers: the n-th number of a stream is
+  /// a hash of (seed, n), so a run is reproducible from its seed whatever
+  /// is drawn in between, and a batch of numbers is independent lanes of
+  /// plain integer arithmetic the compiler can vectorize.
+  class CounterRandom
+  {
+    /// \brief Number of lanes of a batch.
+    public: static const unsigned int kLanes = 8;
+
+    /// \brief Constructor.
+    /// \param[in] _seed Stream seed.
+    public: explicit CounterRandom(const uint32_t _seed = 0);
+
+    /// \brief Standard normal numbers of one counter value.
+    /// \param[in] _counter Counter, a new value for every batch.
+    /// \param[out] _normals 2 * kLanes standard normal numbers.
+    public: void Normals(const uint64_t _counter, double *_normals) const;
+
+    /// \brief Uniform number in [0, 1) of one counter value.
+    /// \param[in] _counter Counter.
+    /// \return Uniform number.
+    public: double Uniform(const uint64_t _counter) const;
+
+    /// \brief 32 bit integer hash with a good avalanche.
+    /// \param[in] _x Value to hash.
+    /// \return Hash.
+    public: static uint32_t Hash(uint32_t _x)
+    {
+      _x ^= _x >> 16;
+      _x *= 0x7feb352du;
+      _x ^= _x >> 15;
+      _x *= 0x846ca68bu;
+      _x ^= _x >> 16;
+      return _x;
+    }
+
+    /// \brief Key of the stream, a hash of the seed.
+    private: uint32_t key;
+  };
+
+  /// \brief Sensor error stage of the imu fields of the state packet:
+  /// white noise, constant and Gauss-Markov bias, and vibration correlated
+  /// with the rotor velocities.
+  ///
+  /// Every Apply draws the 12 normal numbers it needs (white noise and
+  /// bias drive of 6 axes) as a single CounterRandom batch.
+  class ArduPilotSensorErrors
+  {
+    /// \brief Constructor.
+    public: ArduPilotSensorErrors();
+
+    /// \brief Set the error models.
+    /// \param[in] _accel Accelerometer model, m/s^2.
+    /// \param[in] _gyro Gyro model, rad/s.
+    /// \param[in] _vibrationRefVelocity Rotor velocity of the vibration
+    /// amplitudes, rad/s.
+    /// \param[in] _seed Random seed.
+    public: void Configure(const ImuErrorModel &_accel,
+        const ImuErrorModel &_gyro, const double _vibrationRefVelocity,
+        const uint32_t _seed);
+
+    /// \brief True if any error is configured.
+    public: bool Enabled() const;
+
+    /// \brief True if vibration is configured, Apply then needs the rotor
+    /// velocities.
+    public: bool Vibrates() const;
+
+    /// \brief Add the errors to an imu measurement.
+    /// \param[in] _time Sim time of the measurement, s.
+    /// \param[in] _rotorVelocity Rotor velocities, rad/s.
+    /// \param[in] _rotorCount Number of rotors.
+    /// \param[in,out] _accel Linear acceleration.
+    /// \param[in,out] _gyro Angular velocity.
+    public: void Apply(const double _time, const double *_rotorVelocity,
+        const size_t _rotorCount, double *_accel, double *_gyro);
+
+    /// \brief Random numbers.
+    private: CounterRandom random;
+
+    /// \brief Number of batches drawn.
+    private: uint64_t counter = 0;
+
+    /// \brief Error models, accelerometer then gyro.
+    private: ImuErrorModel models[2];
+
+    /// \brief Inverse of the vibration reference velocity squared.
+    private: double vibrationScale = 1e-6;
+
+    /// \brief Gauss-Markov bias state, accelerometer xyz then gyro xyz.
+    private: double bias[6];
+
+    /// \brief Time of the previous Apply, negative before the first one.
+    private: double lastTime = -1.0;
+
+    /// \brief Step size biasPhi and biasDrive were computed for, negative
+    /// for the first sample.
+    private: double biasDt = -1.0;
+
+    /// \brief Gauss-Markov bias decay per step, accelerometer then gyro.
+    private: double biasPhi[2] = {0.0, 0.0};
+
+    /// \brief Gauss-Markov bias drive per step, accelerometer then gyro.
+    private: double biasDrive[2] = {0.0, 0.0};
+
+    /// \brief Rotor angles, rad.
+    private: std::vector<double> rotorAngle;
+
+    /// \brief Sine and cosine of the vibration phase of every rotor and
+    /// axis.
+    private: std::vector<double> rotorPhase;
+
+    /// \brief True if any error is configured.
+    private: bool enabled = false;
+
+    /// \brief True if vibration is configured.
+    private: bool vibrates = false;
+  };
+}
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTSHM_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTSHM_HH_
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace gazebo
+{
+  // Forward declare shared memory layout
+  struct ArduPilotShmRing;
+  struct ArduPilotShmLayout;
+
+  /// \brief Shared memory datagram transport between ArduPilot SITL and
+  /// ArduPilotPlugin, for SITL and gzserver running on the same host.
+  ///
+  /// A POSIX shared memory object holds two single-producer /
+  /// single-consumer rings, one per direction. Each ring slot carries one
+  /// packet, with the same semantics as the UDP sockets: a packet sent
+  /// while the ring is full is dropped, and a receiver can keep only the
+  /// newest queued packet. A blocked receiver sleeps on a futex, which
+  /// the sender only wakes when someone is actually waiting.
+  ///
+  /// Only available on Linux, Create and Open fail elsewhere.
+  class ArduPilotShm
+  {
+    /// \brief Constructor.
+    public: ArduPilotShm();
+
+    /// \brief Destructor, unmap the memory and unlink it if created here.
+    public: ~ArduPilotShm();
+
+    /// \brief Create (or reset) the shared memory, gazebo side.
+    /// \param[in] _name Shared memory object name, e.g. "/ardupilot_9002".
+    /// \return True on success.
+    public: bool Create(const std::string &_name);
+
+    /// \brief Open shared memory created by Create, ArduPilot side.
+    /// \param[in] _name Shared memory object name.
+    /// \return True on success.
+    public: bool Open(const std::string &_name);
+
+    /// \brief Send a packet.
+    /// \param[in] _buf Packet data.
+    /// \param[in] _size Packet size, at most kSlotSize.
+    /// \return _size on success, -1 if the packet was dropped.
+    public: ssize_t Send(const void *_buf, const size_t _size);
+
+    /// \brief Receive a packet, waiting if none is queued.
+    /// \param[out] _buf Buffer that receives the data.
+    /// \param[in] _size Size of the buffer.
+    /// \param[in] _timeoutMs Milliseconds to wait for data.
+    /// \return Size of the received packet, -1 if none arrived in time.
+    public: ssize_t Recv(void *_buf, const size_t _size,
+        const uint32_t _timeoutMs);
+
+    /// \brief Receive every queued packet and keep only the newest one.
+    /// \param[out] _buf Buffer that receives the newest packet, untouched if
+    /// nothing was queued.
+    /// \param[in] _size Size of the buffer.
+    /// \param[out] _count Number of packets received.
+    /// \return Size of the newest packet, -1 if nothing was queued.
+    public: ssize_t RecvLatest(void *_buf, const size_t _size,
+        unsigned int &_count);
+
+    /// \brief Maximum size of a packet.
+    public: static const size_t kSlotSize = 4096;
+
+    /// \brief Number of packets each ring can hold.
+    public: static const uint32_t kSlotCount = 16;
+
+    /// \brief Map the shared memory object.
+    /// \param[in] _name Shared memory object name.
+    /// \param[in] _create True to create and initialize it.
+    /// \return True on success.
+    private: bool Map(const std::string &_name, const bool _create);
+
+    /// \brief Mapped memory.
+    private: ArduPilotShmLayout *layout = nullptr;
+
+    /// \brief Ring this side receives from.
+    private: ArduPilotShmRing *inRing = nullptr;
+
+    /// \brief Ring this side sends to.
+    private: ArduPilotShmRing *outRing = nullptr;
+
+    /// \brief Name to unlink on destruction, empty if opened.
+    private: std::string unlinkName;
+  };
+}
+#endif
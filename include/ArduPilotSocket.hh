@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTSOCKET_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTSOCKET_HH_
+
+#include <fcntl.h>
+#ifdef _WIN32
+  #include <Winsock2.h>
+  #include <Ws2def.h>
+  #include <Ws2ipdef.h>
+  #include <Ws2tcpip.h>
+  using raw_type = char;
+#else
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <arpa/inet.h>
+  using raw_type = void;
+#endif
+
+#if defined(_MSC_VER)
+  #include <BaseTsd.h>
+  typedef SSIZE_T ssize_t;
+#endif
+
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace gazebo
+{
+  /// \brief Non-blocking UDP socket used by ArduPilotPlugin to exchange
+  /// servo and state packets with ArduPilot.
+  class ArduPilotSocketPrivate
+  {
+    /// \brief constructor
+    public: ArduPilotSocketPrivate()
+    {
+      // initialize socket udp socket
+      fd = socket(AF_INET, SOCK_DGRAM, 0);
+      #ifndef _WIN32
+      // Windows does not support FD_CLOEXEC
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      #endif
+    }
+
+    /// \brief destructor
+    public: ~ArduPilotSocketPrivate()
+    {
+      if (fd != -1)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+
+    /// \brief Bind to an adress and port
+    /// \param[in] _address Address to bind to.
+    /// \param[in] _port Port to bind to.
+    /// \return True on success.
+    public: bool Bind(const char *_address, const uint16_t _port)
+    {
+      struct sockaddr_in sockaddr;
+      this->MakeSockAddr(_address, _port, sockaddr);
+
+      if (bind(this->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) != 0)
+      {
+        shutdown(this->fd, 0);
+        #ifdef _WIN32
+        closesocket(this->fd);
+        #else
+        close(this->fd);
+        #endif
+        return false;
+      }
+      int one = 1;
+      setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR,
+          reinterpret_cast<const char *>(&one), sizeof(one));
+
+      #ifdef _WIN32
+      u_long on = 1;
+      ioctlsocket(this->fd, FIONBIO,
+                reinterpret_cast<u_long FAR *>(&on));
+      #else
+      fcntl(this->fd, F_SETFL,
+          fcntl(this->fd, F_GETFL, 0) | O_NONBLOCK);
+      #endif
+      return true;
+    }
+
+    /// \brief Connect to an adress and port
+    /// \param[in] _address Address to connect to.
+    /// \param[in] _port Port to connect to.
+    /// \return True on success.
+    public : bool Connect(const char *_address, const uint16_t _port)
+    {
+      struct sockaddr_in sockaddr;
+      this->MakeSockAddr(_address, _port, sockaddr);
+
+      if (connect(this->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) != 0)
+      {
+        shutdown(this->fd, 0);
+        #ifdef _WIN32
+        closesocket(this->fd);
+        #else
+        close(this->fd);
+        #endif
+        return false;
+      }
+      int one = 1;
+      setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR,
+          reinterpret_cast<const char *>(&one), sizeof(one));
+
+      #ifdef _WIN32
+      u_long on = 1;
+      ioctlsocket(this->fd, FIONBIO,
+                reinterpret_cast<u_long FAR *>(&on));
+      #else
+      fcntl(this->fd, F_SETFL,
+          fcntl(this->fd, F_GETFL, 0) | O_NONBLOCK);
+      #endif
+      return true;
+    }
+
+    /// \brief Make a socket
+    /// \param[in] _address Socket address.
+    /// \param[in] _port Socket port
+    /// \param[out] _sockaddr New socket address structure.
+    public: void MakeSockAddr(const char *_address, const uint16_t _port,
+      struct sockaddr_in &_sockaddr)
+    {
+      memset(&_sockaddr, 0, sizeof(_sockaddr));
+
+      #ifdef HAVE_SOCK_SIN_LEN
+        _sockaddr.sin_len = sizeof(_sockaddr);
+      #endif
+
+      _sockaddr.sin_port = htons(_port);
+      _sockaddr.sin_family = AF_INET;
+      _sockaddr.sin_addr.s_addr = inet_addr(_address);
+    }
+
+    public: ssize_t Send(const void *_buf, size_t _size)
+    {
+      return send(this->fd, _buf, _size, 0);
+    }
+
+    /// \brief Receive data
+    /// The socket is non-blocking, so a packet that is already queued is
+    /// returned without waiting. Otherwise block until a packet lands or
+    /// the timeout expires, whichever comes first.
+    /// \param[out] _buf Buffer that receives the data.
+    /// \param[in] _size Size of the buffer.
+    /// \param[in] _timeoutMS Milliseconds to wait for data.
+    /// \return Size of the received packet, -1 if none arrived in time.
+    public: ssize_t Recv(void *_buf, const size_t _size, uint32_t _timeoutMs)
+    {
+      ssize_t ret = this->RecvNoWait(_buf, _size);
+      if (ret != -1 || _timeoutMs == 0)
+      {
+        return ret;
+      }
+
+      fd_set fds;
+      struct timeval tv;
+
+      FD_ZERO(&fds);
+      FD_SET(this->fd, &fds);
+
+      tv.tv_sec = _timeoutMs / 1000;
+      tv.tv_usec = (_timeoutMs % 1000) * 1000UL;
+
+      if (select(this->fd+1, &fds, NULL, NULL, &tv) != 1)
+      {
+          return -1;
+      }
+
+      return this->RecvNoWait(_buf, _size);
+    }
+
+    /// \brief Receive data if a packet is already queued on the socket.
+    /// \param[out] _buf Buffer that receives the data.
+    /// \param[in] _size Size of the buffer.
+    /// \return Size of the received packet, -1 if nothing was queued.
+    public: ssize_t RecvNoWait(void *_buf, const size_t _size)
+    {
+      #ifdef _WIN32
+      return recv(this->fd, reinterpret_cast<char *>(_buf), _size, 0);
+      #else
+      return recv(this->fd, _buf, _size, 0);
+      #endif
+    }
+
+    /// \brief Socket handle
+    /// \return The underlying socket file descriptor.
+    public: int Handle() const
+    {
+      return this->fd;
+    }
+
+    /// \brief Receive every packet queued on the socket and keep only the
+    /// newest one. On Linux the backlog is pulled with recvmmsg, up to
+    /// kDrainBatchSize packets per syscall, into a ring allocated once.
+    /// \param[out] _buf Buffer that receives the newest packet, untouched if
+    /// nothing was queued.
+    /// \param[in] _size Size of the buffer.
+    /// \param[out] _count Number of packets received.
+    /// \return Size of the newest packet, -1 if nothing was queued.
+    public: ssize_t RecvLatest(void *_buf, const size_t _size,
+        unsigned int &_count)
+    {
+      _count = 0;
+      #ifdef __linux__
+      if (this->drainSlotSize != _size)
+      {
+        this->drainSlotSize = _size;
+        this->drainBuffer.resize(kDrainBatchSize * _size);
+        for (unsigned int i = 0; i < kDrainBatchSize; ++i)
+        {
+          this->drainIov[i].iov_base = &this->drainBuffer[i * _size];
+          this->drainIov[i].iov_len = _size;
+          memset(&this->drainMsgs[i], 0, sizeof(this->drainMsgs[i]));
+          this->drainMsgs[i].msg_hdr.msg_iov = &this->drainIov[i];
+          this->drainMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+      }
+
+      int newest = -1;
+      while (true)
+      {
+        const int n = recvmmsg(this->fd, this->drainMsgs, kDrainBatchSize,
+            MSG_DONTWAIT, nullptr);
+        if (n <= 0)
+        {
+          break;
+        }
+        _count += n;
+        newest = n - 1;
+        if (n < static_cast<int>(kDrainBatchSize))
+        {
+          break;
+        }
+      }
+
+      if (newest < 0)
+      {
+        return -1;
+      }
+      const ssize_t len = this->drainMsgs[newest].msg_len;
+      memcpy(_buf, this->drainIov[newest].iov_base, len);
+      return len;
+      #else
+      ssize_t len = -1;
+      while (true)
+      {
+        const ssize_t ret = this->RecvNoWait(_buf, _size);
+        if (ret == -1)
+        {
+          break;
+        }
+        ++_count;
+        len = ret;
+      }
+      return len;
+      #endif
+    }
+
+    /// \brief Maximum number of packets pulled by a single drain syscall
+    public: static const unsigned int kDrainBatchSize = 32;
+
+    /// \brief Socket handle
+    private: int fd;
+
+    #ifdef __linux__
+    /// \brief Storage for the drain ring, kDrainBatchSize packets
+    private: std::vector<uint8_t> drainBuffer;
+
+    /// \brief Size of one packet slot in drainBuffer
+    private: size_t drainSlotSize = 0;
+
+    /// \brief One iovec per drain ring slot
+    private: struct iovec drainIov[kDrainBatchSize];
+
+    /// \brief recvmmsg headers, one per drain ring slot
+    private: struct mmsghdr drainMsgs[kDrainBatchSize];
+    #endif
+  };
+}
+#endif
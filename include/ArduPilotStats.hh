@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_ARDUPILOTSTATS_HH_
+#define GAZEBO_PLUGINS_ARDUPILOTSTATS_HH_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace gazebo
+{
+  /// \brief Latency histogram with about 12% resolution, from 1 ns to
+  /// centuries.
+  ///
+  /// Written by a single thread without locks. Buckets are relaxed atomics
+  /// so another thread may read a (slightly inconsistent) snapshot at any
+  /// time.
+  class LatencyHistogram
+  {
+    /// \brief Constructor.
+    public: LatencyHistogram()
+    {
+      this->Reset();
+    }
+
+    /// \brief Record a sample.
+    /// \param[in] _ns Sample in nanoseconds.
+    public: void Add(const uint64_t _ns)
+    {
+      std::atomic<uint64_t> &bucket = this->buckets[Bucket(_ns)];
+      bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+      this->count.store(this->count.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+      this->sum.store(this->sum.load(std::memory_order_relaxed) + _ns,
+          std::memory_order_relaxed);
+      if (_ns > this->max.load(std::memory_order_relaxed))
+      {
+        this->max.store(_ns, std::memory_order_relaxed);
+      }
+    }
+
+    /// \brief Record a sample.
+    /// \param[in] _duration Sample duration.
+    public: void Add(const std::chrono::steady_clock::duration _duration)
+    {
+      this->Add(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              _duration).count()));
+    }
+
+    /// \brief Clear all samples.
+    public: void Reset()
+    {
+      for (std::atomic<uint64_t> &bucket : this->buckets)
+      {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      this->count.store(0, std::memory_order_relaxed);
+      this->sum.store(0, std::memory_order_relaxed);
+      this->max.store(0, std::memory_order_relaxed);
+    }
+
+    /// \brief Add the samples of another histogram to this one.
+    /// \param[in] _other Histogram not being written to.
+    public: void Merge(const LatencyHistogram &_other)
+    {
+      for (unsigned int i = 0; i < kBuckets; ++i)
+      {
+        this->buckets[i].store(
+            this->buckets[i].load(std::memory_order_relaxed) +
+            _other.buckets[i].load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+      }
+      this->count.store(this->Count() + _other.Count(),
+          std::memory_order_relaxed);
+      this->sum.store(this->sum.load(std::memory_order_relaxed) +
+          _other.sum.load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      if (_other.Max() > this->Max())
+      {
+        this->max.store(_other.Max(), std::memory_order_relaxed);
+      }
+    }
+
+    /// \brief Number of samples.
+    public: uint64_t Count() const
+    {
+      return this->count.load(std::memory_order_relaxed);
+    }
+
+    /// \brief Largest sample in nanoseconds.
+    public: uint64_t Max() const
+    {
+      return this->max.load(std::memory_order_relaxed);
+    }
+
+    /// \brief Mean of the samples in nanoseconds.
+    public: uint64_t Mean() const
+    {
+      const uint64_t n = this->Count();
+      return n == 0 ? 0 : this->sum.load(std::memory_order_relaxed) / n;
+    }
+
+    /// \brief Estimate a percentile.
+    /// \param[in] _p Percentile, between 0 and 1.
+    /// \return Middle of the bucket holding the percentile, in nanoseconds.
+    public: uint64_t Percentile(const double _p) const
+    {
+      const uint64_t n = this->Count();
+      if (n == 0)
+      {
+        return 0;
+      }
+      const uint64_t rank = static_cast<uint64_t>(_p * (n - 1));
+      uint64_t seen = 0;
+      for (unsigned int i = 0; i < kBuckets; ++i)
+      {
+        seen += this->buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+        {
+          if (i + 1 == kBuckets)
+          {
+            return this->Max();
+          }
+          return (Lower(i) + Lower(i + 1)) / 2;
+        }
+      }
+      return this->Max();
+    }
+
+    /// \brief Bucket of a sample: exact below 8, then 4 buckets per
+    /// power of two.
+    /// \param[in] _ns Sample in nanoseconds.
+    /// \return Bucket index.
+    private: static unsigned int Bucket(const uint64_t _ns)
+    {
+      if (_ns < 8)
+      {
+        return static_cast<unsigned int>(_ns);
+      }
+      unsigned int msb = 63;
+      while (!(_ns & (1ull << msb)))
+      {
+        --msb;
+      }
+      return (msb - 1) * 4 + ((_ns >> (msb - 2)) & 3);
+    }
+
+    /// \brief Smallest sample of a bucket.
+    /// \param[in] _bucket Bucket index.
+    /// \return Sample in nanoseconds.
+    private: static uint64_t Lower(const unsigned int _bucket)
+    {
+      if (_bucket < 8)
+      {
+        return _bucket;
+      }
+      const unsigned int msb = _bucket / 4 + 1;
+      return static_cast<uint64_t>(4 + _bucket % 4) << (msb - 2);
+    }
+
+    /// \brief Number of buckets, enough for any 64 bit sample.
+    private: static const unsigned int kBuckets = 252;
+
+    /// \brief Sample count per bucket.
+    private: std::atomic<uint64_t> buckets[kBuckets];
+
+    /// \brief Number of samples.
+    private: std::atomic<uint64_t> count;
+
+    /// \brief Sum of the samples.
+    private: std::atomic<uint64_t> sum;
+
+    /// \brief Largest sample.
+    private: std::atomic<uint64_t> max;
+  };
+
+  /// \brief Record the lifetime of the timer into a histogram.
+  /// Does not read the clock when the histogram is null.
+  class ScopedLatencyTimer
+  {
+    /// \brief Constructor.
+    /// \param[in] _histogram Histogram receiving the sample, may be null.
+    public: explicit ScopedLatencyTimer(LatencyHistogram *_histogram)
+      : histogram(_histogram)
+    {
+      if (this->histogram)
+      {
+        this->start = std::chrono::steady_clock::now();
+      }
+    }
+
+    /// \brief Destructor, record the sample.
+    public: ~ScopedLatencyTimer()
+    {
+      if (this->histogram)
+      {
+        this->histogram->Add(std::chrono::steady_clock::now() - this->start);
+      }
+    }
+
+    /// \brief Histogram receiving the sample.
+    private: LatencyHistogram *histogram;
+
+    /// \brief Time the timer was created.
+    private: std::chrono::steady_clock::time_point start;
+  };
+}
+#endif
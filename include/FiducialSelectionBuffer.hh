@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef _GAZEBO_RENDERING_FIDUCIALSELECTIONBUFFER_HH_
+#define _GAZEBO_RENDERING_FIDUCIALSELECTIONBUFFER_HH_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <gazebo/rendering/RenderTypes.hh>
+
+namespace Ogre
+{
+  class RenderTarget;
+  class SceneManager;
+}
+
+namespace gazebo
+{
+  namespace rendering
+  {
+    struct FiducialSelectionBufferPrivate;
+
+    /// \brief Id pass of a camera for a set of fiducials: the fiducials are
+    /// drawn in a color encoding their index, every other selectable entity
+    /// in black so it still occludes them. One Update renders and reads
+    /// back the whole pass, after which any number of pixels are looked up
+    /// from memory, unlike SelectionBuffer::OnSelectionClick which renders
+    /// and reads back on every lookup.
+    class FiducialSelectionBuffer
+    {
+      /// \brief Constructor
+      /// \param[in] _cameraName Name of the camera to generate an id pass
+      /// for.
+      /// \param[in] _mgr Pointer to the scene manager.
+      /// \param[in] _renderTarget Render target of the camera, gives the
+      /// size of the pass.
+      public: FiducialSelectionBuffer(const std::string &_cameraName,
+                  Ogre::SceneManager *_mgr, Ogre::RenderTarget *_renderTarget);
+
+      /// \brief Destructor
+      public: ~FiducialSelectionBuffer();
+
+      /// \brief Set the fiducials to identify.
+      /// \param[in] _visuals Root visuals of the fiducials, null for the
+      /// ones not in the scene yet. FiducialAt returns indices in this
+      /// vector.
+      public: void SetFiducials(const std::vector<VisualPtr> &_visuals);
+
+      /// \brief Render the id pass and read it back.
+      public: void Update();
+
+      /// \brief Fiducial visible at a pixel of the last Update.
+      /// \param[in] _x X coordinate in pixels.
+      /// \param[in] _y Y coordinate in pixels.
+      /// \return Index of the fiducial, -1 for none or out of the image.
+      public: int FiducialAt(const int _x, const int _y) const;
+
+      /// \internal
+      /// \brief Pointer to private data.
+      private: std::unique_ptr<FiducialSelectionBufferPrivate> dataPtr;
+    };
+  }
+}
+#endif
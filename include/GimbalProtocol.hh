@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_GIMBALPROTOCOL_HH_
+#define GAZEBO_PLUGINS_GIMBALPROTOCOL_HH_
+
+#include <cstdint>
+
+namespace gazebo
+{
+  /// \brief Magic number starting every gimbal packet, "GIMB".
+  static const uint32_t kGimbalPacketMagic = 0x424d4947;
+
+  /// \brief Current version of the gimbal packets.
+  static const uint16_t kGimbalPacketVersion = 1;
+
+  /// \brief Gimbal command, received over UDP.
+  struct GimbalCommandPacket
+  {
+    /// \brief kGimbalPacketMagic
+    uint32_t magic;
+
+    /// \brief kGimbalPacketVersion
+    uint16_t version;
+
+    /// \brief Unused, 0
+    uint16_t reserved;
+
+    /// \brief Time the command was sent, us. A jump of more than 1 s back
+    /// from the last applied command is a restart of the sender, the
+    /// command is applied whatever its sequence number.
+    uint64_t timestamp;
+
+    /// \brief Roll target, rad
+    float roll;
+
+    /// \brief Pitch target, rad, the tilt joint angle
+    float pitch;
+
+    /// \brief Yaw target, rad
+    float yaw;
+
+    /// \brief Command sequence number, incremented by the sender for every
+    /// command and wrapping around. A command not newer than the last
+    /// applied one is dropped.
+    uint32_t sequence;
+  };
+
+  static_assert(sizeof(GimbalCommandPacket) == 32,
+      "GimbalCommandPacket is a wire format, it must not be padded");
+
+  /// \brief Gimbal status, sent over UDP.
+  struct GimbalStatusPacket
+  {
+    /// \brief kGimbalPacketMagic
+    uint32_t magic;
+
+    /// \brief kGimbalPacketVersion
+    uint16_t version;
+
+    /// \brief Unused, 0
+    uint16_t reserved;
+
+    /// \brief Sim time of the measurement, us
+    uint64_t timestamp;
+
+    /// \brief Measured roll, rad
+    float roll;
+
+    /// \brief Measured pitch, rad
+    float pitch;
+
+    /// \brief Measured yaw, rad
+    float yaw;
+
+    /// \brief Roll target, rad
+    float targetRoll;
+
+    /// \brief Pitch target, rad
+    float targetPitch;
+
+    /// \brief Yaw target, rad
+    float targetYaw;
+  };
+
+  static_assert(sizeof(GimbalStatusPacket) == 40,
+      "GimbalStatusPacket is a wire format, it must not be padded");
+}
+#endif
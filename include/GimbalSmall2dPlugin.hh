@@ -27,6 +27,17 @@ namespace gazebo
   class GimbalSmall2dPluginPrivate;
 
   /// \brief A plugin for controlling the angle of a gimbal joint
+  ///
+  /// <joint>          tilt joint, tilt_joint
+  /// <protocol>       string, angles as text on the gazebo topics
+  ///                  ~/<model>/gimbal_tilt_cmd and gimbal_tilt_status, or
+  ///                  udp, GimbalCommandPacket and GimbalStatusPacket of
+  ///                  GimbalProtocol.hh. string by default
+  /// <udp_addr>       address of the udp sockets, 127.0.0.1
+  /// <udp_port_in>    port udp commands are received on, 9010
+  /// <udp_port_out>   port udp status is sent to, 9011
+  /// <status_rate>    status messages per second of sim time, 0 for every
+  ///                  step, 10
   class GAZEBO_VISIBLE GimbalSmall2dPlugin : public ModelPlugin
   {
     /// \brief Constructor
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_IRLOCKPROTOCOL_HH_
+#define GAZEBO_PLUGINS_IRLOCKPROTOCOL_HH_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace gazebo
+{
+  /// \brief One target per packet, the layout ArduPilot's SITL IRLock
+  /// reads.
+  struct IRLockPacket
+  {
+    /// \brief Measurement time, ms
+    uint64_t timestamp;
+
+    /// \brief Always 1
+    uint16_t num_targets;
+
+    /// \brief Horizontal angle of the target center, rad
+    float pos_x;
+
+    /// \brief Vertical angle of the target center, rad
+    float pos_y;
+
+    /// \brief Width of the target in the image, pixels
+    float size_x;
+
+    /// \brief Height of the target in the image, pixels
+    float size_y;
+  };
+
+  /// \brief Target of a frame packet.
+  struct IRLockTarget
+  {
+    /// \brief Horizontal angle of the target center, rad
+    float pos_x;
+
+    /// \brief Vertical angle of the target center, rad
+    float pos_y;
+
+    /// \brief Width of the target in the image, pixels
+    float size_x;
+
+    /// \brief Height of the target in the image, pixels
+    float size_y;
+  };
+
+  /// \brief Current version of the frame packet.
+  static const uint16_t kIRLockFrameVersion = 1;
+
+  /// \brief Maximum number of targets of a frame packet.
+  static const uint16_t kIRLockFrameMaxTargets = 64;
+
+  /// \brief Every target of one camera frame, only the first num_targets
+  /// targets are sent.
+  struct IRLockFramePacket
+  {
+    /// \brief Measurement time of the frame, ms
+    uint64_t timestamp;
+
+    /// \brief Frame number, to detect lost frames
+    uint32_t sequence;
+
+    /// \brief Number of targets that follow
+    uint16_t num_targets;
+
+    /// \brief kIRLockFrameVersion
+    uint16_t version;
+
+    /// \brief Targets
+    IRLockTarget targets[kIRLockFrameMaxTargets];
+  };
+
+  static_assert(offsetof(IRLockFramePacket, targets) == 16,
+      "IRLockFramePacket is a wire format, it must not be padded");
+
+  /// \brief Target at a pixel of an image.
+  /// \param[in] _x X coordinate in pixels.
+  /// \param[in] _y Y coordinate in pixels.
+  /// \param[in] _width Image width in pixels.
+  /// \param[in] _height Image height in pixels.
+  /// \param[in] _hfov Horizontal field of view, rad.
+  /// \param[in] _vfov Vertical field of view, rad.
+  /// \return Target with its angles set, 1x1 pixel.
+  inline IRLockTarget IRLockTargetAt(const int _x, const int _y,
+      const double _width, const double _height, const double _hfov,
+      const double _vfov)
+  {
+    const double pixelsPerRadianX = _width / _hfov;
+    const double pixelsPerRadianY = _height / _vfov;
+    IRLockTarget target;
+    target.pos_x = static_cast<float>(
+      (static_cast<double>(_x) - (_width * 0.5)) / pixelsPerRadianX);
+    target.pos_y = static_cast<float>(
+      -((_height * 0.5) - static_cast<double>(_y)) / pixelsPerRadianY);
+    target.size_x = 1.0f;
+    target.size_y = 1.0f;
+    return target;
+  }
+}
+#endif
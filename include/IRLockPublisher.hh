@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifndef GAZEBO_PLUGINS_IRLOCKPUBLISHER_HH_
+#define GAZEBO_PLUGINS_IRLOCKPUBLISHER_HH_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sdf/sdf.hh>
+#include <gazebo/common/Console.hh>
+#include "include/ArduPilotSocket.hh"
+#include "include/IRLockProtocol.hh"
+
+namespace gazebo
+{
+  /// \brief Sends the targets of a frame to ArduPilot, shared by the
+  /// camera and the analytic IRLock plugins so both send the same packets.
+  class IRLockPublisher
+  {
+    /// \brief Read <irlock_addr>, <irlock_port> and <irlock_packet> and
+    /// connect to the receiver.
+    /// \param[in] _sdf Plugin sdf.
+    /// \return False if the socket could not be connected.
+    public: bool Load(sdf::ElementPtr _sdf)
+    {
+      const std::string address =
+        _sdf->Get("irlock_addr", static_cast<std::string>("127.0.0.1")).first;
+      const uint16_t port = _sdf->Get("irlock_port", 9005).first;
+
+      const std::string packet =
+        _sdf->Get("irlock_packet", static_cast<std::string>("target")).first;
+      this->framePacket = packet == "frame";
+      if (!this->framePacket && packet != "target")
+      {
+        gzwarn << "irlock_packet [" << packet << "] not recognized, must be"
+               << " target or frame. default to target.\n";
+      }
+
+      // the destination never changes, packets are then sent without an
+      // address to resolve
+      this->connected = this->socket.Connect(address.c_str(), port);
+      if (!this->connected)
+      {
+        gzerr << "IRLock cannot connect to [" << address << ":" << port
+              << "], no target will be sent.\n";
+      }
+      return this->connected;
+    }
+
+    /// \brief Send the targets of a frame.
+    /// \param[in] _timestamp Measurement time of the frame, ms.
+    /// \param[in] _targets Targets of the frame.
+    public: void Publish(const uint64_t _timestamp,
+        const std::vector<IRLockTarget> &_targets)
+    {
+      if (!this->connected)
+      {
+        return;
+      }
+
+      if (this->framePacket)
+      {
+        // every frame, even without target, so the receiver knows it was
+        // seen
+        IRLockFramePacket pkt;
+        pkt.timestamp = _timestamp;
+        pkt.sequence = this->sequence++;
+        pkt.num_targets = static_cast<uint16_t>(std::min(_targets.size(),
+              static_cast<size_t>(kIRLockFrameMaxTargets)));
+        pkt.version = kIRLockFrameVersion;
+        std::copy(_targets.begin(), _targets.begin() + pkt.num_targets,
+            pkt.targets);
+        this->socket.Send(&pkt, offsetof(IRLockFramePacket, targets) +
+            pkt.num_targets * sizeof(IRLockTarget));
+        return;
+      }
+
+      for (const IRLockTarget &target : _targets)
+      {
+        IRLockPacket pkt;
+        pkt.timestamp = _timestamp;
+        pkt.num_targets = static_cast<uint16_t>(1);
+        pkt.pos_x = target.pos_x;
+        pkt.pos_y = target.pos_y;
+        pkt.size_x = target.size_x;
+        pkt.size_y = target.size_y;
+        this->socket.Send(&pkt, sizeof(pkt));
+      }
+    }
+
+    /// \brief Non-blocking UDP socket
+    private: ArduPilotSocketPrivate socket;
+
+    /// \brief True once socket is connected
+    private: bool connected = false;
+
+    /// \brief Send frame packets
+    private: bool framePacket = false;
+
+    /// \brief Number of frame packets sent
+    private: uint32_t sequence = 0;
+  };
+}
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ignition/math/Box.hh>
+#include <ignition/math/Pose3.hh>
+
+#include <gazebo/common/Events.hh>
+#include <gazebo/physics/physics.hh>
+
+#include "include/ArduCopterIRLockAnalyticPlugin.hh"
+#include "include/IRLockPublisher.hh"
+
+using namespace gazebo;
+GZ_REGISTER_MODEL_PLUGIN(ArduCopterIRLockAnalyticPlugin)
+
+/// \brief Ray casts per line of sight test, each one looks past the
+/// vehicle surface the previous one hit
+static const unsigned int kMaxRayHops = 4;
+
+namespace gazebo
+{
+  class ArduCopterIRLockAnalyticPluginPrivate
+  {
+    /// \brief Vehicle model
+    public: physics::ModelPtr model;
+
+    /// \brief World of the vehicle
+    public: physics::WorldPtr world;
+
+    /// \brief Link carrying the camera
+    public: physics::LinkPtr link;
+
+    /// \brief Camera pose in the link frame
+    public: ignition::math::Pose3d cameraPose;
+
+    /// \brief Horizontal field of view, rad
+    public: double hfov = 1.047;
+
+    /// \brief Vertical field of view, rad
+    public: double vfov = 0.0;
+
+    /// \brief Image width, pixels
+    public: double imageWidth = 320;
+
+    /// \brief Image height, pixels
+    public: double imageHeight = 240;
+
+    /// \brief Sim time between detections, s
+    public: double period = 0.05;
+
+    /// \brief Sim time of the last detection, negative before the first
+    public: double lastUpdate = -1.0;
+
+    /// \brief A list of fiducials tracked by this camera.
+    public: std::vector<std::string> fiducials;
+
+    /// \brief Model of each fiducial, null until it is in the world
+    public: std::vector<physics::ModelPtr> fiducialModels;
+
+    /// \brief Scoped name prefix of the collisions of each fiducial
+    public: std::vector<std::string> fiducialPrefixes;
+
+    /// \brief Scoped name prefix of the collisions of the vehicle
+    public: std::string modelPrefix;
+
+    /// \brief Ray of the line of sight tests
+    public: physics::RayShapePtr ray;
+
+    /// \brief Sends the targets to ArduPilot
+    public: IRLockPublisher publisher;
+
+    /// \brief Targets found in the last detection
+    public: std::vector<IRLockTarget> targets;
+
+    /// \brief World update connection
+    public: event::ConnectionPtr updateConnection;
+  };
+}
+
+/////////////////////////////////////////////////
+/// \brief Project a world point to normalized device coordinates, as the
+/// Ogre projection of a gazebo camera does.
+/// \param[in] _camera Camera pose in the world, looking along x.
+/// \param[in] _tanX Tangent of half the horizontal field of view.
+/// \param[in] _tanY Tangent of half the vertical field of view.
+/// \param[in] _pt World point.
+/// \param[out] _x X coordinate, -1 to 1 in the image.
+/// \param[out] _y Y coordinate, -1 to 1 in the image.
+/// \return False if _pt is behind the camera.
+static bool ProjectToNdc(const ignition::math::Pose3d &_camera,
+    const double _tanX, const double _tanY,
+    const ignition::math::Vector3d &_pt, double &_x, double &_y)
+{
+  const ignition::math::Vector3d p =
+    _camera.Rot().RotateVectorReverse(_pt - _camera.Pos());
+  if (p.X() <= 0.0)
+  {
+    return false;
+  }
+  // image right is -y, image up is z
+  _x = -p.Y() / (p.X() * _tanX);
+  _y = p.Z() / (p.X() * _tanY);
+  return true;
+}
+
+/////////////////////////////////////////////////
+ArduCopterIRLockAnalyticPlugin::ArduCopterIRLockAnalyticPlugin()
+    : ModelPlugin(),
+      dataPtr(new ArduCopterIRLockAnalyticPluginPrivate)
+{
+}
+
+/////////////////////////////////////////////////
+ArduCopterIRLockAnalyticPlugin::~ArduCopterIRLockAnalyticPlugin()
+{
+  this->dataPtr->updateConnection.reset();
+}
+
+/////////////////////////////////////////////////
+void ArduCopterIRLockAnalyticPlugin::Load(physics::ModelPtr _model,
+                                          sdf::ElementPtr _sdf)
+{
+  this->dataPtr->model = _model;
+  this->dataPtr->world = _model->GetWorld();
+  this->dataPtr->modelPrefix = _model->GetScopedName() + "::";
+
+  // load the fiducials
+  if (_sdf->HasElement("fiducial"))
+  {
+    sdf::ElementPtr elem = _sdf->GetElement("fiducial");
+    while (elem)
+    {
+      this->dataPtr->fiducials.push_back(elem->Get<std::string>());
+      elem = elem->GetNextElement("fiducial");
+    }
+    // resolved in the world by the first updates
+    this->dataPtr->fiducialModels.resize(this->dataPtr->fiducials.size());
+    this->dataPtr->fiducialPrefixes.resize(this->dataPtr->fiducials.size());
+  }
+  else
+  {
+    gzerr << "No fidicuals specified. ArduCopterIRLockAnalyticPlugin will"
+          << " not be run.\n";
+    return;
+  }
+
+  const std::string linkName =
+    _sdf->Get("linkName", static_cast<std::string>("")).first;
+  this->dataPtr->link = linkName.empty() ? _model->GetLink() :
+    _model->GetLink(linkName);
+  if (!this->dataPtr->link)
+  {
+    gzerr << "ArduCopterIRLockAnalyticPlugin camera link [" << linkName
+          << "] not found.\n";
+    return;
+  }
+  this->dataPtr->cameraPose =
+    _sdf->Get("cameraPose", ignition::math::Pose3d::Zero).first;
+  this->dataPtr->hfov = _sdf->Get("hfov", this->dataPtr->hfov).first;
+  this->dataPtr->imageWidth =
+    _sdf->Get("imageWidth", this->dataPtr->imageWidth).first;
+  this->dataPtr->imageHeight =
+    _sdf->Get("imageHeight", this->dataPtr->imageHeight).first;
+  // the vertical field of view of a gazebo camera follows the aspect ratio
+  this->dataPtr->vfov = 2.0 * std::atan(std::tan(this->dataPtr->hfov / 2.0) *
+      this->dataPtr->imageHeight / this->dataPtr->imageWidth);
+  const double updateRate = _sdf->Get("updateRate", 20.0).first;
+  this->dataPtr->period = updateRate > 0.0 ? 1.0 / updateRate : 0.0;
+
+  this->dataPtr->publisher.Load(_sdf);
+
+  this->dataPtr->updateConnection = event::Events::ConnectWorldUpdateBegin(
+      std::bind(&ArduCopterIRLockAnalyticPlugin::OnUpdate, this,
+        std::placeholders::_1));
+
+  gzmsg << "ArduCopterIRLockAnalyticPlugin camera on link "
+        << this->dataPtr->link->GetScopedName() << "\n";
+}
+
+/////////////////////////////////////////////////
+void ArduCopterIRLockAnalyticPlugin::OnUpdate(
+    const common::UpdateInfo &_info)
+{
+  const double simTime = _info.simTime.Double();
+  // time went backward, world reset: publish right away again
+  if (simTime < this->dataPtr->lastUpdate)
+  {
+    this->dataPtr->lastUpdate = -1.0;
+  }
+  if (this->dataPtr->lastUpdate >= 0.0 &&
+      simTime - this->dataPtr->lastUpdate < this->dataPtr->period)
+  {
+    return;
+  }
+  this->dataPtr->lastUpdate = simTime;
+
+  if (!this->dataPtr->ray)
+  {
+    // created in the physics thread, where the casts happen
+    physics::PhysicsEnginePtr engine = this->dataPtr->world->Physics();
+    engine->InitForThread();
+    this->dataPtr->ray = boost::dynamic_pointer_cast<physics::RayShape>(
+        engine->CreateShape("ray", physics::CollisionPtr()));
+  }
+
+  // look the fiducial models up by name until they all exist
+  for (size_t i = 0; i < this->dataPtr->fiducials.size(); ++i)
+  {
+    physics::ModelPtr &fiducial = this->dataPtr->fiducialModels[i];
+    if (!fiducial)
+    {
+      fiducial =
+        this->dataPtr->world->ModelByName(this->dataPtr->fiducials[i]);
+      if (fiducial)
+      {
+        this->dataPtr->fiducialPrefixes[i] = fiducial->GetScopedName() + "::";
+      }
+    }
+  }
+
+  const ignition::math::Pose3d camera =
+    this->dataPtr->cameraPose + this->dataPtr->link->WorldPose();
+  const double width = this->dataPtr->imageWidth;
+  const double height = this->dataPtr->imageHeight;
+  const double tanX = std::tan(this->dataPtr->hfov / 2.0);
+  const double tanY = std::tan(this->dataPtr->vfov / 2.0);
+
+  this->dataPtr->targets.clear();
+  for (size_t i = 0; i < this->dataPtr->fiducialModels.size(); ++i)
+  {
+    const physics::ModelPtr &fiducial = this->dataPtr->fiducialModels[i];
+    if (!fiducial)
+    {
+      continue;
+    }
+
+    // pixel as the camera plugin computes it
+    const ignition::math::Vector3d pos = fiducial->WorldPose().Pos();
+    double x, y;
+    if (!ProjectToNdc(camera, tanX, tanY, pos, x, y) ||
+        x < -1.0 || x > 1.0 || y < -1.0 || y > 1.0)
+    {
+      continue;
+    }
+    const int pixelX = static_cast<int>(((x / 2.0) + 0.5) * width);
+    const int pixelY = static_cast<int>((1 - ((y / 2.0) + 0.5)) * height);
+
+    if (!this->LineOfSight(camera.Pos(), pos, i))
+    {
+      continue;
+    }
+
+    IRLockTarget target = IRLockTargetAt(pixelX, pixelY, width, height,
+        this->dataPtr->hfov, this->dataPtr->vfov);
+
+    // size of the collision bounding box in the image
+    const ignition::math::Box box = fiducial->BoundingBox();
+    double minX = 1.0, maxX = -1.0, minY = 1.0, maxY = -1.0;
+    bool inFront = true;
+    for (unsigned int c = 0; c < 8 && inFront; ++c)
+    {
+      const ignition::math::Vector3d corner(
+          (c & 1) ? box.Max().X() : box.Min().X(),
+          (c & 2) ? box.Max().Y() : box.Min().Y(),
+          (c & 4) ? box.Max().Z() : box.Min().Z());
+      inFront = ProjectToNdc(camera, tanX, tanY, corner, x, y);
+      minX = std::min(minX, x);
+      maxX = std::max(maxX, x);
+      minY = std::min(minY, y);
+      maxY = std::max(maxY, y);
+    }
+    if (inFront)
+    {
+      target.size_x = std::max(1.0f, static_cast<float>(
+            (std::min(maxX, 1.0) - std::max(minX, -1.0)) / 2.0 * width));
+      target.size_y = std::max(1.0f, static_cast<float>(
+            (std::min(maxY, 1.0) - std::max(minY, -1.0)) / 2.0 * height));
+    }
+    this->dataPtr->targets.push_back(target);
+  }
+
+  this->dataPtr->publisher.Publish(static_cast<uint64_t>(1.0e3 * simTime),
+      this->dataPtr->targets);
+}
+
+/////////////////////////////////////////////////
+bool ArduCopterIRLockAnalyticPlugin::LineOfSight(
+    const ignition::math::Vector3d &_start,
+    const ignition::math::Vector3d &_end, const size_t _index)
+{
+  const std::string &fiducialPrefix = this->dataPtr->fiducialPrefixes[_index];
+  const ignition::math::Vector3d dir = (_end - _start).Normalized();
+  ignition::math::Vector3d from = _start;
+  for (unsigned int hop = 0; hop < kMaxRayHops; ++hop)
+  {
+    double dist;
+    std::string entity;
+    this->dataPtr->ray->SetPoints(from, _end);
+    this->dataPtr->ray->GetIntersection(dist, entity);
+
+    // nothing in between, or the fiducial itself
+    if (entity.empty() || entity.compare(0, fiducialPrefix.size(),
+          fiducialPrefix) == 0)
+    {
+      return true;
+    }
+    if (entity.compare(0, this->dataPtr->modelPrefix.size(),
+          this->dataPtr->modelPrefix) != 0)
+    {
+      return false;
+    }
+    // the vehicle itself, the camera often sits inside its collision, look
+    // past it
+    from += dir * (dist + 1e-3);
+  }
+  return false;
+}
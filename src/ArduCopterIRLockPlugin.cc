@@ -15,27 +15,11 @@
  *
 */
 
+#include <algorithm>
+#include <cstdlib>
 #include <memory>
 #include <functional>
-
-#ifdef _WIN32
-  #include <Winsock2.h>
-  #include <Ws2def.h>
-  #include <Ws2ipdef.h>
-  #include <Ws2tcpip.h>
-  using raw_type = char;
-#else
-  #include <sys/socket.h>
-  #include <netinet/in.h>
-  #include <netinet/tcp.h>
-  #include <arpa/inet.h>
-  using raw_type = void;
-#endif
-
-#if defined(_MSC_VER)
-  #include <BaseTsd.h>
-  typedef SSIZE_T ssize_t;
-#endif
+#include <vector>
 
 #include <ignition/math/Angle.hh>
 #include <ignition/math/Vector3.hh>
@@ -45,13 +29,19 @@
 #include <gazebo/rendering/Camera.hh>
 #include <gazebo/rendering/Conversions.hh>
 #include <gazebo/rendering/Scene.hh>
-#include <include/SelectionBuffer.hh>
+#include <gazebo/rendering/Visual.hh>
+#include <include/FiducialSelectionBuffer.hh>
 
 #include "include/ArduCopterIRLockPlugin.hh"
+#include "include/IRLockPublisher.hh"
 
 using namespace gazebo;
 GZ_REGISTER_SENSOR_PLUGIN(ArduCopterIRLockPlugin)
 
+/// \brief Pixels a fiducial may move in the image and keep its cached
+/// occlusion result
+static const int kOcclusionCachePixels = 2;
+
 namespace gazebo
 {
   class ArduCopterIRLockPluginPrivate
@@ -59,8 +49,9 @@ namespace gazebo
     /// \brief Pointer to the parent camera sensor
     public: sensors::CameraSensorPtr parentSensor;
 
-    /// \brief Selection buffer used for occlusion detection
-    public: std::unique_ptr<rendering::SelectionBuffer> selectionBuffer;
+    /// \brief Id pass of the fiducials used for occlusion detection
+    public: std::unique_ptr<rendering::FiducialSelectionBuffer>
+            selectionBuffer;
 
     /// \brief All event connections.
     public: std::vector<event::ConnectionPtr> connections;
@@ -68,40 +59,141 @@ namespace gazebo
     /// \brief A list of fiducials tracked by this camera.
     public: std::vector<std::string> fiducials;
 
-    /// \brief Irlock address
-    public: std::string irlock_addr;
+    /// \brief Root visual of each fiducial, null until it is in the scene
+    public: std::vector<rendering::VisualPtr> fiducialVisuals;
 
-    /// \brief Irlock port for receiver socket
-    public: uint16_t irlock_port;
+    /// \brief Number of null entries of fiducialVisuals
+    public: size_t unresolvedFiducials = 0;
 
-    public: int handle;
+    /// \brief Fiducial index and pixel of the fiducials in the image,
+    /// filled every frame
+    public: std::vector<std::pair<size_t, ignition::math::Vector2i>>
+            candidates;
 
-    public: struct irlockPacket
+    /// \brief Occlusion result of a fiducial, from the last id pass it
+    /// was in the image for
+    public: struct OcclusionCache
             {
-              uint64_t timestamp;
-              uint16_t num_targets;
-              float pos_x;
-              float pos_y;
-              float size_x;
-              float size_y;
+              /// \brief True while the fiducial stayed in the image since
+              /// the id pass
+              bool valid = false;
+              /// \brief True if the fiducial was not occluded
+              bool visible = false;
+              /// \brief Sim time of the id pass
+              double time = 0.0;
+              /// \brief Pixel of the fiducial in the id pass
+              ignition::math::Vector2i pixel;
             };
+
+    /// \brief Occlusion result of each fiducial
+    public: std::vector<OcclusionCache> occlusion;
+
+    /// \brief How long an occlusion result is reused while its fiducial
+    /// stays put in the image, s, 0 for never
+    public: double occlusionCacheTime = 0.0;
+
+    /// \brief Sim time between detections, s, 0 for every frame
+    public: double detectionPeriod = 0.0;
+
+    /// \brief Sim time of the next detection
+    public: double nextDetection = 0.0;
+
+    /// \brief Sends the targets to ArduPilot
+    public: IRLockPublisher publisher;
+
+    /// \brief Targets found in the last frame
+    public: std::vector<IRLockTarget> targets;
   };
 }
 
 /////////////////////////////////////////////////
-ignition::math::Vector2i GetScreenSpaceCoords(ignition::math::Vector3d _pt,
-    gazebo::rendering::CameraPtr _cam)
+/// \brief Project a world point to normalized device coordinates.
+/// \param[in] _viewProj Projection matrix times view matrix of the camera.
+/// \param[in] _pt World point.
+/// \param[out] _x X coordinate, -1 to 1 in the image.
+/// \param[out] _y Y coordinate, -1 to 1 in the image.
+/// \return False if _pt is behind the camera.
+static bool ProjectToNdc(const Ogre::Matrix4 &_viewProj,
+    const ignition::math::Vector3d &_pt, double &_x, double &_y)
+{
+  const Ogre::Vector4 clip = _viewProj *
+      Ogre::Vector4(_pt.X(), _pt.Y(), _pt.Z(), 1.0);
+  if (clip.w <= 0.0)
+  {
+    return false;
+  }
+  _x = clip.x / clip.w;
+  _y = clip.y / clip.w;
+  return true;
+}
+
+/////////////////////////////////////////////////
+/// \brief Project a world point to the image.
+/// \param[in] _viewProj Projection matrix times view matrix of the camera.
+/// \param[in] _pt World point.
+/// \param[in] _cam Camera.
+/// \param[out] _screenPos Pixel of _pt.
+/// \return False if _pt is behind the camera or out of the image.
+static bool ProjectToScreen(const Ogre::Matrix4 &_viewProj,
+    const ignition::math::Vector3d &_pt, const rendering::CameraPtr &_cam,
+    ignition::math::Vector2i &_screenPos)
 {
   // Convert from 3D world pos to 2D screen pos
-  Ogre::Vector3 pos = _cam->OgreCamera()->getProjectionMatrix() *
-      _cam->OgreCamera()->getViewMatrix() *
-      gazebo::rendering::Conversions::Convert(_pt);
+  double x, y;
+  if (!ProjectToNdc(_viewProj, _pt, x, y) ||
+      x < -1.0 || x > 1.0 || y < -1.0 || y > 1.0)
+  {
+    return false;
+  }
 
-  ignition::math::Vector2i screenPos;
-  screenPos.X() = ((pos.x / 2.0) + 0.5) * _cam->ViewportWidth();
-  screenPos.Y() = (1 - ((pos.y / 2.0) + 0.5)) * _cam->ViewportHeight();
+  _screenPos.X() = ((x / 2.0) + 0.5) * _cam->ViewportWidth();
+  _screenPos.Y() = (1 - ((y / 2.0) + 0.5)) * _cam->ViewportHeight();
+  return true;
+}
 
-  return screenPos;
+/////////////////////////////////////////////////
+/// \brief Size in the image of the bounding box of a visual.
+/// \param[in] _viewProj Projection matrix times view matrix of the camera.
+/// \param[in] _vis Visual.
+/// \param[in] _cam Camera.
+/// \param[out] _sizeX Width in pixels, at least 1.
+/// \param[out] _sizeY Height in pixels, at least 1.
+static void ProjectedSize(const Ogre::Matrix4 &_viewProj,
+    const rendering::VisualPtr &_vis, const rendering::CameraPtr &_cam,
+    float &_sizeX, float &_sizeY)
+{
+  _sizeX = 1.0f;
+  _sizeY = 1.0f;
+  const ignition::math::Box box = _vis->BoundingBox();
+  const ignition::math::Pose3d pose = _vis->WorldPose();
+  double minX = 1.0, maxX = -1.0, minY = 1.0, maxY = -1.0;
+  for (unsigned int i = 0; i < 8; ++i)
+  {
+    const ignition::math::Vector3d corner(
+        (i & 1) ? box.Max().X() : box.Min().X(),
+        (i & 2) ? box.Max().Y() : box.Min().Y(),
+        (i & 4) ? box.Max().Z() : box.Min().Z());
+    double x, y;
+    if (!ProjectToNdc(_viewProj, pose.CoordPositionAdd(corner), x, y))
+    {
+      // the box crosses the camera plane, no meaningful size
+      return;
+    }
+    minX = std::min(minX, x);
+    maxX = std::max(maxX, x);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+  }
+
+  // clipped to the image
+  minX = std::max(minX, -1.0);
+  maxX = std::min(maxX, 1.0);
+  minY = std::max(minY, -1.0);
+  maxY = std::min(maxY, 1.0);
+  _sizeX = std::max(1.0f, static_cast<float>(
+        (maxX - minX) / 2.0 * _cam->ViewportWidth()));
+  _sizeY = std::max(1.0f, static_cast<float>(
+        (maxY - minY) / 2.0 * _cam->ViewportHeight()));
 }
 
 /////////////////////////////////////////////////
@@ -109,26 +201,6 @@ ArduCopterIRLockPlugin::ArduCopterIRLockPlugin()
     : SensorPlugin(),
       dataPtr(new ArduCopterIRLockPluginPrivate)
 {
-  // socket
-  this->dataPtr->handle = socket(AF_INET, SOCK_DGRAM /*SOCK_STREAM*/, 0);
-  #ifndef _WIN32
-  // Windows does not support FD_CLOEXEC
-  fcntl(this->dataPtr->handle, F_SETFD, FD_CLOEXEC);
-  #endif
-  int one = 1;
-  setsockopt(this->dataPtr->handle, IPPROTO_TCP, TCP_NODELAY,
-      reinterpret_cast<const char *>(&one), sizeof(one));
-  setsockopt(this->dataPtr->handle, SOL_SOCKET, SO_REUSEADDR,
-      reinterpret_cast<const char *>(&one), sizeof(one));
-
-  #ifdef _WIN32
-  u_long on = 1;
-  ioctlsocket(this->dataPtr->handle, FIONBIO,
-      reinterpret_cast<u_long FAR *>(&on));
-  #else
-  fcntl(this->dataPtr->handle, F_SETFL,
-      fcntl(this->dataPtr->handle, F_GETFL, 0) | O_NONBLOCK);
-  #endif
 }
 
 /////////////////////////////////////////////////
@@ -160,6 +232,10 @@ void ArduCopterIRLockPlugin::Load(sensors::SensorPtr _sensor,
       this->dataPtr->fiducials.push_back(elem->Get<std::string>());
       elem = elem->GetNextElement("fiducial");
     }
+    // resolved in the rendering scene by the first frames
+    this->dataPtr->fiducialVisuals.resize(this->dataPtr->fiducials.size());
+    this->dataPtr->unresolvedFiducials = this->dataPtr->fiducials.size();
+    this->dataPtr->occlusion.resize(this->dataPtr->fiducials.size());
   }
   else
   {
@@ -167,10 +243,13 @@ void ArduCopterIRLockPlugin::Load(sensors::SensorPtr _sensor,
         << std::endl;
     return;
   }
-  this->dataPtr->irlock_addr =
-          _sdf->Get("irlock_addr", static_cast<std::string>("127.0.0.1")).first;
-  this->dataPtr->irlock_port =
-          _sdf->Get("irlock_port", 9005).first;
+  this->dataPtr->publisher.Load(_sdf);
+
+  const double detectionRate = _sdf->Get("detectionRate", 0.0).first;
+  this->dataPtr->detectionPeriod =
+    detectionRate > 0.0 ? 1.0 / detectionRate : 0.0;
+  this->dataPtr->occlusionCacheTime =
+    _sdf->Get("occlusionCacheTime", 0.0).first;
 
   this->dataPtr->parentSensor->SetActive(true);
 
@@ -186,6 +265,23 @@ void ArduCopterIRLockPlugin::OnNewFrame(const unsigned char * /*_image*/,
     unsigned int /*_width*/, unsigned int /*_height*/, unsigned int /*_depth*/,
     const std::string &/*_format*/)
 {
+  // frames between detections are left alone
+  const double now =
+    this->dataPtr->parentSensor->LastMeasurementTime().Double();
+  if (this->dataPtr->detectionPeriod > 0.0)
+  {
+    // small tolerance, so a camera rate multiple of the detection rate
+    // does not skip an extra frame on rounding
+    if (now + 1e-6 < this->dataPtr->nextDetection)
+    {
+      return;
+    }
+    this->dataPtr->nextDetection =
+      now - this->dataPtr->nextDetection > this->dataPtr->detectionPeriod ?
+      now + this->dataPtr->detectionPeriod :
+      this->dataPtr->nextDetection + this->dataPtr->detectionPeriod;
+  }
+
   rendering::CameraPtr camera = this->dataPtr->parentSensor->Camera();
   rendering::ScenePtr scene = camera->GetScene();
 
@@ -193,90 +289,112 @@ void ArduCopterIRLockPlugin::OnNewFrame(const unsigned char * /*_image*/,
   {
     std::string cameraName = camera->OgreCamera()->getName();
     this->dataPtr->selectionBuffer.reset(
-        new rendering::SelectionBuffer(cameraName, scene->OgreSceneManager(),
+        new rendering::FiducialSelectionBuffer(cameraName,
+        scene->OgreSceneManager(),
         camera->RenderTexture()->getBuffer()->getRenderTarget()));
   }
 
-  for (const auto &f : this->dataPtr->fiducials)
+  // look the fiducial visuals up by name until they all exist
+  if (this->dataPtr->unresolvedFiducials > 0)
   {
-    // check if fiducial is visible within the frustum
-    rendering::VisualPtr vis = scene->GetVisual(f);
-    if (!vis)
-      continue;
+    bool resolved = false;
+    for (size_t i = 0; i < this->dataPtr->fiducials.size(); ++i)
+    {
+      rendering::VisualPtr &vis = this->dataPtr->fiducialVisuals[i];
+      if (!vis)
+      {
+        vis = scene->GetVisual(this->dataPtr->fiducials[i]);
+        if (vis)
+        {
+          --this->dataPtr->unresolvedFiducials;
+          resolved = true;
+        }
+      }
+    }
+    if (resolved)
+    {
+      this->dataPtr->selectionBuffer->SetFiducials(
+          this->dataPtr->fiducialVisuals);
+    }
+  }
 
-    if (!camera->IsVisible(vis))
+  // project all fiducials with the same matrix, keep the ones in the image
+  const Ogre::Matrix4 viewProj =
+    camera->OgreCamera()->getProjectionMatrix() *
+    camera->OgreCamera()->getViewMatrix();
+  auto &candidates = this->dataPtr->candidates;
+  candidates.clear();
+  bool idPass = false;
+  for (size_t i = 0; i < this->dataPtr->fiducialVisuals.size(); ++i)
+  {
+    const rendering::VisualPtr &vis = this->dataPtr->fiducialVisuals[i];
+    ArduCopterIRLockPluginPrivate::OcclusionCache &cache =
+      this->dataPtr->occlusion[i];
+    ignition::math::Vector2i pt;
+    if (!vis || !ProjectToScreen(viewProj, vis->WorldPose().Pos(), camera, pt))
+    {
+      // out of the image, tested again when it comes back
+      cache.valid = false;
       continue;
+    }
+    candidates.emplace_back(i, pt);
 
-    ignition::math::Vector2i pt = GetScreenSpaceCoords(
-        vis->WorldPose().Pos(), camera);
+    // the cached result holds while the fiducial stays put in the image
+    idPass |= !cache.valid ||
+      now - cache.time > this->dataPtr->occlusionCacheTime ||
+      std::abs(pt.X() - cache.pixel.X()) > kOcclusionCachePixels ||
+      std::abs(pt.Y() - cache.pixel.Y()) > kOcclusionCachePixels;
+  }
 
-    // use selection buffer to check if visual is occluded by other entities
-    // in the camera view
-    Ogre::Entity *entity =
-      this->dataPtr->selectionBuffer->OnSelectionClick(pt.X(), pt.Y());
+  if (idPass)
+  {
+    // one id pass and read back for all of them, a fiducial is visible if
+    // it is what the id pass shows at its pixel
+    this->dataPtr->selectionBuffer->Update();
+    for (const auto &candidate : candidates)
+    {
+      const ignition::math::Vector2i &pt = candidate.second;
+      ArduCopterIRLockPluginPrivate::OcclusionCache &cache =
+        this->dataPtr->occlusion[candidate.first];
+      cache.valid = true;
+      cache.visible = this->dataPtr->selectionBuffer->FiducialAt(
+          pt.X(), pt.Y()) == static_cast<int>(candidate.first);
+      cache.time = now;
+      cache.pixel = pt;
+    }
+  }
 
-    rendering::VisualPtr result;
-    if (entity && !entity->getUserObjectBindings().getUserAny().isEmpty())
+  this->dataPtr->targets.clear();
+  if (!candidates.empty())
+  {
+    const double imageWidth = this->dataPtr->parentSensor->ImageWidth();
+    const double imageHeight = this->dataPtr->parentSensor->ImageHeight();
+    const double hfov = camera->HFOV().Radian();
+    const double vfov = camera->VFOV().Radian();
+    for (const auto &candidate : candidates)
     {
-      try
+      if (!this->dataPtr->occlusion[candidate.first].visible)
       {
-        result = scene->GetVisual(
-            Ogre::any_cast<std::string>(
-            entity->getUserObjectBindings().getUserAny()));
-      }
-      catch(Ogre::Exception &e)
-      {
-        gzerr << "Ogre Error:" << e.getFullDescription() << "\n";
         continue;
       }
-    }
 
-    if (result && result->GetRootVisual() == vis)
-    {
-      this->Publish(vis->Name(), pt.X(), pt.Y());
+      const ignition::math::Vector2i &pt = candidate.second;
+      IRLockTarget target = IRLockTargetAt(pt.X(), pt.Y(), imageWidth,
+          imageHeight, hfov, vfov);
+      ProjectedSize(viewProj,
+          this->dataPtr->fiducialVisuals[candidate.first], camera,
+          target.size_x, target.size_y);
+      this->dataPtr->targets.push_back(target);
     }
   }
+
+  this->Publish();
 }
 
 /////////////////////////////////////////////////
-void ArduCopterIRLockPlugin::Publish(const std::string &/*_fiducial*/,
-    unsigned int _x, unsigned int _y)
+void ArduCopterIRLockPlugin::Publish()
 {
-  rendering::CameraPtr camera = this->dataPtr->parentSensor->Camera();
-
-  const double imageWidth = this->dataPtr->parentSensor->ImageWidth();
-  const double imageHeight = this->dataPtr->parentSensor->ImageHeight();
-  const double hfov = camera->HFOV().Radian();
-  const double vfov = camera->VFOV().Radian();
-  const double pixelsPerRadianX = imageWidth / hfov;
-  const double pixelsPerRadianY = imageHeight / vfov;
-  const float angleX = static_cast<float>(
-    (static_cast<double>(_x) - (imageWidth * 0.5)) / pixelsPerRadianX);
-  const float angleY = static_cast<float>(
-    -((imageHeight * 0.5) - static_cast<double>(_y)) / pixelsPerRadianY);
-
-  // send_packet
-  ArduCopterIRLockPluginPrivate::irlockPacket pkt;
-
-  pkt.timestamp = static_cast<uint64_t>
-    (1.0e3 * this->dataPtr->parentSensor->LastMeasurementTime().Double());
-  pkt.num_targets = static_cast<uint16_t>(1);
-  pkt.pos_x = angleX;
-  pkt.pos_y = angleY;
-  // 1x1 pixel box for now
-  pkt.size_x = static_cast<float>(1);
-  pkt.size_y = static_cast<float>(1);
-
-  // std::cerr << "fiducial '" << _fiducial << "':" << _x << ", " << _y
-  //     << ", pos: " << pkt.pos_x << ", " << pkt.pos_y << std::endl;
-
-  struct sockaddr_in sockaddr;
-  memset(&sockaddr, 0, sizeof(sockaddr));
-  sockaddr.sin_port = htons(this->dataPtr->irlock_port);
-  sockaddr.sin_family = AF_INET;
-  sockaddr.sin_addr.s_addr = inet_addr(this->dataPtr->irlock_addr.c_str());
-  ::sendto(this->dataPtr->handle,
-           reinterpret_cast<raw_type *>(&pkt),
-           sizeof(pkt), 0,
-           (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+  this->dataPtr->publisher.Publish(static_cast<uint64_t>
+    (1.0e3 * this->dataPtr->parentSensor->LastMeasurementTime().Double()),
+    this->dataPtr->targets);
 }
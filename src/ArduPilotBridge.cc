@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifdef __linux__
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/socket.h>
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "include/ArduPilotBridge.hh"
+
+using namespace gazebo;
+
+/// \brief Servo packet mailbox of a single vehicle
+class ArduPilotBridgeVehicle
+{
+  /// \brief Maximum number of packets pulled by a single recvmmsg
+  public: static const unsigned int kBatchSize = 32;
+
+  /// \brief Socket handle
+  public: int fd = -1;
+
+  /// \brief Protects packet, size, fresh and dropped
+  public: std::mutex mutex;
+
+  /// \brief Notified when a fresh packet is available
+  public: std::condition_variable cond;
+
+  /// \brief Newest packet received
+  public: std::vector<uint8_t> packet;
+
+  /// \brief Size of the newest packet
+  public: ssize_t size = -1;
+
+  /// \brief True if packet has not been consumed yet
+  public: bool fresh = false;
+
+  /// \brief Packets superseded since the last consumed one
+  public: unsigned int dropped = 0;
+
+  #ifdef __linux__
+  /// \brief Receive ring, only touched by the I/O thread
+  public: std::vector<uint8_t> ring;
+
+  /// \brief One iovec per ring slot
+  public: struct iovec iov[kBatchSize];
+
+  /// \brief recvmmsg headers, one per ring slot
+  public: struct mmsghdr msgs[kBatchSize];
+  #endif
+};
+
+// Private data class
+class gazebo::ArduPilotBridgePrivate
+{
+  /// \brief Serializes starting and stopping the I/O thread, held by
+  /// Unregister across the join so a Register cannot start a second
+  /// thread or replace the fds of the one being stopped
+  public: std::mutex lifecycleMutex;
+
+  /// \brief Protects vehicles and nextId
+  public: std::mutex mutex;
+
+  /// \brief Registered vehicles by id
+  public: std::map<int, std::shared_ptr<ArduPilotBridgeVehicle>> vehicles;
+
+  /// \brief Next vehicle id
+  public: int nextId = 0;
+
+  /// \brief epoll instance watching every vehicle socket
+  public: int epollFd = -1;
+
+  /// \brief eventfd used to wake up the I/O thread on shutdown
+  public: int wakeFd = -1;
+
+  /// \brief True while the I/O thread should keep running
+  public: bool running = false;
+
+  /// \brief I/O thread, running while at least one vehicle is registered
+  public: std::thread thread;
+};
+
+/// \brief epoll user data marking the wake up eventfd
+static const uint64_t kWakeEvent = ~0ull;
+
+/////////////////////////////////////////////////
+ArduPilotBridge::ArduPilotBridge()
+  : dataPtr(new ArduPilotBridgePrivate)
+{
+}
+
+/////////////////////////////////////////////////
+ArduPilotBridge::~ArduPilotBridge()
+{
+  #ifdef __linux__
+  std::lock_guard<std::mutex> lifecycleLock(this->dataPtr->lifecycleMutex);
+  // a plugin that never unregistered, do not leave a joinable thread behind
+  if (this->dataPtr->thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+      this->dataPtr->running = false;
+    }
+    const uint64_t one = 1;
+    if (write(this->dataPtr->wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+      // the eventfd counter cannot overflow here, nothing to do
+    }
+    this->dataPtr->thread.join();
+  }
+  if (this->dataPtr->epollFd != -1)
+    close(this->dataPtr->epollFd);
+  if (this->dataPtr->wakeFd != -1)
+    close(this->dataPtr->wakeFd);
+  #endif
+}
+
+/////////////////////////////////////////////////
+int ArduPilotBridge::Register(const int _fd, const size_t _packetSize)
+{
+  #ifdef __linux__
+  std::shared_ptr<ArduPilotBridgeVehicle> vehicle =
+    std::make_shared<ArduPilotBridgeVehicle>();
+  vehicle->fd = _fd;
+  vehicle->packet.resize(_packetSize);
+  vehicle->ring.resize(ArduPilotBridgeVehicle::kBatchSize * _packetSize);
+  for (unsigned int i = 0; i < ArduPilotBridgeVehicle::kBatchSize; ++i)
+  {
+    vehicle->iov[i].iov_base = &vehicle->ring[i * _packetSize];
+    vehicle->iov[i].iov_len = _packetSize;
+    memset(&vehicle->msgs[i], 0, sizeof(vehicle->msgs[i]));
+    vehicle->msgs[i].msg_hdr.msg_iov = &vehicle->iov[i];
+    vehicle->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  std::lock_guard<std::mutex> lifecycleLock(this->dataPtr->lifecycleMutex);
+  std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+
+  if (this->dataPtr->vehicles.empty())
+  {
+    this->dataPtr->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    this->dataPtr->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (this->dataPtr->epollFd == -1 || this->dataPtr->wakeFd == -1)
+    {
+      if (this->dataPtr->epollFd != -1)
+        close(this->dataPtr->epollFd);
+      if (this->dataPtr->wakeFd != -1)
+        close(this->dataPtr->wakeFd);
+      this->dataPtr->epollFd = -1;
+      this->dataPtr->wakeFd = -1;
+      return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = kWakeEvent;
+    epoll_ctl(this->dataPtr->epollFd, EPOLL_CTL_ADD, this->dataPtr->wakeFd,
+        &ev);
+  }
+
+  const int id = this->dataPtr->nextId++;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = static_cast<uint64_t>(id);
+  if (epoll_ctl(this->dataPtr->epollFd, EPOLL_CTL_ADD, _fd, &ev) != 0)
+  {
+    // nothing else registered, release what was set up for this vehicle
+    if (this->dataPtr->vehicles.empty())
+    {
+      close(this->dataPtr->epollFd);
+      close(this->dataPtr->wakeFd);
+      this->dataPtr->epollFd = -1;
+      this->dataPtr->wakeFd = -1;
+    }
+    return -1;
+  }
+
+  this->dataPtr->vehicles[id] = vehicle;
+
+  // started once the first vehicle is in, so a failed registration never
+  // leaves a thread running
+  if (!this->dataPtr->running)
+  {
+    this->dataPtr->running = true;
+    this->dataPtr->thread = std::thread(&ArduPilotBridge::Run, this);
+  }
+  return id;
+  #else
+  (void)_fd;
+  (void)_packetSize;
+  return -1;
+  #endif
+}
+
+/////////////////////////////////////////////////
+void ArduPilotBridge::Unregister(const int _id)
+{
+  #ifdef __linux__
+  std::lock_guard<std::mutex> lifecycleLock(this->dataPtr->lifecycleMutex);
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+    auto it = this->dataPtr->vehicles.find(_id);
+    if (it == this->dataPtr->vehicles.end())
+    {
+      return;
+    }
+    epoll_ctl(this->dataPtr->epollFd, EPOLL_CTL_DEL, it->second->fd, nullptr);
+    this->dataPtr->vehicles.erase(it);
+
+    if (!this->dataPtr->vehicles.empty())
+    {
+      return;
+    }
+
+    // last vehicle gone, stop the I/O thread
+    this->dataPtr->running = false;
+    const uint64_t one = 1;
+    if (write(this->dataPtr->wakeFd, &one, sizeof(one)) != sizeof(one))
+    {
+      // the eventfd counter cannot overflow here, nothing to do
+    }
+    thread = std::move(this->dataPtr->thread);
+  }
+
+  // the I/O thread only takes mutex, joining under lifecycleMutex is safe
+  if (thread.joinable())
+  {
+    thread.join();
+  }
+
+  // no Register could run since the thread was stopped, the fds are ours
+  std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+  close(this->dataPtr->epollFd);
+  close(this->dataPtr->wakeFd);
+  this->dataPtr->epollFd = -1;
+  this->dataPtr->wakeFd = -1;
+  #else
+  (void)_id;
+  #endif
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotBridge::Recv(const int _id, void *_buf, const size_t _size,
+    const uint32_t _timeoutMs, unsigned int &_dropped)
+{
+  _dropped = 0;
+
+  std::shared_ptr<ArduPilotBridgeVehicle> vehicle;
+  {
+    std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+    auto it = this->dataPtr->vehicles.find(_id);
+    if (it == this->dataPtr->vehicles.end())
+    {
+      return -1;
+    }
+    vehicle = it->second;
+  }
+
+  std::unique_lock<std::mutex> lock(vehicle->mutex);
+  if (!vehicle->cond.wait_for(lock, std::chrono::milliseconds(_timeoutMs),
+        [&vehicle] { return vehicle->fresh; }))
+  {
+    return -1;
+  }
+
+  const size_t len = std::min(static_cast<size_t>(vehicle->size), _size);
+  memcpy(_buf, vehicle->packet.data(), len);
+  _dropped = vehicle->dropped;
+  vehicle->fresh = false;
+  vehicle->dropped = 0;
+  return len;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotBridge::Run()
+{
+  #ifdef __linux__
+  const int kMaxEvents = 64;
+  struct epoll_event events[kMaxEvents];
+
+  while (true)
+  {
+    const int n = epoll_wait(this->dataPtr->epollFd, events, kMaxEvents, -1);
+
+    std::lock_guard<std::mutex> registryLock(this->dataPtr->mutex);
+    if (!this->dataPtr->running)
+    {
+      return;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+      if (events[i].data.u64 == kWakeEvent)
+      {
+        continue;
+      }
+
+      auto it = this->dataPtr->vehicles.find(
+          static_cast<int>(events[i].data.u64));
+      if (it == this->dataPtr->vehicles.end())
+      {
+        continue;
+      }
+      ArduPilotBridgeVehicle &vehicle = *it->second;
+
+      // drain the socket, keep only the newest packet
+      unsigned int count = 0;
+      int newest = -1;
+      while (true)
+      {
+        const int m = recvmmsg(vehicle.fd, vehicle.msgs,
+            ArduPilotBridgeVehicle::kBatchSize, MSG_DONTWAIT, nullptr);
+        if (m <= 0)
+        {
+          break;
+        }
+        count += m;
+        newest = m - 1;
+        if (m < static_cast<int>(ArduPilotBridgeVehicle::kBatchSize))
+        {
+          break;
+        }
+      }
+
+      if (newest < 0)
+      {
+        continue;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(vehicle.mutex);
+        vehicle.size = vehicle.msgs[newest].msg_len;
+        memcpy(vehicle.packet.data(), vehicle.iov[newest].iov_base,
+            vehicle.size);
+        vehicle.dropped += count - 1 + (vehicle.fresh ? 1 : 0);
+        vehicle.fresh = true;
+      }
+      vehicle.cond.notify_one();
+    }
+  }
+  #endif
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#include <cstring>
+#include "include/ArduPilotBridge.hh"
+#include "include/ArduPilotLink.hh"
+#include "include/ArduPilotSender.hh"
+#include "include/ArduPilotShm.hh"
+
+using namespace gazebo;
+
+/////////////////////////////////////////////////
+ArduPilotLink::ArduPilotLink()
+  : state()
+{
+}
+
+/////////////////////////////////////////////////
+ArduPilotLink::~ArduPilotLink()
+{
+  // the bridge thread and the sender thread use the transport
+  if (this->bridgeId >= 0)
+  {
+    ArduPilotBridge::Instance()->Unregister(this->bridgeId);
+  }
+  this->sender.reset();
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::OpenUdp(const std::string &_listenAddr,
+    const uint16_t _portIn, const std::string &_fdmAddr,
+    const uint16_t _portOut)
+{
+  return this->socketIn.Bind(_listenAddr.c_str(), _portIn) &&
+    this->socketOut.Connect(_fdmAddr.c_str(), _portOut);
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::OpenShm(const std::string &_name)
+{
+  this->shm.reset(new ArduPilotShm);
+  if (!this->shm->Create(_name))
+  {
+    this->shm.reset();
+    return false;
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::UseBridge()
+{
+  if (this->shm)
+  {
+    return false;
+  }
+  this->bridgeId = ArduPilotBridge::Instance()->Register(
+      this->socketIn.Handle(), kServoPacketMaxSize);
+  return this->bridgeId >= 0;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotLink::UseSender()
+{
+  this->sender.reset(new ArduPilotSender(
+      [this](const void *_buf, size_t _size)
+      {
+        this->Send(_buf, _size);
+      }, kFdmPacketMaxSize));
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotLink::Receive(const uint32_t _timeoutMs)
+{
+  // received in place, no need to clear the buffer
+  uint8_t *pkt = this->servoBuffer;
+  this->drained = 0;
+
+  ssize_t recvSize;
+  if (this->bridgeId >= 0)
+  {
+    // the shared bridge already drained the socket for us
+    recvSize = ArduPilotBridge::Instance()->Recv(this->bridgeId,
+        pkt, kServoPacketMaxSize, _timeoutMs, this->drained);
+  }
+  else
+  {
+    recvSize = this->shm ?
+      this->shm->Recv(pkt, kServoPacketMaxSize, _timeoutMs) :
+      this->socketIn.Recv(pkt, kServoPacketMaxSize, _timeoutMs);
+
+    // Drain the socket in the case we're backed up,
+    // only the newest packet is copied into pkt
+    if (recvSize != -1)
+    {
+      const ssize_t recvSizeLast = this->shm ?
+        this->shm->RecvLatest(pkt, kServoPacketMaxSize, this->drained) :
+        this->socketIn.RecvLatest(pkt, kServoPacketMaxSize, this->drained);
+      if (recvSizeLast != -1)
+      {
+        recvSize = recvSizeLast;
+      }
+    }
+  }
+
+  if (recvSize != -1)
+  {
+    this->received += 1 + this->drained;
+    this->dropped += this->drained;
+  }
+  return recvSize;
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotLink::Inject(const void *_buf, const size_t _size)
+{
+  this->drained = 0;
+  if (_size > kServoPacketMaxSize)
+  {
+    return -1;
+  }
+  std::memcpy(this->servoBuffer, _buf, _size);
+  ++this->received;
+  return _size;
+}
+
+/////////////////////////////////////////////////
+const uint8_t *ArduPilotLink::ServoPacket() const
+{
+  return this->servoBuffer;
+}
+
+/////////////////////////////////////////////////
+unsigned int ArduPilotLink::Drained() const
+{
+  return this->drained;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::Parse(const ssize_t _size, ServoCommand &_servo)
+{
+  this->versionChanged = false;
+  if (!ParseServoPacket(this->servoBuffer, _size, _servo))
+  {
+    return false;
+  }
+
+  // the packet layout is negotiated by whatever ArduPilot sends
+  const int version = _servo.versioned ? kServoPacketVersion : 0;
+  if (version != this->servoPacketVersion)
+  {
+    this->servoPacketVersion = version;
+    this->versionChanged = true;
+    this->frameValid = false;
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::Accept(const ServoCommand &_servo)
+{
+  if (!_servo.versioned)
+  {
+    return true;
+  }
+
+  if (this->frameValid)
+  {
+    const uint32_t gap = _servo.frameCount - this->lastFrame;
+    if (gap == 0 || gap > 0x80000000u)
+    {
+      // duplicate or reordered frame, keep applying the newer one
+      ++this->framesOutOfOrder;
+      return false;
+    }
+    // frames drained from a backed up socket were received, not lost
+    if (gap - 1 > this->drained)
+    {
+      this->framesLost += gap - 1 - this->drained;
+    }
+  }
+  this->lastFrame = _servo.frameCount;
+  this->frameValid = true;
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::VersionChanged() const
+{
+  return this->versionChanged;
+}
+
+/////////////////////////////////////////////////
+int ArduPilotLink::ServoPacketVersion() const
+{
+  return this->servoPacketVersion;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotLink::ResetFrames()
+{
+  this->frameValid = false;
+}
+
+/////////////////////////////////////////////////
+fdmPacketExt &ArduPilotLink::State()
+{
+  return this->state.pkt;
+}
+
+/////////////////////////////////////////////////
+size_t ArduPilotLink::FinishState(const int _fdmVersion,
+    const ImuBatchSample *_samples, const uint16_t _count)
+{
+  size_t size = _fdmVersion >= 2 ? sizeof(fdmPacketExt) : sizeof(fdmPacket);
+  if (_samples)
+  {
+    // every sample since the last packet, right after the fields in use
+    uint8_t *batch = reinterpret_cast<uint8_t *>(&this->state) + size;
+    ImuBatchHeader header;
+    header.magic = kImuBatchMagic;
+    header.version = kImuBatchVersion;
+    header.sampleCount = _count;
+    std::memcpy(batch, &header, sizeof(header));
+    std::memcpy(batch + sizeof(header), _samples,
+        _count * sizeof(ImuBatchSample));
+    size += sizeof(header) + _count * sizeof(ImuBatchSample);
+  }
+  return size;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotLink::SendState(const size_t _size)
+{
+  if (this->sender)
+  {
+    this->sender->Publish(&this->state, _size);
+  }
+  else
+  {
+    this->Send(&this->state, _size);
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotLink::Send(const void *_buf, const size_t _size)
+{
+  if (this->shm)
+  {
+    this->shm->Send(_buf, _size);
+  }
+  else
+  {
+    this->socketOut.Send(_buf, _size);
+  }
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotLink::Received() const
+{
+  return this->received;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotLink::Dropped() const
+{
+  return this->dropped;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotLink::FramesLost() const
+{
+  return this->framesLost;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotLink::FramesOutOfOrder() const
+{
+  return this->framesOutOfOrder;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotLink::Async() const
+{
+  return this->sender != nullptr;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotLink::Coalesced() const
+{
+  return this->sender ? this->sender->Coalesced() : 0;
+}
@@ -15,26 +15,12 @@
  *
 */
 #include <functional>
-#include <fcntl.h>
-#ifdef _WIN32
-  #include <Winsock2.h>
-  #include <Ws2def.h>
-  #include <Ws2ipdef.h>
-  #include <Ws2tcpip.h>
-  using raw_type = char;
-#else
-  #include <sys/socket.h>
-  #include <netinet/in.h>
-  #include <netinet/tcp.h>
-  #include <arpa/inet.h>
-  using raw_type = void;
-#endif
-
-#if defined(_MSC_VER)
-  #include <BaseTsd.h>
-  typedef SSIZE_T ssize_t;
-#endif
-
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -45,73 +31,147 @@
 #include <gazebo/msgs/msgs.hh>
 #include <gazebo/sensors/sensors.hh>
 #include <gazebo/transport/transport.hh>
+#include "include/ArduPilotImuRing.hh"
+#include "include/ArduPilotLink.hh"
 #include "include/ArduPilotPlugin.hh"
-
-#define MAX_MOTORS 255
+#include "include/ArduPilotProtocol.hh"
+#include "include/ArduPilotRecorder.hh"
+#include "include/ArduPilotSensorErrors.hh"
+#include "include/ArduPilotStats.hh"
 
 using namespace gazebo;
 
 GZ_REGISTER_MODEL_PLUGIN(ArduPilotPlugin)
 
-/// \brief A servo packet.
-struct ServoPacket
-{
-  /// \brief Motor speed data.
-  /// should rename to servo_command here and in ArduPilot SIM_Gazebo.cpp
-  float motorSpeed[MAX_MOTORS] = {0.0f};
-};
-
-/// \brief Flight Dynamics Model packet that is sent back to the ArduPilot
-struct fdmPacket
+/// \brief Find a sensor of a model, trying every scoped name matching
+/// _name before the unscoped name.
+/// \param[in] _model Model owning the sensor.
+/// \param[in] _modelName Model name, for log messages.
+/// \param[in] _name Sensor name.
+/// \return The sensor, null if not found.
+template<typename SensorT>
+static std::shared_ptr<SensorT> FindSensor(const physics::ModelPtr &_model,
+    const std::string &_modelName, const std::string &_name)
 {
-  /// \brief packet timestamp
-  double timestamp;
-
-  /// \brief IMU angular velocity
-  double imuAngularVelocityRPY[3];
-
-  /// \brief IMU linear acceleration
-  double imuLinearAccelerationXYZ[3];
-
-  /// \brief IMU quaternion orientation
-  double imuOrientationQuat[4];
+  std::vector<std::string> scopedName = _model->SensorScopedName(_name);
 
-  /// \brief Model velocity in NED frame
-  double velocityXYZ[3];
+  if (scopedName.size() > 1)
+  {
+    gzwarn << "[" << _modelName << "] "
+           << "multiple names match [" << _name << "] using first found"
+           << " name.\n";
+    for (unsigned k = 0; k < scopedName.size(); ++k)
+    {
+      gzwarn << "  sensor " << k << " [" << scopedName[k] << "].\n";
+    }
+  }
 
-  /// \brief Model position in NED frame
-  double positionXYZ[3];
-/*  NOT MERGED IN MASTER YET
-  /// \brief Model latitude in WGS84 system
-  double latitude = 0.0;
+  std::shared_ptr<SensorT> sensor;
+  for (unsigned k = 0; k < scopedName.size(); ++k)
+  {
+    sensor = std::dynamic_pointer_cast<SensorT>
+      (sensors::SensorManager::Instance()->GetSensor(scopedName[k]));
+    if (sensor)
+    {
+      if (k > 0)
+      {
+        gzwarn << "[" << _modelName << "] "
+               << "first scoped name [" << scopedName[0]
+               << "] not found, found [" << scopedName[k] << "]\n";
+      }
+      return sensor;
+    }
+  }
 
-  /// \brief Model longitude in WGS84 system
-  double longitude = 0.0;
+  gzwarn << "[" << _modelName << "] "
+         << "sensor scoped name [" << _name
+         << "] not found, trying unscoped name.\n";
+  // TODO: this fails for multi-nested models.
+  // TODO: and transforms fail for rotated nested model,
+  //       joints point the wrong way.
+  return std::dynamic_pointer_cast<SensorT>
+    (sensors::SensorManager::Instance()->GetSensor(_name));
+}
 
-  /// \brief Model altitude from GPS
-  double altitude = 0.0;
+/// \brief Read the error model of one imu sensor, from the plugin
+/// parameters <imu{_sensor}Noise>, <imu{_sensor}Bias> and so on.
+/// \param[in] _sdf Plugin sdf.
+/// \param[in] _sensor Accel or Gyro.
+/// \return Error model, no error for missing parameters.
+static ImuErrorModel ReadImuErrorModel(sdf::ElementPtr _sdf,
+    const std::string &_sensor)
+{
+  const std::string prefix = "imu" + _sensor;
+  ImuErrorModel model;
+  model.noise = _sdf->Get(prefix + "Noise", 0.0).first;
+  model.biasStd = _sdf->Get(prefix + "BiasStd", 0.0).first;
+  model.biasTau = _sdf->Get(prefix + "BiasTau", model.biasTau).first;
+  const ignition::math::Vector3d bias =
+    _sdf->Get(prefix + "Bias", ignition::math::Vector3d::Zero).first;
+  const ignition::math::Vector3d vibration =
+    _sdf->Get(prefix + "Vibration", ignition::math::Vector3d::Zero).first;
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    model.bias[i] = bias[i];
+    model.vibration[i] = vibration[i];
+  }
+  return model;
+}
 
-  /// \brief Model estimated from airspeed sensor (e.g. Pitot) in m/s
-  double airspeed = 0.0;
+/// \brief Control law driving a control joint. Parsed once in Load, new
+/// laws get a value here and a case in ArduPilotPlugin::ApplyMotorForces.
+enum class ControlLaw : uint8_t
+{
+  /// \brief Control velocity of joint
+  VELOCITY,
 
-  /// \brief Battery voltage. Default to -1 to use sitl estimator.
-  double battery_voltage = -1.0;
+  /// \brief Control position of joint
+  POSITION,
 
-  /// \brief Battery Current.
-  double battery_current = 0.0;
+  /// \brief Control effort of joint
+  EFFORT,
 
-  /// \brief Model rangefinder value. Default to -1 to use sitl rangefinder.
-  double rangefinder = -1.0;
-*/
+  /// \brief Virtual rotor: first order motor model, thrust and drag torque
+  /// applied to a link, no spinning joint
+  ROTOR
 };
 
-/// \brief Control class
+/// \brief Parse a control law from its sdf name.
+/// \param[in] _name VELOCITY, POSITION, EFFORT or ROTOR.
+/// \param[out] _law Parsed control law, untouched on failure.
+/// \return True if _name is a known control law.
+static bool ParseControlLaw(const std::string &_name, ControlLaw &_law)
+{
+  if (_name == "VELOCITY")
+  {
+    _law = ControlLaw::VELOCITY;
+  }
+  else if (_name == "POSITION")
+  {
+    _law = ControlLaw::POSITION;
+  }
+  else if (_name == "EFFORT")
+  {
+    _law = ControlLaw::EFFORT;
+  }
+  else if (_name == "ROTOR")
+  {
+    _law = ControlLaw::ROTOR;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/// \brief Control description, as parsed from the <control> block
 class Control
 {
   /// \brief Constructor
   public: Control()
   {
-    // most of these coefficients are not used yet.
+    // filter coefficients are only used when frequencyCutoff is set.
     this->rotorVelocitySlowdownSim = this->kDefaultRotorVelocitySlowdownSim;
     this->frequencyCutoff = this->kDefaultFrequencyCutoff;
     this->samplingRate = this->kDefaultSamplingRate;
@@ -125,17 +185,11 @@ class Control
   /// \brief control id / channel
   public: int channel = 0;
 
-  /// \brief Next command to be applied to the propeller
-  public: double cmd = 0;
-
   /// \brief Velocity PID for motor control
   public: common::PID pid;
 
-  /// \brief Control type. Can be:
-  /// VELOCITY control velocity of joint
-  /// POSITION control position of joint
-  /// EFFORT control effort of joint
-  public: std::string type;
+  /// \brief Control law
+  public: ControlLaw law = ControlLaw::VELOCITY;
 
   /// \brief use force controler
   public: bool useForce = true;
@@ -152,12 +206,46 @@ class Control
   /// \brief input command offset
   public: double offset = 0;
 
-  /// \brief unused coefficients
+  /// \brief rotor velocity slowdown, for rotor aliasing problem
   public: double rotorVelocitySlowdownSim;
+
+  /// \brief filter the joint state fed to the controller
+  public: bool useFilter = false;
+
+  /// \brief joint state filter coefficients
   public: double frequencyCutoff;
   public: double samplingRate;
   public: ignition::math::OnePole<double> filter;
 
+  /// \brief Virtual rotor: link receiving thrust and torque
+  public: physics::LinkPtr link;
+
+  /// \brief Virtual rotor: position in the link frame, thrust along z
+  public: ignition::math::Pose3d rotorPose;
+
+  /// \brief Virtual rotor: thrust per squared rotor velocity, N/(rad/s)^2
+  public: double motorConstant = 8.54858e-06;
+
+  /// \brief Virtual rotor: drag torque per thrust, m
+  public: double momentConstant = 0.016;
+
+  /// \brief Virtual rotor: spin up time constant, s
+  public: double timeConstantUp = 0.0125;
+
+  /// \brief Virtual rotor: spin down time constant, s
+  public: double timeConstantDown = 0.025;
+
+  /// \brief Virtual rotor: max rotor velocity, rad/s
+  public: double maxRotVelocity = 1100.0;
+
+  /// \brief Virtual rotor: in-plane drag force per rotor velocity per
+  /// in-plane airspeed, N s^2/(rad m)
+  public: double rotorDragCoefficient = 0.0;
+
+  /// \brief Virtual rotor: blade flapping moment per rotor velocity per
+  /// in-plane airspeed, N s^2/rad
+  public: double rollingMomentCoefficient = 0.0;
+
   public: static double kDefaultRotorVelocitySlowdownSim;
   public: static double kDefaultFrequencyCutoff;
   public: static double kDefaultSamplingRate;
@@ -167,150 +255,258 @@ double Control::kDefaultRotorVelocitySlowdownSim = 10.0;
 double Control::kDefaultFrequencyCutoff = 5.0;
 double Control::kDefaultSamplingRate = 0.2;
 
-// Private data class
-class gazebo::ArduPilotSocketPrivate
+/// \brief Controls of a vehicle, stored as one array per field so the
+/// per-step loops walk contiguous memory and only touch the fields they
+/// use.
+class ControlArrays
 {
-  /// \brief constructor
-  public: ArduPilotSocketPrivate()
+  /// \brief Append a control.
+  /// \param[in] _control Parsed control description.
+  public: void Add(const Control &_control)
   {
-    // initialize socket udp socket
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
-    #ifndef _WIN32
-    // Windows does not support FD_CLOEXEC
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
-    #endif
+    this->law.push_back(_control.law);
+    this->useForce.push_back(_control.useForce);
+    this->channel.push_back(_control.channel);
+    this->multiplier.push_back(_control.multiplier);
+    this->offset.push_back(_control.offset);
+    this->cmd.push_back(0.0);
+    this->velocityScale.push_back(1.0 / _control.rotorVelocitySlowdownSim);
+    this->joint.push_back(_control.joint);
+    this->pid.push_back(_control.pid);
+    this->force.push_back(0.0);
+    this->useFilter.push_back(_control.useFilter);
+    this->filter.push_back(_control.filter);
+    this->jointName.push_back(_control.jointName);
   }
 
-  /// \brief destructor
-  public: ~ArduPilotSocketPrivate()
+  /// \brief Number of controls.
+  public: size_t Size() const
   {
-    if (fd != -1)
-    {
-      ::close(fd);
-      fd = -1;
-    }
+    return this->law.size();
   }
 
-  /// \brief Bind to an adress and port
-  /// \param[in] _address Address to bind to.
-  /// \param[in] _port Port to bind to.
-  /// \return True on success.
-  public: bool Bind(const char *_address, const uint16_t _port)
-  {
-    struct sockaddr_in sockaddr;
-    this->MakeSockAddr(_address, _port, sockaddr);
+  /// \brief Control law of each control
+  public: std::vector<ControlLaw> law;
 
-    if (bind(this->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) != 0)
-    {
-      shutdown(this->fd, 0);
-      #ifdef _WIN32
-      closesocket(this->fd);
-      #else
-      close(this->fd);
-      #endif
-      return false;
-    }
-    int one = 1;
-    setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR,
-        reinterpret_cast<const char *>(&one), sizeof(one));
-
-    #ifdef _WIN32
-    u_long on = 1;
-    ioctlsocket(this->fd, FIONBIO,
-              reinterpret_cast<u_long FAR *>(&on));
-    #else
-    fcntl(this->fd, F_SETFL,
-        fcntl(this->fd, F_GETFL, 0) | O_NONBLOCK);
-    #endif
-    return true;
-  }
+  /// \brief Drive the joint through forces rather than setting its state,
+  /// uint8_t rather than bool to keep a plain array
+  public: std::vector<uint8_t> useForce;
 
-  /// \brief Connect to an adress and port
-  /// \param[in] _address Address to connect to.
-  /// \param[in] _port Port to connect to.
-  /// \return True on success.
-  public : bool Connect(const char *_address, const uint16_t _port)
-  {
-    struct sockaddr_in sockaddr;
-    this->MakeSockAddr(_address, _port, sockaddr);
+  /// \brief Servo channel of each control
+  public: std::vector<int> channel;
 
-    if (connect(this->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) != 0)
+  /// \brief Command multiplier
+  public: std::vector<double> multiplier;
+
+  /// \brief Command offset
+  public: std::vector<double> offset;
+
+  /// \brief Next command to be applied to the joint
+  public: std::vector<double> cmd;
+
+  /// \brief Inverse of rotorVelocitySlowdownSim
+  public: std::vector<double> velocityScale;
+
+  /// \brief Controlled joint
+  public: std::vector<physics::JointPtr> joint;
+
+  /// \brief PID of force controlled joints
+  public: std::vector<common::PID> pid;
+
+  /// \brief Last force applied to the joint, held between controller
+  /// updates
+  public: std::vector<double> force;
+
+  /// \brief Filter the joint state fed to the PID
+  public: std::vector<uint8_t> useFilter;
+
+  /// \brief Joint state filters
+  public: std::vector<ignition::math::OnePole<double>> filter;
+
+  /// \brief Joint names, for log messages
+  public: std::vector<std::string> jointName;
+};
+
+/// \brief Virtual rotors of a vehicle, one array per field and one array
+/// per vector component, so the aerodynamics of all rotors are computed in
+/// plain loops the compiler can vectorize. Rotors only exist here, their
+/// control has no joint.
+class RotorArrays
+{
+  /// \brief Append a rotor.
+  /// \param[in] _control Parsed control description.
+  /// \param[in] _index Index of the control in ControlArrays.
+  public: void Add(const Control &_control, const unsigned int _index)
+  {
+    const ignition::math::Vector3d axis = _control.rotorPose.Rot().RotateVector(
+        ignition::math::Vector3d::UnitZ);
+    this->control.push_back(_index);
+    this->link.push_back(_control.link);
+    this->px.push_back(_control.rotorPose.Pos().X());
+    this->py.push_back(_control.rotorPose.Pos().Y());
+    this->pz.push_back(_control.rotorPose.Pos().Z());
+    this->ax.push_back(axis.X());
+    this->ay.push_back(axis.Y());
+    this->az.push_back(axis.Z());
+    this->motorConstant.push_back(_control.motorConstant);
+    this->momentConstant.push_back(_control.momentConstant);
+    this->timeConstantUp.push_back(_control.timeConstantUp);
+    this->timeConstantDown.push_back(_control.timeConstantDown);
+    this->maxRotVelocity.push_back(_control.maxRotVelocity);
+    this->rotorDragCoefficient.push_back(_control.rotorDragCoefficient);
+    this->rollingMomentCoefficient.push_back(
+        _control.rollingMomentCoefficient);
+    this->velocity.push_back(0.0);
+    for (std::vector<double> *v : {&this->vx, &this->vy, &this->vz,
+        &this->fx, &this->fy, &this->fz, &this->tx, &this->ty, &this->tz})
     {
-      shutdown(this->fd, 0);
-      #ifdef _WIN32
-      closesocket(this->fd);
-      #else
-      close(this->fd);
-      #endif
-      return false;
+      v->push_back(0.0);
     }
-    int one = 1;
-    setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR,
-        reinterpret_cast<const char *>(&one), sizeof(one));
-
-    #ifdef _WIN32
-    u_long on = 1;
-    ioctlsocket(this->fd, FIONBIO,
-              reinterpret_cast<u_long FAR *>(&on));
-    #else
-    fcntl(this->fd, F_SETFL,
-        fcntl(this->fd, F_GETFL, 0) | O_NONBLOCK);
-    #endif
-    return true;
   }
 
-  /// \brief Make a socket
-  /// \param[in] _address Socket address.
-  /// \param[in] _port Socket port
-  /// \param[out] _sockaddr New socket address structure.
-  public: void MakeSockAddr(const char *_address, const uint16_t _port,
-    struct sockaddr_in &_sockaddr)
+  /// \brief Number of rotors.
+  public: size_t Size() const
   {
-    memset(&_sockaddr, 0, sizeof(_sockaddr));
+    return this->control.size();
+  }
 
-    #ifdef HAVE_SOCK_SIN_LEN
-      _sockaddr.sin_len = sizeof(_sockaddr);
-    #endif
+  /// \brief Index of the rotor control in ControlArrays
+  public: std::vector<unsigned int> control;
 
-    _sockaddr.sin_port = htons(_port);
-    _sockaddr.sin_family = AF_INET;
-    _sockaddr.sin_addr.s_addr = inet_addr(_address);
-  }
+  /// \brief Link receiving thrust and torque
+  public: std::vector<physics::LinkPtr> link;
+
+  /// \brief Rotor position in the link frame
+  public: std::vector<double> px, py, pz;
+
+  /// \brief Thrust direction in the link frame
+  public: std::vector<double> ax, ay, az;
+
+  /// \brief Thrust per squared rotor velocity
+  public: std::vector<double> motorConstant;
+
+  /// \brief Drag torque per thrust
+  public: std::vector<double> momentConstant;
+
+  /// \brief Spin up time constant
+  public: std::vector<double> timeConstantUp;
+
+  /// \brief Spin down time constant
+  public: std::vector<double> timeConstantDown;
+
+  /// \brief Max rotor velocity
+  public: std::vector<double> maxRotVelocity;
+
+  /// \brief In-plane drag force per rotor velocity per in-plane airspeed
+  public: std::vector<double> rotorDragCoefficient;
+
+  /// \brief Blade flapping moment per rotor velocity per in-plane airspeed
+  public: std::vector<double> rollingMomentCoefficient;
+
+  /// \brief Rotor velocity, signed by the turning direction
+  public: std::vector<double> velocity;
+
+  /// \brief Air velocity at the rotor in the link frame
+  public: std::vector<double> vx, vy, vz;
+
+  /// \brief Last force in the link frame, held between controller updates
+  public: std::vector<double> fx, fy, fz;
+
+  /// \brief Last torque in the link frame, held between controller updates
+  public: std::vector<double> tx, ty, tz;
+};
+
+/// \brief Source of the imu fields of the state packet
+enum class ImuMode : uint8_t
+{
+  /// \brief Whatever the imu sensor last measured
+  SENSOR,
+
+  /// \brief Newest imu sample measured at or before the step
+  STEP,
+
+  /// \brief STEP, plus every sample since the last state packet appended
+  /// as an imu batch
+  BATCH,
+
+  /// \brief Computed from the imu link state every exchange, the imu
+  /// sensor is not needed
+  KINEMATIC
+};
+
+/// \brief State of the link with ArduPilot
+enum class gazebo::ConnectionState : uint8_t
+{
+  /// \brief No ArduPilot, physics runs free, motors are not driven
+  OFFLINE,
+
+  /// \brief First servo packets received, confirming ArduPilot is there
+  HANDSHAKE,
 
-  public: ssize_t Send(const void *_buf, size_t _size)
+  /// \brief Every step gets its servo packet
+  LOCKSTEP,
+
+  /// \brief Servo packets stopped coming, physics runs free on the last
+  /// command until ArduPilot comes back or a deadline expires
+  DEGRADED
+};
+
+/// \brief Name of a connection state, for log messages.
+/// \param[in] _state Connection state.
+/// \return State name.
+static const char *ConnectionStateName(const ConnectionState _state)
+{
+  switch (_state)
   {
-    return send(this->fd, _buf, _size, 0);
+    case ConnectionState::OFFLINE:
+      return "offline";
+    case ConnectionState::HANDSHAKE:
+      return "handshake";
+    case ConnectionState::LOCKSTEP:
+      return "lockstep";
+    case ConnectionState::DEGRADED:
+      return "degraded";
+    default:
+      break;
   }
+  return "unknown";
+}
 
-  /// \brief Receive data
-  /// \param[out] _buf Buffer that receives the data.
-  /// \param[in] _size Size of the buffer.
-  /// \param[in] _timeoutMS Milliseconds to wait for data.
-  public: ssize_t Recv(void *_buf, const size_t _size, uint32_t _timeoutMs)
-  {
-    fd_set fds;
-    struct timeval tv;
+/// \brief Hot path instrumentation of the ArduPilot bridge
+class ArduPilotPluginStats
+{
+  /// \brief Whole OnUpdate
+  public: LatencyHistogram step;
 
-    FD_ZERO(&fds);
-    FD_SET(this->fd, &fds);
+  /// \brief Waiting for and decoding the servo packet
+  public: LatencyHistogram recv;
 
-    tv.tv_sec = _timeoutMs / 1000;
-    tv.tv_usec = (_timeoutMs % 1000) * 1000UL;
+  /// \brief ApplyMotorForces
+  public: LatencyHistogram apply;
 
-    if (select(this->fd+1, &fds, NULL, NULL, &tv) != 1)
-    {
-        return -1;
-    }
+  /// \brief Building and sending the state packet
+  public: LatencyHistogram send;
 
-    #ifdef _WIN32
-    return recv(this->fd, reinterpret_cast<char *>(_buf), _size, 0);
-    #else
-    return recv(this->fd, _buf, _size, 0);
-    #endif
-  }
+  /// \brief Wall time between two reports
+  public: std::chrono::steady_clock::duration period;
+
+  /// \brief Wall time of the last report
+  public: std::chrono::steady_clock::time_point lastWallTime;
+
+  /// \brief Sim time of the last report
+  public: common::Time lastSimTime;
+
+  /// \brief Transport node publishing the reports
+  public: transport::NodePtr node;
+
+  /// \brief Publisher of the reports
+  public: transport::PublisherPtr pub;
+
+  /// \brief Report message, reused
+  public: msgs::Param_V msg;
 
-  /// \brief Socket handle
-  private: int fd;
+  /// \brief Optional file receiving the reports as csv
+  public: std::ofstream file;
 };
 
 // Private data class
@@ -326,19 +522,57 @@ class gazebo::ArduPilotPluginPrivate
   public: std::string modelName;
 
   /// \brief array of propellers
-  public: std::vector<Control> controls;
+  public: ControlArrays controls;
+
+  /// \brief virtual rotors, a subset of controls
+  public: RotorArrays rotors;
 
   /// \brief keep track of controller update sim-time.
   public: gazebo::common::Time lastControllerUpdateTime;
 
-  /// \brief Controller update mutex.
-  public: std::mutex mutex;
+  /// \brief Sim time of the last motor controller update
+  public: gazebo::common::Time lastMotorUpdateTime;
+
+  /// \brief Physics steps since Load, drives the decimation below
+  public: uint64_t updateCount = 0;
+
+  /// \brief Exchange packets with ArduPilot every fdmDecimation steps
+  public: unsigned int fdmDecimation = 1;
+
+  /// \brief Run the motor controllers every controlDecimation steps
+  public: unsigned int controlDecimation = 1;
+
+  /// \brief World of the model, cached at Load
+  public: physics::WorldPtr world;
+
+  /// \brief Canonical link of the model, cached at Load
+  public: physics::LinkPtr rootLink;
+
+  /// \brief Packet exchange with ArduPilot, the state packet is filled
+  /// in place every exchange
+  public: ArduPilotLink link;
+
+  /// \brief Log of the exchanged packets, null when not recording
+  public: std::unique_ptr<ArduPilotRecorder> recorder;
 
-  /// \brief Ardupilot Socket for receive motor command on gazebo
-  public: ArduPilotSocketPrivate socket_in;
+  /// \brief True once a packet could not be recorded
+  public: bool recordFailed = false;
 
-  /// \brief Ardupilot Socket to send state to Ardupilot
-  public: ArduPilotSocketPrivate socket_out;
+  /// \brief Recorded packets replacing ArduPilot, null when not replaying
+  public: std::unique_ptr<ArduPilotReplay> replay;
+
+  /// \brief True once the replay ended or lost sync with the recording
+  public: bool replayDone = false;
+
+  /// \brief True once the sim time left the one of the recording
+  public: bool replayTimeWarned = false;
+
+  /// \brief Largest difference between the sim time and the recorded one,
+  /// half a physics step
+  public: double replayTimeTolerance = 0.0;
+
+  /// \brief State packets differing from the recorded ones
+  public: uint64_t replayMismatches = 0;
 
   /// \brief Ardupilot address
   public: std::string fdm_addr;
@@ -361,16 +595,150 @@ class gazebo::ArduPilotPluginPrivate
   /// \brief Pointer to an Rangefinder sensor
   public: sensors::RaySensorPtr rangefinderSensor;
 
+  /// \brief Source of the imu fields of the state packet
+  public: ImuMode imuMode = ImuMode::SENSOR;
+
+  /// \brief Imu samples queued by the sensor thread, null with
+  /// ImuMode::SENSOR. Declared before sensorConnections so it outlives
+  /// the connection pushing into it.
+  public: std::unique_ptr<ArduPilotImuRing> imuRing;
+
+  /// \brief Sensor update event connections
+  public: std::vector<event::ConnectionPtr> sensorConnections;
+
+  /// \brief Newest imu sample taken from imuRing
+  public: ImuBatchSample imuSample;
+
+  /// \brief True once imuSample holds a sample
+  public: bool imuSampleValid = false;
+
+  /// \brief Age of imuSample past which it is stale: an imu period and
+  /// an exchange period, seconds
+  public: double imuMaxAge = 0.0;
+
+  /// \brief True until the first state packet after leaving OFFLINE
+  /// checked the age of its imu sample
+  public: bool imuReconnectCheck = false;
+
+  /// \brief Samples of the imu batch being built
+  public: ImuBatchSample imuBatch[kImuBatchMaxSamples];
+
+  /// \brief Number of samples in imuBatch
+  public: uint16_t imuBatchCount = 0;
+
+  /// \brief Link carrying the imu, ImuMode::KINEMATIC
+  public: physics::LinkPtr imuLink;
+
+  /// \brief Imu pose in the imu link frame, ImuMode::KINEMATIC
+  public: ignition::math::Pose3d imuPose;
+
+  /// \brief Imu velocity in the world frame at the previous exchange,
+  /// ImuMode::KINEMATIC
+  public: ignition::math::Vector3d imuLastVel;
+
+  /// \brief Sim time of imuLastVel, negative before the first exchange
+  public: double imuLastTime = -1.0;
+
+  /// \brief Noise, bias and vibration added to the imu fields
+  public: ArduPilotSensorErrors imuErrors;
+
+  /// \brief Rotor velocities handed to imuErrors, rad/s
+  public: std::vector<double> rotorVelocities;
+
+  /// \brief State packets sent without a new imu sample
+  public: uint64_t imuStale = 0;
+
+  /// \brief Imu samples too many for a batch, oldest dropped
+  public: uint64_t imuDropped = 0;
+
+  /// \brief Protects the cached sensor values below
+  public: std::mutex sensorMutex;
+
+  /// \brief Last gps latitude in degrees
+  public: double latitude = 0.0;
+
+  /// \brief Last gps longitude in degrees
+  public: double longitude = 0.0;
+
+  /// \brief Last gps altitude
+  public: double altitude = 0.0;
+
+  /// \brief Last rangefinder value, -1 to use sitl rangefinder
+  public: double rangefinder = -1.0;
+
+  /// \brief Version of the state packet sent to ArduPilot,
+  /// 1 for fdmPacket, 2 for fdmPacketExt
+  public: int fdmVersion = 1;
+
   /// \brief false before ardupilot controller is online
-  /// to allow gazebo to continue without waiting
+  /// to allow gazebo to continue without waiting,
+  /// true in every connection state but OFFLINE
   public: bool arduPilotOnline;
 
+  /// \brief State of the link with ArduPilot
+  public: ConnectionState connectionState = ConnectionState::OFFLINE;
+
   /// \brief number of times ArduCotper skips update
   public: int connectionTimeoutCount;
 
   /// \brief number of times ArduCotper skips update
   /// before marking ArduPilot offline
   public: int connectionTimeoutMaxCount;
+
+  /// \brief Consecutive servo packets needed to leave HANDSHAKE
+  public: int handshakeFrames = 2;
+
+  /// \brief Servo packets received since entering HANDSHAKE
+  public: int handshakeCount = 0;
+
+  /// \brief Milliseconds to wait for a servo packet while DEGRADED
+  public: uint32_t degradedTimeoutMs = 10;
+
+  /// \brief Wall seconds in DEGRADED before going OFFLINE, 0 for none
+  public: double degradedWallTimeout = 1.0;
+
+  /// \brief Sim seconds in DEGRADED before going OFFLINE, 0 for none
+  public: double degradedSimTimeout = 0.0;
+
+  /// \brief Wall time DEGRADED was entered
+  public: std::chrono::steady_clock::time_point degradedWallStart;
+
+  /// \brief Sim time DEGRADED was entered
+  public: common::Time degradedSimStart;
+
+  /// \brief Last rate limited connection warning
+  public: std::chrono::steady_clock::time_point lastConnectionWarning;
+
+  /// \brief Missed servo packets not reported since the last warning
+  public: unsigned int unreportedMisses = 0;
+
+  /// \brief true to run in lockstep with ArduPilot: block every step
+  /// until the servo packet arrives, and never sleep while offline.
+  public: bool lockstep = false;
+
+  /// \brief Milliseconds to wait for a servo packet once ArduPilot is online
+  public: uint32_t lockstepTimeoutMs = 1000;
+
+  /// \brief Milliseconds to wait for a servo packet while ArduPilot is offline
+  public: uint32_t offlineTimeoutMs = 1;
+
+  /// \brief Wall time spent waiting for servo packets since last report
+  public: std::chrono::steady_clock::duration stallTime;
+
+  /// \brief Longest single wait for a servo packet since last report
+  public: std::chrono::steady_clock::duration stallTimeMax;
+
+  /// \brief Number of waits accounted in stallTime since last report
+  public: uint64_t stallCount = 0;
+
+  /// \brief Wall time of the last stall time report
+  public: std::chrono::steady_clock::time_point lastStallReport;
+
+  /// \brief Number of steps ArduPilot did not answer in time
+  public: uint64_t servoTimeouts = 0;
+
+  /// \brief Hot path instrumentation, null when disabled
+  public: std::unique_ptr<ArduPilotPluginStats> stats;
 };
 
 /////////////////////////////////////////////////
@@ -379,11 +747,16 @@ ArduPilotPlugin::ArduPilotPlugin()
 {
   this->dataPtr->arduPilotOnline = false;
   this->dataPtr->connectionTimeoutCount = 0;
+  this->dataPtr->stallTime = std::chrono::steady_clock::duration::zero();
+  this->dataPtr->stallTimeMax = std::chrono::steady_clock::duration::zero();
+  this->dataPtr->lastStallReport = std::chrono::steady_clock::now();
 }
 
 /////////////////////////////////////////////////
 ArduPilotPlugin::~ArduPilotPlugin()
 {
+  // stop the sensor callbacks before the data they write to goes away
+  this->dataPtr->sensorConnections.clear();
 }
 
 /////////////////////////////////////////////////
@@ -394,6 +767,8 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
 
   this->dataPtr->model = _model;
   this->dataPtr->modelName = this->dataPtr->model->GetName();
+  this->dataPtr->world = _model->GetWorld();
+  this->dataPtr->rootLink = _model->GetLink();
 
   // modelXYZToAirplaneXForwardZDown brings us from gazebo model frame:
   // x-forward, y-right, z-down
@@ -414,6 +789,17 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
     this->gazeboXYZToNED = _sdf->Get<ignition::math::Pose3d>("gazeboXYZToNED");
   }
 
+  // Controller and ArduPilot exchange rates, as physics step decimations
+  const double stepSize =
+    this->dataPtr->world->Physics()->GetMaxStepSize();
+  this->dataPtr->fdmDecimation = this->Decimation(stepSize,
+      _sdf->Get("fdm_rate", 0.0).first, "fdm_rate");
+  this->dataPtr->controlDecimation = this->Decimation(stepSize,
+      _sdf->Get("controlRate", 0.0).first, "controlRate");
+  const double controlRate =
+    1.0 / (stepSize * this->dataPtr->controlDecimation);
+  this->dataPtr->replayTimeTolerance = stepSize / 2.0;
+
   // per control channel
   sdf::ElementPtr controlSDF;
   if (_sdf->HasElement("control"))
@@ -445,7 +831,7 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
     }
     else
     {
-      control.channel = this->dataPtr->controls.size();
+      control.channel = this->dataPtr->controls.Size();
       gzwarn << "[" << this->dataPtr->modelName << "] "
              <<  "id/channel attribute not specified, use order parsed ["
              << control.channel << "].\n";
@@ -453,25 +839,22 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
 
     if (controlSDF->HasElement("type"))
     {
-      control.type = controlSDF->Get<std::string>("type");
+      const std::string type = controlSDF->Get<std::string>("type");
+      if (!ParseControlLaw(type, control.law))
+      {
+        gzwarn << "[" << this->dataPtr->modelName << "] "
+               << "Control type [" << type
+               << "] not recognized, must be one of VELOCITY, POSITION,"
+               << " EFFORT, ROTOR. default to VELOCITY.\n";
+        control.law = ControlLaw::VELOCITY;
+      }
     }
     else
     {
       gzerr << "[" << this->dataPtr->modelName << "] "
             <<  "Control type not specified,"
             << " using velocity control by default.\n";
-      control.type = "VELOCITY";
-    }
-
-    if (control.type != "VELOCITY" &&
-        control.type != "POSITION" &&
-        control.type != "EFFORT")
-    {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "Control type [" << control.type
-             << "] not recognized, must be one of VELOCITY, POSITION, EFFORT."
-             << " default to VELOCITY.\n";
-      control.type = "VELOCITY";
+      control.law = ControlLaw::VELOCITY;
     }
 
     if (controlSDF->HasElement("useForce"))
@@ -479,25 +862,59 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
       control.useForce = controlSDF->Get<bool>("useForce");
     }
 
-    if (controlSDF->HasElement("jointName"))
+    if (control.law == ControlLaw::ROTOR)
     {
-      control.jointName = controlSDF->Get<std::string>("jointName");
+      // virtual rotor, pushes the link directly
+      const std::string linkName =
+        controlSDF->Get("linkName", std::string()).first;
+      control.link = _model->GetLink(linkName);
+      if (control.link == nullptr)
+      {
+        gzerr << "[" << this->dataPtr->modelName << "] "
+              << "Couldn't find specified link [" << linkName
+              << "] of rotor control. This plugin will not run.\n";
+        return;
+      }
+      control.jointName = controlSDF->Get("jointName", linkName).first;
+      control.rotorPose =
+        controlSDF->Get("rotorPose", control.rotorPose).first;
+      control.motorConstant =
+        controlSDF->Get("motorConstant", control.motorConstant).first;
+      control.momentConstant =
+        controlSDF->Get("momentConstant", control.momentConstant).first;
+      control.timeConstantUp =
+        controlSDF->Get("timeConstantUp", control.timeConstantUp).first;
+      control.timeConstantDown =
+        controlSDF->Get("timeConstantDown", control.timeConstantDown).first;
+      control.maxRotVelocity =
+        controlSDF->Get("maxRotVelocity", control.maxRotVelocity).first;
+      control.rotorDragCoefficient = controlSDF->Get("rotorDragCoefficient",
+          control.rotorDragCoefficient).first;
+      control.rollingMomentCoefficient = controlSDF->Get(
+          "rollingMomentCoefficient", control.rollingMomentCoefficient).first;
     }
     else
     {
-      gzerr << "[" << this->dataPtr->modelName << "] "
-            << "Please specify a jointName,"
-            << " where the control channel is attached.\n";
-    }
+      if (controlSDF->HasElement("jointName"))
+      {
+        control.jointName = controlSDF->Get<std::string>("jointName");
+      }
+      else
+      {
+        gzerr << "[" << this->dataPtr->modelName << "] "
+              << "Please specify a jointName,"
+              << " where the control channel is attached.\n";
+      }
 
-    // Get the pointer to the joint.
-    control.joint = _model->GetJoint(control.jointName);
-    if (control.joint == nullptr)
-    {
-      gzerr << "[" << this->dataPtr->modelName << "] "
-            << "Couldn't find specified joint ["
-            << control.jointName << "]. This plugin will not run.\n";
-      return;
+      // Get the pointer to the joint.
+      control.joint = _model->GetJoint(control.jointName);
+      if (control.joint == nullptr)
+      {
+        gzerr << "[" << this->dataPtr->modelName << "] "
+              << "Couldn't find specified joint ["
+              << control.jointName << "]. This plugin will not run.\n";
+        return;
+      }
     }
 
     if (controlSDF->HasElement("multiplier"))
@@ -559,10 +976,14 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
       control.rotorVelocitySlowdownSim = 1.0;
     }
 
-    control.frequencyCutoff =
-          controlSDF->Get("frequencyCutoff", control.frequencyCutoff).first;
-    control.samplingRate =
-          controlSDF->Get("samplingRate", control.samplingRate).first;
+    // the joint state fed to the PID is only filtered when a cutoff is
+    // given, sampled at the controller rate unless told otherwise
+    const std::pair<double, bool> frequencyCutoff =
+          controlSDF->Get("frequencyCutoff", control.frequencyCutoff);
+    control.useFilter = frequencyCutoff.second;
+    control.frequencyCutoff = frequencyCutoff.first;
+    control.samplingRate = controlSDF->Get("samplingRate",
+          control.useFilter ? controlRate : control.samplingRate).first;
 
     // use gazebo::math::Filter
     control.filter.Fc(control.frequencyCutoff, control.samplingRate);
@@ -570,9 +991,6 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
     // initialize filter to zero value
     control.filter.Set(0.0);
 
-    // note to use this filter, do
-    // stateFiltered = filter.Process(stateRaw);
-
     // Overload the PID parameters if they are available.
     double param;
     // carry over from ArduCopter plugin
@@ -622,252 +1040,460 @@ void ArduPilotPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
     // set pid initial command
     control.pid.SetCmd(0.0);
 
-    this->dataPtr->controls.push_back(control);
+    if (control.law == ControlLaw::ROTOR)
+    {
+      this->dataPtr->rotors.Add(control, this->dataPtr->controls.Size());
+    }
+    this->dataPtr->controls.Add(control);
     controlSDF = controlSDF->GetNextElement("control");
   }
 
+  // Timing of the imu data sent to ArduPilot
+  const std::string imuMode =
+    _sdf->Get("imuMode", static_cast<std::string>("sensor")).first;
+  if (imuMode == "step")
+  {
+    this->dataPtr->imuMode = ImuMode::STEP;
+  }
+  else if (imuMode == "batch")
+  {
+    this->dataPtr->imuMode = ImuMode::BATCH;
+  }
+  else if (imuMode == "kinematic")
+  {
+    this->dataPtr->imuMode = ImuMode::KINEMATIC;
+  }
+  else if (imuMode != "sensor")
+  {
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "imuMode [" << imuMode << "] not recognized, must be one of"
+           << " sensor, step, batch, kinematic. default to sensor.\n";
+  }
+
   // Get sensors
   std::string imuName =
     _sdf->Get("imuName", static_cast<std::string>("imu_sensor")).first;
-  std::vector<std::string> imuScopedName =
-    this->dataPtr->model->SensorScopedName(imuName);
-
-  if (imuScopedName.size() > 1)
+  this->dataPtr->imuSensor = FindSensor<sensors::ImuSensor>(
+      this->dataPtr->model, this->dataPtr->modelName, imuName);
+  if (this->dataPtr->imuMode == ImuMode::KINEMATIC)
   {
-    gzwarn << "[" << this->dataPtr->modelName << "] "
-           << "multiple names match [" << imuName << "] using first found"
-           << " name.\n";
-    for (unsigned k = 0; k < imuScopedName.size(); ++k)
+    if (!this->InitKinematicImu(_sdf))
     {
-      gzwarn << "  sensor " << k << " [" << imuScopedName[k] << "].\n";
+      return;
     }
   }
+  else if (!this->dataPtr->imuSensor)
+  {
+    gzerr << "[" << this->dataPtr->modelName << "] "
+          << "imu_sensor [" << imuName
+          << "] not found, abort ArduPilot plugin.\n" << "\n";
+    return;
+  }
+
+  if (this->dataPtr->imuMode == ImuMode::STEP ||
+      this->dataPtr->imuMode == ImuMode::BATCH)
+  {
+    // queue every measurement, SendState picks the ones of the step
+    this->dataPtr->imuRing.reset(new ArduPilotImuRing);
+    sensors::ImuSensorPtr imu = this->dataPtr->imuSensor;
+    const double imuRate = imu->UpdateRate();
+    this->dataPtr->imuMaxAge = this->dataPtr->fdmDecimation *
+      this->dataPtr->world->Physics()->GetMaxStepSize() +
+      (imuRate > 0.0 ? 1.0 / imuRate : 0.0);
+    ArduPilotImuRing *ring = this->dataPtr->imuRing.get();
+    this->dataPtr->sensorConnections.push_back(imu->ConnectUpdated(
+        [imu, ring]()
+        {
+          ImuBatchSample sample;
+          sample.timestamp = imu->LastMeasurementTime().Double();
+          const ignition::math::Vector3d angularVel = imu->AngularVelocity();
+          const ignition::math::Vector3d linearAccel =
+            imu->LinearAcceleration();
+          sample.imuAngularVelocityRPY[0] = angularVel.X();
+          sample.imuAngularVelocityRPY[1] = angularVel.Y();
+          sample.imuAngularVelocityRPY[2] = angularVel.Z();
+          sample.imuLinearAccelerationXYZ[0] = linearAccel.X();
+          sample.imuLinearAccelerationXYZ[1] = linearAccel.Y();
+          sample.imuLinearAccelerationXYZ[2] = linearAccel.Z();
+          ring->Push(sample);
+        }));
+  }
 
-  if (imuScopedName.size() > 0)
+  // Sensor errors added to the imu fields of every mode
+  this->dataPtr->imuErrors.Configure(ReadImuErrorModel(_sdf, "Accel"),
+      ReadImuErrorModel(_sdf, "Gyro"),
+      _sdf->Get("vibrationRefVelocity", 1000.0).first,
+      _sdf->Get("imuNoiseSeed", static_cast<uint32_t>(0)).first);
+
+  // Extended state packet, carrying gps, rangefinder and airspeed
+  this->dataPtr->fdmVersion = _sdf->Get("fdm_version", 1).first;
+  if (this->dataPtr->fdmVersion != 1 && this->dataPtr->fdmVersion != 2)
   {
-    this->dataPtr->imuSensor = std::dynamic_pointer_cast<sensors::ImuSensor>
-      (sensors::SensorManager::Instance()->GetSensor(imuScopedName[0]));
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "fdm_version [" << this->dataPtr->fdmVersion
+           << "] not recognized, must be one of 1, 2. default to 1.\n";
+    this->dataPtr->fdmVersion = 1;
   }
 
-  if (!this->dataPtr->imuSensor)
+  if (this->dataPtr->fdmVersion >= 2)
   {
-    if (imuScopedName.size() > 1)
+    // Get GPS
+    std::string gpsName =
+      _sdf->Get("gpsName", static_cast<std::string>("gps_sensor")).first;
+    this->dataPtr->gpsSensor = FindSensor<sensors::GpsSensor>(
+        this->dataPtr->model, this->dataPtr->modelName, gpsName);
+    if (!this->dataPtr->gpsSensor)
     {
       gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "first imu_sensor scoped name [" << imuScopedName[0]
-             << "] not found, trying the rest of the sensor names.\n";
-      for (unsigned k = 1; k < imuScopedName.size(); ++k)
-      {
-        this->dataPtr->imuSensor = std::dynamic_pointer_cast<sensors::ImuSensor>
-          (sensors::SensorManager::Instance()->GetSensor(imuScopedName[k]));
-        if (this->dataPtr->imuSensor)
-        {
-          gzwarn << "found [" << imuScopedName[k] << "]\n";
-          break;
-        }
-      }
+             << "gps [" << gpsName
+             << "] not found, skipping gps support.\n";
     }
-
-    if (!this->dataPtr->imuSensor)
+    else
     {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "imu_sensor scoped name [" << imuName
-             << "] not found, trying unscoped name.\n" << "\n";
-      // TODO: this fails for multi-nested models.
-      // TODO: and transforms fail for rotated nested model,
-      //       joints point the wrong way.
-      this->dataPtr->imuSensor = std::dynamic_pointer_cast<sensors::ImuSensor>
-        (sensors::SensorManager::Instance()->GetSensor(imuName));
+      // cache the fix on sensor updates, SendState only copies it
+      sensors::GpsSensorPtr gps = this->dataPtr->gpsSensor;
+      this->dataPtr->sensorConnections.push_back(gps->ConnectUpdated(
+          [this, gps]()
+          {
+            std::lock_guard<std::mutex> lock(this->dataPtr->sensorMutex);
+            this->dataPtr->latitude = gps->Latitude().Degree();
+            this->dataPtr->longitude = gps->Longitude().Degree();
+            this->dataPtr->altitude = gps->Altitude();
+          }));
     }
 
-    if (!this->dataPtr->imuSensor)
+    // Get Rangefinder
+    // TODO add sonar
+    std::string rangefinderName = _sdf->Get("rangefinderName",
+      static_cast<std::string>("rangefinder_sensor")).first;
+    this->dataPtr->rangefinderSensor = FindSensor<sensors::RaySensor>(
+        this->dataPtr->model, this->dataPtr->modelName, rangefinderName);
+    if (!this->dataPtr->rangefinderSensor)
     {
-      gzerr << "[" << this->dataPtr->modelName << "] "
-            << "imu_sensor [" << imuName
-            << "] not found, abort ArduPilot plugin.\n" << "\n";
-      return;
+      gzwarn << "[" << this->dataPtr->modelName << "] "
+             << "rangefinder [" << rangefinderName
+             << "] not found, skipping rangefinder support.\n";
     }
-  }
-/* NOT MERGED IN MASTER YET
-    // Get GPS
-  std::string gpsName = _sdf->Get("imuName", static_cast<std::string>("gps_sensor")).first;
-  std::vector<std::string> gpsScopedName = SensorScopedName(this->dataPtr->model, gpsName);
-  if (gpsScopedName.size() > 1)
-  {
-    gzwarn << "[" << this->dataPtr->modelName << "] "
-           << "multiple names match [" << gpsName << "] using first found"
-           << " name.\n";
-    for (unsigned k = 0; k < gpsScopedName.size(); ++k)
+    else
     {
-      gzwarn << "  sensor " << k << " [" << gpsScopedName[k] << "].\n";
+      sensors::RaySensorPtr ray = this->dataPtr->rangefinderSensor;
+      this->dataPtr->sensorConnections.push_back(ray->ConnectUpdated(
+          [this, ray]()
+          {
+            // Rangefinder value can not be send as Inf to ardupilot
+            const double range = ray->Range(0);
+            std::lock_guard<std::mutex> lock(this->dataPtr->sensorMutex);
+            this->dataPtr->rangefinder = std::isinf(range) ? 0.0 : range;
+          }));
     }
   }
 
-  if (gpsScopedName.size() > 0)
+  // Controller time control.
+  this->dataPtr->lastControllerUpdateTime = 0;
+
+  // Initialise ardupilot sockets
+  if (!InitArduPilotSockets(_sdf))
   {
-    this->dataPtr->gpsSensor = std::dynamic_pointer_cast<sensors::GpsSensor>
-      (sensors::SensorManager::Instance()->GetSensor(gpsScopedName[0]));
+    return;
   }
 
-  if (!this->dataPtr->gpsSensor)
+  // Log every packet exchanged with ArduPilot
+  const std::string recordFile = _sdf->Get("recordFile", std::string()).first;
+  if (!recordFile.empty() && !this->dataPtr->replay)
   {
-    if (gpsScopedName.size() > 1)
+    this->dataPtr->recorder.reset(new ArduPilotRecorder);
+    if (this->dataPtr->recorder->Open(recordFile))
+    {
+      gzmsg << "[" << this->dataPtr->modelName << "] "
+            << "recording ArduPilot packets to " << recordFile << "\n";
+    }
+    else
     {
       gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "first gps_sensor scoped name [" << gpsScopedName[0]
-             << "] not found, trying the rest of the sensor names.\n";
-      for (unsigned k = 1; k < gpsScopedName.size(); ++k)
-      {
-        this->dataPtr->gpsSensor = std::dynamic_pointer_cast<sensors::GpsSensor>
-          (sensors::SensorManager::Instance()->GetSensor(gpsScopedName[k]));
-        if (this->dataPtr->gpsSensor)
-        {
-          gzwarn << "found [" << gpsScopedName[k] << "]\n";
-          break;
-        }
-      }
+             << "failed to create record file [" << recordFile
+             << "], not recording.\n";
+      this->dataPtr->recorder.reset();
     }
+  }
 
-    if (!this->dataPtr->gpsSensor)
-    {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "gps_sensor scoped name [" << gpsName
-             << "] not found, trying unscoped name.\n" << "\n";
-      this->dataPtr->gpsSensor = std::dynamic_pointer_cast<sensors::GpsSensor>
-        (sensors::SensorManager::Instance()->GetSensor(gpsName));
-    }
+  // Send state packets from a dedicated thread, the physics thread only
+  // hands over a snapshot
+  if (_sdf->Get("asyncSend", false).first && !this->dataPtr->replay)
+  {
+    this->dataPtr->link.UseSender();
+  }
 
-    if (!this->dataPtr->gpsSensor)
-    {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "gps [" << gpsName
-             << "] not found, skipping gps support.\n" << "\n";
-    }
-    else
+  // Missed update count before we declare arduPilotOnline status false
+  this->dataPtr->connectionTimeoutMaxCount =
+    _sdf->Get("connectionTimeoutMaxCount", 10).first;
+
+  // Connection state machine deadlines
+  this->dataPtr->handshakeFrames =
+    _sdf->Get("handshakeFrames", this->dataPtr->handshakeFrames).first;
+  this->dataPtr->degradedTimeoutMs =
+    _sdf->Get("degradedTimeoutMs", this->dataPtr->degradedTimeoutMs).first;
+  this->dataPtr->degradedWallTimeout = _sdf->Get("degradedWallTimeout",
+      this->dataPtr->degradedWallTimeout).first;
+  this->dataPtr->degradedSimTimeout = _sdf->Get("degradedSimTimeout",
+      this->dataPtr->degradedSimTimeout).first;
+
+  // Lockstep synchronization with ArduPilot
+  this->dataPtr->lockstep = _sdf->Get("lockstep", false).first;
+  this->dataPtr->lockstepTimeoutMs =
+    _sdf->Get("lockstepTimeoutMs", static_cast<uint32_t>(1000)).first;
+  // in lockstep, do not slow down the simulation before ArduPilot shows up
+  this->dataPtr->offlineTimeoutMs = _sdf->Get("offlineTimeoutMs",
+    static_cast<uint32_t>(this->dataPtr->lockstep ? 0 : 1)).first;
+
+  // Hot path instrumentation
+  const double statsPeriod = _sdf->Get("statsPeriod", 0.0).first;
+  if (statsPeriod > 0.0)
+  {
+    this->dataPtr->stats.reset(new ArduPilotPluginStats);
+    ArduPilotPluginStats &stats = *this->dataPtr->stats;
+    stats.period = std::chrono::duration_cast<
+      std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(statsPeriod));
+    stats.lastWallTime = std::chrono::steady_clock::now();
+    stats.lastSimTime = this->dataPtr->world->SimTime();
+
+    const std::string statsTopic = _sdf->Get("statsTopic",
+        "~/" + this->dataPtr->modelName + "/ardupilot_stats").first;
+    if (!statsTopic.empty())
     {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "  found "  << " [" << gpsName << "].\n";
+      stats.node = transport::NodePtr(new transport::Node());
+      stats.node->Init(this->dataPtr->world->Name());
+      stats.pub = stats.node->Advertise<msgs::Param_V>(statsTopic);
     }
-  }
 
-  // Get Rangefinder
-  // TODO add sonar
-  std::string rangefinderName = _sdf->Get("rangefinderName",
-    static_cast<std::string>("rangefinder_sensor")).first;
-  std::vector<std::string> rangefinderScopedName = SensorScopedName(this->dataPtr->model, rangefinderName);
-  if (rangefinderScopedName.size() > 1)
-  {
-    gzwarn << "[" << this->dataPtr->modelName << "] "
-           << "multiple names match [" << rangefinderName << "] using first found"
-           << " name.\n";
-    for (unsigned k = 0; k < rangefinderScopedName.size(); ++k)
+    const std::string statsFile =
+      _sdf->Get("statsFile", std::string()).first;
+    if (!statsFile.empty())
     {
-      gzwarn << "  sensor " << k << " [" << rangefinderScopedName[k] << "].\n";
+      stats.file.open(statsFile, std::ios::out | std::ios::app);
+      if (!stats.file.is_open())
+      {
+        gzwarn << "[" << this->dataPtr->modelName << "] "
+               << "failed to open stats file [" << statsFile << "].\n";
+      }
     }
   }
 
-  if (rangefinderScopedName.size() > 0)
-  {
-    this->dataPtr->rangefinderSensor = std::dynamic_pointer_cast<sensors::RaySensor>
-      (sensors::SensorManager::Instance()->GetSensor(rangefinderScopedName[0]));
-  }
+  // Listen to the update event. This event is broadcast every simulation
+  // iteration.
+  this->dataPtr->updateConnection = event::Events::ConnectWorldUpdateBegin(
+      std::bind(&ArduPilotPlugin::OnUpdate, this));
+
+  gzlog << "[" << this->dataPtr->modelName << "] "
+        << "ArduPilot ready to fly. The force will be with you" << std::endl;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::OnUpdate()
+{
+  // Runs on the physics thread only, like every other access to the
+  // controller state: no lock needed. Sensor callbacks share data through
+  // sensorMutex.
+  const gazebo::common::Time curTime =
+    this->dataPtr->world->SimTime();
 
-  if (!this->dataPtr->rangefinderSensor)
+  ArduPilotPluginStats *stats = this->dataPtr->stats.get();
   {
-    if (rangefinderScopedName.size() > 1)
+    ScopedLatencyTimer stepTimer(stats ? &stats->step : nullptr);
+
+    // Update the control surfaces and publish the new state.
+    if (curTime > this->dataPtr->lastControllerUpdateTime)
     {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "first rangefinder_sensor scoped name [" << rangefinderScopedName[0]
-             << "] not found, trying the rest of the sensor names.\n";
-      for (unsigned k = 1; k < rangefinderScopedName.size(); ++k)
+      // exchange packets with ArduPilot and run the controllers at their
+      // own rates, hold the last command in between
+      const bool exchange =
+        this->dataPtr->updateCount % this->dataPtr->fdmDecimation == 0;
+      const bool control =
+        this->dataPtr->updateCount % this->dataPtr->controlDecimation == 0;
+      ++this->dataPtr->updateCount;
+
+      if (exchange)
+      {
+        ScopedLatencyTimer timer(stats ? &stats->recv : nullptr);
+        this->ReceiveMotorCommand(curTime);
+      }
+      if (this->dataPtr->arduPilotOnline)
       {
-        this->dataPtr->rangefinderSensor = std::dynamic_pointer_cast<sensors::RaySensor>
-          (sensors::SensorManager::Instance()->GetSensor(rangefinderScopedName[k]));
-        if (this->dataPtr->rangefinderSensor)
         {
-          gzwarn << "found [" << rangefinderScopedName[k] << "]\n";
-          break;
+          ScopedLatencyTimer timer(stats ? &stats->apply : nullptr);
+          if (control)
+          {
+            this->ApplyMotorForces((curTime -
+              this->dataPtr->lastMotorUpdateTime).Double());
+            this->dataPtr->lastMotorUpdateTime = curTime;
+          }
+          else
+          {
+            this->HoldMotorForces();
+          }
+        }
+        if (exchange)
+        {
+          ScopedLatencyTimer timer(stats ? &stats->send : nullptr);
+          this->SendState(curTime);
+        }
+      }
+      else
+      {
+        this->dataPtr->lastMotorUpdateTime = curTime;
+        if (this->dataPtr->imuRing)
+        {
+          this->DropImuSamples(curTime);
         }
       }
-    }
-
-    if (!this->dataPtr->rangefinderSensor)
-    {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "rangefinder_sensor scoped name [" << rangefinderName
-             << "] not found, trying unscoped name.\n" << "\n";
-      /// TODO: this fails for multi-nested models.
-      /// TODO: and transforms fail for rotated nested model,
-      ///       joints point the wrong way.
-      this->dataPtr->rangefinderSensor = std::dynamic_pointer_cast<sensors::RaySensor>
-        (sensors::SensorManager::Instance()->GetSensor(rangefinderName));
-    }
-    if (!this->dataPtr->rangefinderSensor)
-    {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "ranfinder [" << rangefinderName
-             << "] not found, skipping rangefinder support.\n" << "\n";
     }
     else
     {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "  found "  << " [" << rangefinderName << "].\n";
+      // time went backward, world reset
+      this->dataPtr->lastMotorUpdateTime = curTime;
     }
+
+    this->dataPtr->lastControllerUpdateTime = curTime;
   }
-*/
-  // Controller time control.
-  this->dataPtr->lastControllerUpdateTime = 0;
 
-  // Initialise ardupilot sockets
-  if (!InitArduPilotSockets(_sdf))
+  if (stats)
   {
-    return;
+    this->PublishStats(curTime);
   }
+}
 
-  // Missed update count before we declare arduPilotOnline status false
-  this->dataPtr->connectionTimeoutMaxCount =
-    _sdf->Get("connectionTimeoutMaxCount", 10).first;
-
-  // Listen to the update event. This event is broadcast every simulation
-  // iteration.
-  this->dataPtr->updateConnection = event::Events::ConnectWorldUpdateBegin(
-      std::bind(&ArduPilotPlugin::OnUpdate, this));
-
-  gzlog << "[" << this->dataPtr->modelName << "] "
-        << "ArduPilot ready to fly. The force will be with you" << std::endl;
+/////////////////////////////////////////////////
+unsigned int ArduPilotPlugin::Decimation(const double _stepSize,
+    const double _rate, const std::string &_name) const
+{
+  if (_rate <= 0.0 || _stepSize <= 0.0)
+  {
+    return 1;
+  }
+  const double steps = 1.0 / (_rate * _stepSize);
+  const unsigned int decimation =
+    std::max(1u, static_cast<unsigned int>(std::lround(steps)));
+  if (std::abs(steps - decimation) > 1e-6 * steps)
+  {
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "<" << _name << "> " << _rate << " Hz is not a divisor of the"
+           << " physics rate " << 1.0 / _stepSize << " Hz, running at "
+           << 1.0 / (_stepSize * decimation) << " Hz.\n";
+  }
+  return decimation;
 }
 
 /////////////////////////////////////////////////
-void ArduPilotPlugin::OnUpdate()
+void ArduPilotPlugin::PublishStats(const common::Time &_simTime)
 {
-  std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+  ArduPilotPluginStats &stats = *this->dataPtr->stats;
 
-  const gazebo::common::Time curTime =
-    this->dataPtr->model->GetWorld()->SimTime();
+  const std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now();
+  const std::chrono::steady_clock::duration elapsed =
+    now - stats.lastWallTime;
+  if (elapsed < stats.period)
+  {
+    return;
+  }
 
-  // Update the control surfaces and publish the new state.
-  if (curTime > this->dataPtr->lastControllerUpdateTime)
+  const double wallSeconds =
+    std::chrono::duration<double>(elapsed).count();
+  const double realTimeFactor =
+    (_simTime - stats.lastSimTime).Double() / wallSeconds;
+
+  // name, value pairs of the report, latencies in microseconds
+  LatencyHistogram *phases[] =
+    {&stats.step, &stats.recv, &stats.apply, &stats.send};
+  const char *phaseNames[] = {"step", "recv", "apply", "send"};
+  std::vector<std::pair<std::string, double>> values;
+  values.emplace_back("sim_time", _simTime.Double());
+  values.emplace_back("real_time_factor", realTimeFactor);
+  values.emplace_back("steps", stats.step.Count());
+  for (unsigned int i = 0; i < 4; ++i)
   {
-    this->ReceiveMotorCommand();
-    if (this->dataPtr->arduPilotOnline)
+    const std::string name = phaseNames[i];
+    values.emplace_back(name + "_p50_us", phases[i]->Percentile(0.5) * 1e-3);
+    values.emplace_back(name + "_p99_us", phases[i]->Percentile(0.99) * 1e-3);
+    values.emplace_back(name + "_max_us", phases[i]->Max() * 1e-3);
+  }
+  const ArduPilotLink &link = this->dataPtr->link;
+  values.emplace_back("servo_received", link.Received());
+  values.emplace_back("servo_dropped", link.Dropped());
+  values.emplace_back("servo_lost", link.FramesLost());
+  values.emplace_back("servo_out_of_order", link.FramesOutOfOrder());
+  values.emplace_back("servo_timeouts", this->dataPtr->servoTimeouts);
+  if (link.Async())
+  {
+    values.emplace_back("fdm_coalesced", link.Coalesced());
+  }
+  if (this->dataPtr->imuRing)
+  {
+    values.emplace_back("imu_stale", this->dataPtr->imuStale);
+    values.emplace_back("imu_dropped", this->dataPtr->imuDropped +
+        this->dataPtr->imuRing->Overflows());
+  }
+  values.emplace_back("connection_state",
+      static_cast<double>(this->dataPtr->connectionState));
+  if (this->dataPtr->recorder)
+  {
+    values.emplace_back("recorded", this->dataPtr->recorder->Count());
+  }
+  if (this->dataPtr->replay)
+  {
+    values.emplace_back("replayed", this->dataPtr->replay->Position());
+    values.emplace_back("replay_mismatches",
+        this->dataPtr->replayMismatches);
+  }
+
+  if (stats.pub)
+  {
+    stats.msg.Clear();
+    for (const auto &value : values)
     {
-      this->ApplyMotorForces((curTime -
-        this->dataPtr->lastControllerUpdateTime).Double());
-      this->SendState();
+      msgs::Param *param = stats.msg.add_param();
+      param->set_name(value.first);
+      *param->mutable_value() = msgs::ConvertAny(value.second);
     }
+    stats.pub->Publish(stats.msg);
   }
 
-  this->dataPtr->lastControllerUpdateTime = curTime;
+  if (stats.file.is_open())
+  {
+    if (stats.file.tellp() == 0)
+    {
+      stats.file << "model";
+      for (const auto &value : values)
+      {
+        stats.file << "," << value.first;
+      }
+      stats.file << "\n";
+    }
+    stats.file << this->dataPtr->modelName;
+    for (const auto &value : values)
+    {
+      stats.file << "," << value.second;
+    }
+    stats.file << std::endl;
+  }
+
+  for (unsigned int i = 0; i < 4; ++i)
+  {
+    phases[i]->Reset();
+  }
+  stats.lastWallTime = now;
+  stats.lastSimTime = _simTime;
 }
 
 /////////////////////////////////////////////////
 void ArduPilotPlugin::ResetPIDs()
 {
   // Reset velocity PID for controls
-  for (size_t i = 0; i < this->dataPtr->controls.size(); ++i)
+  ControlArrays &controls = this->dataPtr->controls;
+  for (size_t i = 0; i < controls.Size(); ++i)
   {
-    this->dataPtr->controls[i].cmd = 0;
-    // this->dataPtr->controls[i].pid.Reset();
+    controls.cmd[i] = 0;
+    // controls.pid[i].Reset();
   }
 }
 
@@ -883,211 +1509,528 @@ bool ArduPilotPlugin::InitArduPilotSockets(sdf::ElementPtr _sdf) const
   this->dataPtr->fdm_port_out =
     _sdf->Get("fdm_port_out", static_cast<uint32_t>(9003)).first;
 
-  if (!this->dataPtr->socket_in.Bind(this->dataPtr->listen_addr.c_str(),
-      this->dataPtr->fdm_port_in))
+  // Several vehicles in a world, and several gzservers on one host, e.g. a
+  // batch of missions: shift the ports of instance n the way ArduPilot
+  // SITL -I n does. <instance> is the index of the vehicle in its world,
+  // ARDUPILOT_GAZEBO_INSTANCE the offset of the whole world.
+  int instance = _sdf->Get("instance", 0).first;
+  if (instance < 0)
   {
-    gzerr << "[" << this->dataPtr->modelName << "] "
-          << "failed to bind with " << this->dataPtr->listen_addr
-          << ":" << this->dataPtr->fdm_port_in << " aborting plugin.\n";
-    return false;
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "instance [" << instance << "] must be positive, using 0.\n";
+    instance = 0;
+  }
+  const char *instanceEnv = std::getenv("ARDUPILOT_GAZEBO_INSTANCE");
+  if (instanceEnv)
+  {
+    const int offset = std::atoi(instanceEnv);
+    if (offset < 0)
+    {
+      gzwarn << "[" << this->dataPtr->modelName << "] "
+             << "ARDUPILOT_GAZEBO_INSTANCE [" << instanceEnv
+             << "] must be positive, ignored.\n";
+    }
+    else
+    {
+      instance += offset;
+    }
+  }
+  if (instance > 0)
+  {
+    // a world of vehicles with their own ports needs a stride covering
+    // all of them, or instance n of one vehicle lands on the ports of
+    // another
+    const uint32_t stride =
+      _sdf->Get("instancePortStride", static_cast<uint32_t>(10)).first;
+    const uint64_t shift = static_cast<uint64_t>(stride) * instance;
+    if (this->dataPtr->fdm_port_in + shift > 65535 ||
+        this->dataPtr->fdm_port_out + shift > 65535)
+    {
+      gzerr << "[" << this->dataPtr->modelName << "] "
+            << "instance " << instance << " shifts the fdm ports "
+            << this->dataPtr->fdm_port_in << "/"
+            << this->dataPtr->fdm_port_out << " by " << shift
+            << ", past 65535, aborting plugin.\n";
+      return false;
+    }
+    this->dataPtr->fdm_port_in += shift;
+    this->dataPtr->fdm_port_out += shift;
+    gzmsg << "[" << this->dataPtr->modelName << "] "
+          << "instance " << instance << ", fdm ports "
+          << this->dataPtr->fdm_port_in << "/"
+          << this->dataPtr->fdm_port_out << "\n";
   }
 
-  if (!this->dataPtr->socket_out.Connect(this->dataPtr->fdm_addr.c_str(),
+  // Replay recorded servo packets, ArduPilot is not needed
+  const std::string replayFile = _sdf->Get("replayFile", std::string()).first;
+  if (!replayFile.empty())
+  {
+    this->dataPtr->replay.reset(new ArduPilotReplay);
+    if (!this->dataPtr->replay->Open(replayFile))
+    {
+      gzerr << "[" << this->dataPtr->modelName << "] "
+            << "failed to open replay file " << replayFile
+            << " aborting plugin.\n";
+      this->dataPtr->replay.reset();
+      return false;
+    }
+    gzmsg << "[" << this->dataPtr->modelName << "] "
+          << "replaying " << this->dataPtr->replay->Count()
+          << " ArduPilot packets from " << replayFile << "\n";
+    return true;
+  }
+
+  const std::string transport =
+    _sdf->Get("fdm_transport", static_cast<std::string>("udp")).first;
+  if (transport == "shm")
+  {
+    const std::string shmName = _sdf->Get("fdm_shm_name",
+        "/ardupilot_gazebo_" + std::to_string(this->dataPtr->fdm_port_in)).first;
+    if (!this->dataPtr->link.OpenShm(shmName))
+    {
+      gzerr << "[" << this->dataPtr->modelName << "] "
+            << "failed to create shared memory " << shmName
+            << " aborting plugin.\n";
+      return false;
+    }
+    gzmsg << "[" << this->dataPtr->modelName << "] "
+          << "exchanging packets with ArduPilot over shared memory "
+          << shmName << "\n";
+    return true;
+  }
+  else if (transport != "udp")
+  {
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "fdm_transport [" << transport
+           << "] not recognized, must be one of udp, shm. default to udp.\n";
+  }
+
+  if (!this->dataPtr->link.OpenUdp(this->dataPtr->listen_addr,
+      this->dataPtr->fdm_port_in, this->dataPtr->fdm_addr,
       this->dataPtr->fdm_port_out))
   {
     gzerr << "[" << this->dataPtr->modelName << "] "
-          << "failed to bind with " << this->dataPtr->fdm_addr
-          << ":" << this->dataPtr->fdm_port_out << " aborting plugin.\n";
+          << "failed to bind with " << this->dataPtr->listen_addr
+          << ":" << this->dataPtr->fdm_port_in << " or connect to "
+          << this->dataPtr->fdm_addr << ":" << this->dataPtr->fdm_port_out
+          << " aborting plugin.\n";
     return false;
   }
 
+  if (_sdf->Get("sharedBridge", false).first)
+  {
+    if (!this->dataPtr->link.UseBridge())
+    {
+      gzwarn << "[" << this->dataPtr->modelName << "] "
+             << "shared ArduPilot bridge not available,"
+             << " receiving on the world update thread.\n";
+    }
+  }
+
   return true;
 }
 
 /////////////////////////////////////////////////
 void ArduPilotPlugin::ApplyMotorForces(const double _dt)
 {
+  ControlArrays &controls = this->dataPtr->controls;
+
   // update velocity PID for controls and apply force to joint
-  for (size_t i = 0; i < this->dataPtr->controls.size(); ++i)
+  for (size_t i = 0; i < controls.Size(); ++i)
   {
-    if (this->dataPtr->controls[i].useForce)
+    if (controls.law[i] == ControlLaw::ROTOR)
     {
-      if (this->dataPtr->controls[i].type == "VELOCITY")
-      {
-        const double velTarget = this->dataPtr->controls[i].cmd /
-          this->dataPtr->controls[i].rotorVelocitySlowdownSim;
-        const double vel = this->dataPtr->controls[i].joint->GetVelocity(0);
-        const double error = vel - velTarget;
-        const double force = this->dataPtr->controls[i].pid.Update(error, _dt);
-        this->dataPtr->controls[i].joint->SetForce(0, force);
-      }
-      else if (this->dataPtr->controls[i].type == "POSITION")
-      {
-        const double posTarget = this->dataPtr->controls[i].cmd;
-        const double pos = this->dataPtr->controls[i].joint->Position();
-        const double error = pos - posTarget;
-        const double force = this->dataPtr->controls[i].pid.Update(error, _dt);
-        this->dataPtr->controls[i].joint->SetForce(0, force);
-      }
-      else if (this->dataPtr->controls[i].type == "EFFORT")
-      {
-        const double force = this->dataPtr->controls[i].cmd;
-        this->dataPtr->controls[i].joint->SetForce(0, force);
-      }
-      else
+      continue;
+    }
+    physics::Joint &joint = *controls.joint[i];
+    if (controls.useForce[i])
+    {
+      switch (controls.law[i])
       {
-        // do nothing
+        case ControlLaw::VELOCITY:
+        {
+          const double velTarget = controls.cmd[i] * controls.velocityScale[i];
+          double vel = joint.GetVelocity(0);
+          if (controls.useFilter[i])
+          {
+            vel = controls.filter[i].Process(vel);
+          }
+          const double error = vel - velTarget;
+          controls.force[i] = controls.pid[i].Update(error, _dt);
+          break;
+        }
+        case ControlLaw::POSITION:
+        {
+          const double posTarget = controls.cmd[i];
+          double pos = joint.Position();
+          if (controls.useFilter[i])
+          {
+            pos = controls.filter[i].Process(pos);
+          }
+          const double error = pos - posTarget;
+          controls.force[i] = controls.pid[i].Update(error, _dt);
+          break;
+        }
+        case ControlLaw::EFFORT:
+        {
+          controls.force[i] = controls.cmd[i];
+          break;
+        }
+        case ControlLaw::ROTOR:
+        default:
+          break;
       }
+      joint.SetForce(0, controls.force[i]);
     }
     else
     {
-      if (this->dataPtr->controls[i].type == "VELOCITY")
-      {
-        this->dataPtr->controls[i].joint->SetVelocity(0, this->dataPtr->controls[i].cmd);
-      }
-      else if (this->dataPtr->controls[i].type == "POSITION")
-      {
-        this->dataPtr->controls[i].joint->SetPosition(0, this->dataPtr->controls[i].cmd);
-      }
-      else if (this->dataPtr->controls[i].type == "EFFORT")
+      switch (controls.law[i])
       {
-        const double force = this->dataPtr->controls[i].cmd;
-        this->dataPtr->controls[i].joint->SetForce(0, force);
-      }
-      else
-      {
-        // do nothing
+        case ControlLaw::VELOCITY:
+          joint.SetVelocity(0, controls.cmd[i]);
+          break;
+        case ControlLaw::POSITION:
+          joint.SetPosition(0, controls.cmd[i]);
+          break;
+        case ControlLaw::EFFORT:
+          controls.force[i] = controls.cmd[i];
+          joint.SetForce(0, controls.force[i]);
+          break;
+        case ControlLaw::ROTOR:
+        default:
+          break;
       }
     }
   }
+
+  this->UpdateRotors(_dt);
+  this->ApplyRotorForces();
 }
 
 /////////////////////////////////////////////////
-void ArduPilotPlugin::ReceiveMotorCommand()
+void ArduPilotPlugin::UpdateRotors(const double _dt)
 {
-  // Added detection for whether ArduPilot is online or not.
-  // If ArduPilot is detected (receive of fdm packet from someone),
-  // then socket receive wait time is increased from 1ms to 1 sec
-  // to accomodate network jitter.
-  // If ArduPilot is not detected, receive call blocks for 1ms
-  // on each call.
-  // Once ArduPilot presence is detected, it takes this many
-  // missed receives before declaring the FCS offline.
-
-  ServoPacket pkt;
-  uint32_t waitMs;
-  if (this->dataPtr->arduPilotOnline)
+  const ControlArrays &controls = this->dataPtr->controls;
+  RotorArrays &rotors = this->dataPtr->rotors;
+  const size_t n = rotors.Size();
+  if (n == 0)
   {
-    // increase timeout for receive once we detect a packet from
-    // ArduPilot FCS.
-    waitMs = 1000;
+    return;
   }
-  else
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    // the command is the rotor velocity target, signed by the turning
+    // direction through the control multiplier
+    const double target = ignition::math::clamp(
+        controls.cmd[rotors.control[i]],
+        -rotors.maxRotVelocity[i], rotors.maxRotVelocity[i]);
+
+    // first order motor model, integrated exactly over _dt so the rotor
+    // stays stable whatever the step size
+    const double tau = std::abs(target) > std::abs(rotors.velocity[i]) ?
+      rotors.timeConstantUp[i] : rotors.timeConstantDown[i];
+    if (tau > 0.0)
+    {
+      rotors.velocity[i] = target +
+        (rotors.velocity[i] - target) * std::exp(-_dt / tau);
+    }
+    else
+    {
+      rotors.velocity[i] = target;
+    }
+  }
+
+  // air velocity at every rotor, in the link frame. Rotors usually share
+  // the vehicle body, its state is only queried once.
+  const physics::Link *stateLink = nullptr;
+  ignition::math::Vector3d linearVel;
+  ignition::math::Vector3d angularVel;
+  for (size_t i = 0; i < n; ++i)
+  {
+    const physics::Link &link = *rotors.link[i];
+    if (&link != stateLink)
+    {
+      stateLink = &link;
+      const ignition::math::Vector3d wind =
+        this->dataPtr->world->Wind().WorldLinearVel(&link);
+      linearVel = link.RelativeLinearVel() -
+        link.WorldPose().Rot().RotateVectorReverse(wind);
+      angularVel = link.RelativeAngularVel();
+    }
+    const ignition::math::Vector3d vel = linearVel + angularVel.Cross(
+        ignition::math::Vector3d(rotors.px[i], rotors.py[i], rotors.pz[i]));
+    rotors.vx[i] = vel.X();
+    rotors.vy[i] = vel.Y();
+    rotors.vz[i] = vel.Z();
+  }
+
+  // aerodynamics of all rotors in one branch-free pass
+  const double *ax = rotors.ax.data();
+  const double *ay = rotors.ay.data();
+  const double *az = rotors.az.data();
+  const double *vx = rotors.vx.data();
+  const double *vy = rotors.vy.data();
+  const double *vz = rotors.vz.data();
+  const double *w = rotors.velocity.data();
+  const double *kT = rotors.motorConstant.data();
+  const double *kM = rotors.momentConstant.data();
+  const double *kD = rotors.rotorDragCoefficient.data();
+  const double *kR = rotors.rollingMomentCoefficient.data();
+  double *fx = rotors.fx.data();
+  double *fy = rotors.fy.data();
+  double *fz = rotors.fz.data();
+  double *tx = rotors.tx.data();
+  double *ty = rotors.ty.data();
+  double *tz = rotors.tz.data();
+  for (size_t i = 0; i < n; ++i)
   {
-    // Otherwise skip quickly and do not set control force.
-    waitMs = 1;
+    // thrust along the rotor axis whatever the turning direction, drag
+    // torque opposes the rotation
+    const double thrust = kT[i] * w[i] * w[i];
+    const double torque = -std::copysign(kM[i] * thrust, w[i]);
+
+    // in-plane airspeed drives rotor drag and blade flapping, both
+    // opposing it and growing with the rotor velocity
+    const double axial = vx[i] * ax[i] + vy[i] * ay[i] + vz[i] * az[i];
+    const double perpX = vx[i] - axial * ax[i];
+    const double perpY = vy[i] - axial * ay[i];
+    const double perpZ = vz[i] - axial * az[i];
+    const double drag = -std::abs(w[i]) * kD[i];
+    const double flapping = -std::abs(w[i]) * kR[i];
+
+    fx[i] = thrust * ax[i] + drag * perpX;
+    fy[i] = thrust * ay[i] + drag * perpY;
+    fz[i] = thrust * az[i] + drag * perpZ;
+    tx[i] = torque * ax[i] + flapping * perpX;
+    ty[i] = torque * ay[i] + flapping * perpY;
+    tz[i] = torque * az[i] + flapping * perpZ;
   }
-  ssize_t recvSize =
-    this->dataPtr->socket_in.Recv(&pkt, sizeof(ServoPacket), waitMs);
+}
 
-  // Drain the socket in the case we're backed up
-  int counter = 0;
-  ServoPacket last_pkt;
-  while (true)
+/////////////////////////////////////////////////
+void ArduPilotPlugin::ApplyRotorForces()
+{
+  RotorArrays &rotors = this->dataPtr->rotors;
+
+  for (size_t i = 0; i < rotors.Size(); ++i)
   {
-    // last_pkt = pkt;
-    const ssize_t recvSize_last =
-      this->dataPtr->socket_in.Recv(&last_pkt, sizeof(ServoPacket), 0ul);
-    if (recvSize_last == -1)
+    physics::Link &link = *rotors.link[i];
+    link.AddLinkForce(
+        ignition::math::Vector3d(rotors.fx[i], rotors.fy[i], rotors.fz[i]),
+        ignition::math::Vector3d(rotors.px[i], rotors.py[i], rotors.pz[i]));
+    link.AddRelativeTorque(
+        ignition::math::Vector3d(rotors.tx[i], rotors.ty[i], rotors.tz[i]));
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::HoldMotorForces()
+{
+  ControlArrays &controls = this->dataPtr->controls;
+
+  // joint forces only last one physics step, apply the last controller
+  // output again between controller updates
+  for (size_t i = 0; i < controls.Size(); ++i)
+  {
+    if (controls.law[i] == ControlLaw::ROTOR)
+    {
+      continue;
+    }
+    physics::Joint &joint = *controls.joint[i];
+    if (controls.useForce[i] || controls.law[i] == ControlLaw::EFFORT)
+    {
+      joint.SetForce(0, controls.force[i]);
+    }
+    else if (controls.law[i] == ControlLaw::VELOCITY)
+    {
+      joint.SetVelocity(0, controls.cmd[i]);
+    }
+    else
     {
+      joint.SetPosition(0, controls.cmd[i]);
+    }
+  }
+
+  this->ApplyRotorForces();
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::ReceiveMotorCommand(const common::Time &_simTime)
+{
+  // The connection state decides how long to wait for ArduPilot.
+  // OFFLINE skips quickly (offlineTimeoutMs, 1ms, 0 in lockstep) and does
+  // not set control force. Once a servo packet shows up, HANDSHAKE and
+  // LOCKSTEP wait up to lockstepTimeoutMs (1 sec) to accomodate network
+  // jitter. The receive call returns as soon as the servo packet lands.
+  // A missed packet moves to DEGRADED, which only waits degradedTimeoutMs
+  // per step and keeps applying the last command, until ArduPilot comes
+  // back or a deadline expires (see ServoTimeout).
+
+  ArduPilotLink &link = this->dataPtr->link;
+  uint32_t waitMs = this->dataPtr->offlineTimeoutMs;
+  switch (this->dataPtr->connectionState)
+  {
+    case ConnectionState::OFFLINE:
+      waitMs = this->dataPtr->offlineTimeoutMs;
+      break;
+    case ConnectionState::HANDSHAKE:
+    case ConnectionState::LOCKSTEP:
+      waitMs = this->dataPtr->lockstepTimeoutMs;
       break;
+    case ConnectionState::DEGRADED:
+      waitMs = this->dataPtr->degradedTimeoutMs;
+      break;
+    default:
+      break;
+  }
+
+  const std::chrono::steady_clock::time_point waitStart =
+    std::chrono::steady_clock::now();
+  ssize_t recvSize = -1;
+  if (this->dataPtr->replay)
+  {
+    // recorded servo packet of this step, never waits
+    ArduPilotRecord record;
+    if (this->NextRecord(ArduPilotRecordType::SERVO, _simTime, record) &&
+        record.size > 0)
+    {
+      recvSize = link.Inject(record.data, record.size);
     }
-    counter++;
-    pkt = last_pkt;
-    recvSize = recvSize_last;
   }
-  if (counter > 0)
+  else
+  {
+    // waits for the servo packet, and drains the socket in the case
+    // we're backed up
+    recvSize = link.Receive(waitMs);
+  }
+  if (this->dataPtr->arduPilotOnline)
+  {
+    this->AccountStallTime(std::chrono::steady_clock::now() - waitStart);
+  }
+
+  if (this->dataPtr->recorder)
+  {
+    this->Record(ArduPilotRecordType::SERVO, _simTime, link.ServoPacket(),
+        recvSize == -1 ? 0 : recvSize);
+  }
+  if (link.Drained() > 0)
   {
     gzdbg << "[" << this->dataPtr->modelName << "] "
-          << "Drained n packets: " << counter << std::endl;
+          << "Drained n packets: " << link.Drained()
+          << ", dropped in total: " << link.Dropped()
+          << "/" << link.Received() << std::endl;
   }
 
   if (recvSize == -1)
   {
     // didn't receive a packet
     // gzdbg << "no packet\n";
-    gazebo::common::Time::NSleep(100);
     if (this->dataPtr->arduPilotOnline)
     {
-      gzwarn << "[" << this->dataPtr->modelName << "] "
-             << "Broken ArduPilot connection, count ["
-             << this->dataPtr->connectionTimeoutCount
-             << "/" << this->dataPtr->connectionTimeoutMaxCount
-             << "]\n";
-      if (++this->dataPtr->connectionTimeoutCount >
-        this->dataPtr->connectionTimeoutMaxCount)
-      {
-        this->dataPtr->connectionTimeoutCount = 0;
-        this->dataPtr->arduPilotOnline = false;
-        gzwarn << "[" << this->dataPtr->modelName << "] "
-               << "Broken ArduPilot connection, resetting motor control.\n";
-        this->ResetPIDs();
-      }
+      ++this->dataPtr->servoTimeouts;
+    }
+    if (!this->dataPtr->lockstep && !this->dataPtr->replay)
+    {
+      gazebo::common::Time::NSleep(100);
     }
+    this->ServoTimeout(_simTime);
   }
   else
   {
-    const ssize_t expectedPktSize =
-    sizeof(pkt.motorSpeed[0]) * this->dataPtr->controls.size();
-    if (recvSize < expectedPktSize)
+    ServoCommand servo;
+    if (!link.Parse(recvSize, servo))
     {
       gzerr << "[" << this->dataPtr->modelName << "] "
-            << "got less than model needs. Got: " << recvSize
-            << "commands, expected size: " << expectedPktSize << "\n";
+            << "malformed or unsupported versioned servo packet of size "
+            << recvSize << ", ignored.\n";
+      return;
+    }
+
+    if (link.VersionChanged())
+    {
+      gzmsg << "[" << this->dataPtr->modelName << "] "
+            << "ArduPilot sends "
+            << (servo.versioned ? "versioned" : "legacy")
+            << " servo packets.\n";
     }
-    const ssize_t recvChannels = recvSize / sizeof(pkt.motorSpeed[0]);
+
+    const ssize_t expectedChannels = this->dataPtr->controls.Size();
+    if (servo.channelCount < expectedChannels)
+    {
+      gzerr << "[" << this->dataPtr->modelName << "] "
+            << "got less than model needs. Got: " << servo.channelCount
+            << "commands, expected: " << expectedChannels << "\n";
+    }
+    const ssize_t recvChannels = servo.channelCount;
     // for(unsigned int i = 0; i < recvChannels; ++i)
     // {
-    //   gzdbg << "servo_command [" << i << "]: " << pkt.motorSpeed[i] << "\n";
+    //   gzdbg << "servo_command [" << i << "]: " << servo.Channel(i) << "\n";
     // }
 
-    if (!this->dataPtr->arduPilotOnline)
+    switch (this->dataPtr->connectionState)
     {
-      gzdbg << "[" << this->dataPtr->modelName << "] "
-            << "ArduPilot controller online detected.\n";
-      // made connection, set some flags
-      this->dataPtr->connectionTimeoutCount = 0;
-      this->dataPtr->arduPilotOnline = true;
+      case ConnectionState::OFFLINE:
+        gzdbg << "[" << this->dataPtr->modelName << "] "
+              << "ArduPilot controller online detected.\n";
+        this->dataPtr->handshakeCount = 1;
+        this->SetConnectionState(ConnectionState::HANDSHAKE, _simTime);
+        if (this->dataPtr->handshakeCount >= this->dataPtr->handshakeFrames)
+        {
+          this->SetConnectionState(ConnectionState::LOCKSTEP, _simTime);
+        }
+        break;
+      case ConnectionState::HANDSHAKE:
+        if (++this->dataPtr->handshakeCount >= this->dataPtr->handshakeFrames)
+        {
+          this->SetConnectionState(ConnectionState::LOCKSTEP, _simTime);
+        }
+        break;
+      case ConnectionState::DEGRADED:
+        gzmsg << "[" << this->dataPtr->modelName << "] "
+              << "ArduPilot back after "
+              << this->dataPtr->connectionTimeoutCount
+              << " missed servo packets.\n";
+        this->SetConnectionState(ConnectionState::LOCKSTEP, _simTime);
+        break;
+      case ConnectionState::LOCKSTEP:
+      default:
+        break;
+    }
+
+    // duplicate or reordered frame, keep applying the newer one
+    if (!link.Accept(servo))
+    {
+      return;
     }
 
     // compute command based on requested motorSpeed
-    for (unsigned i = 0; i < this->dataPtr->controls.size(); ++i)
+    ControlArrays &controls = this->dataPtr->controls;
+    for (unsigned i = 0; i < controls.Size(); ++i)
     {
       if (i < MAX_MOTORS)
       {
-        if (this->dataPtr->controls[i].channel < recvChannels)
+        if (controls.channel[i] < recvChannels)
         {
           // bound incoming cmd between 0 and 1
           const double cmd = ignition::math::clamp(
-            pkt.motorSpeed[this->dataPtr->controls[i].channel],
+            servo.Channel(controls.channel[i]),
             -1.0f, 1.0f);
-          this->dataPtr->controls[i].cmd =
-            this->dataPtr->controls[i].multiplier *
-            (this->dataPtr->controls[i].offset + cmd);
-          // gzdbg << "apply input chan[" << this->dataPtr->controls[i].channel
+          controls.cmd[i] = controls.multiplier[i] * (controls.offset[i] + cmd);
+          // gzdbg << "apply input chan[" << controls.channel[i]
           //       << "] to control chan[" << i
           //       << "] with joint name ["
-          //       << this->dataPtr->controls[i].jointName
+          //       << controls.jointName[i]
           //       << "] raw cmd ["
-          //       << pkt.motorSpeed[this->dataPtr->controls[i].channel]
-          //       << "] adjusted cmd [" << this->dataPtr->controls[i].cmd
+          //       << servo.Channel(controls.channel[i])
+          //       << "] adjusted cmd [" << controls.cmd[i]
           //       << "].\n";
         }
         else
         {
           gzerr << "[" << this->dataPtr->modelName << "] "
                 << "control[" << i << "] channel ["
-                << this->dataPtr->controls[i].channel
+                << controls.channel[i]
                 << "] is greater than incoming commands size["
                 << recvChannels
                 << "], control not applied.\n";
@@ -1104,36 +2047,494 @@ void ArduPilotPlugin::ReceiveMotorCommand()
 }
 
 /////////////////////////////////////////////////
-void ArduPilotPlugin::SendState() const
+bool ArduPilotPlugin::InitKinematicImu(sdf::ElementPtr _sdf)
+{
+  // the imu link and mounting come from the imu sensor when there is one,
+  // it is then switched off as nothing reads it anymore
+  std::string linkName = _sdf->Get("imuLinkName", std::string()).first;
+  if (this->dataPtr->imuSensor)
+  {
+    if (linkName.empty())
+    {
+      linkName = this->dataPtr->imuSensor->ParentName();
+    }
+    this->dataPtr->imuPose = this->dataPtr->imuSensor->Pose();
+    this->dataPtr->imuSensor->SetActive(false);
+  }
+  this->dataPtr->imuLink = linkName.empty() ? this->dataPtr->rootLink :
+    this->dataPtr->model->GetLink(linkName);
+  if (!this->dataPtr->imuLink)
+  {
+    gzerr << "[" << this->dataPtr->modelName << "] "
+          << "imu link [" << linkName
+          << "] not found, abort ArduPilot plugin.\n";
+    return false;
+  }
+  this->dataPtr->imuPose = _sdf->Get("imuPose", this->dataPtr->imuPose).first;
+
+  gzmsg << "[" << this->dataPtr->modelName << "] "
+        << "kinematic imu on link "
+        << this->dataPtr->imuLink->GetScopedName() << "\n";
+  return true;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::KinematicImu(const common::Time &_simTime,
+    fdmPacket &_pkt)
+{
+  ArduPilotPluginPrivate &data = *this->dataPtr;
+  const double simTime = _simTime.Double();
+
+  // imu frame in the world, then velocity of the imu itself, which is
+  // off the link origin
+  const ignition::math::Quaterniond imuRot =
+    (data.imuPose + data.imuLink->WorldPose()).Rot();
+  const ignition::math::Vector3d vel =
+    data.imuLink->WorldLinearVel(data.imuPose.Pos());
+
+  // mean acceleration since the previous exchange, what an accelerometer
+  // sampled at the exchange rate integrates
+  ignition::math::Vector3d accel;
+  const double dt = simTime - data.imuLastTime;
+  if (data.imuLastTime >= 0.0 && dt > 0.0)
+  {
+    accel = (vel - data.imuLastVel) / dt;
+  }
+  else
+  {
+    accel = data.imuLink->WorldLinearAccel();
+  }
+  data.imuLastVel = vel;
+  data.imuLastTime = simTime;
+
+  // specific force and body rates in the imu frame
+  const ignition::math::Vector3d linearAccel =
+    imuRot.RotateVectorReverse(accel - data.world->Gravity());
+  const ignition::math::Vector3d angularVel =
+    imuRot.RotateVectorReverse(data.imuLink->WorldAngularVel());
+
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    _pkt.imuLinearAccelerationXYZ[i] = linearAccel[i];
+    _pkt.imuAngularVelocityRPY[i] = angularVel[i];
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::ApplyImuErrors(const common::Time &_simTime,
+    fdmPacket &_pkt)
+{
+  ArduPilotPluginPrivate &data = *this->dataPtr;
+
+  // rotor velocities, of the virtual rotors and of the spinning joints
+  std::vector<double> &velocities = data.rotorVelocities;
+  velocities.clear();
+  if (data.imuErrors.Vibrates())
+  {
+    velocities.insert(velocities.end(), data.rotors.velocity.begin(),
+        data.rotors.velocity.end());
+    const ControlArrays &controls = data.controls;
+    for (size_t i = 0; i < controls.Size(); ++i)
+    {
+      if (controls.law[i] == ControlLaw::VELOCITY &&
+          controls.velocityScale[i] > 0.0)
+      {
+        velocities.push_back(
+            controls.joint[i]->GetVelocity(0) / controls.velocityScale[i]);
+      }
+    }
+  }
+
+  // batch samples in time order, each at its own measurement time
+  for (uint16_t i = 0; i < data.imuBatchCount; ++i)
+  {
+    ImuBatchSample &sample = data.imuBatch[i];
+    data.imuErrors.Apply(sample.timestamp, velocities.data(),
+        velocities.size(), sample.imuLinearAccelerationXYZ,
+        sample.imuAngularVelocityRPY);
+  }
+
+  if (data.imuMode == ImuMode::BATCH && data.imuBatchCount > 0)
+  {
+    // the packet fields are the newest sample, keep them consistent
+    const ImuBatchSample &last = data.imuBatch[data.imuBatchCount - 1];
+    std::memcpy(_pkt.imuLinearAccelerationXYZ, last.imuLinearAccelerationXYZ,
+        sizeof(_pkt.imuLinearAccelerationXYZ));
+    std::memcpy(_pkt.imuAngularVelocityRPY, last.imuAngularVelocityRPY,
+        sizeof(_pkt.imuAngularVelocityRPY));
+  }
+  else
+  {
+    data.imuErrors.Apply(_simTime.Double(), velocities.data(),
+        velocities.size(), _pkt.imuLinearAccelerationXYZ,
+        _pkt.imuAngularVelocityRPY);
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::DropImuSamples(const common::Time &_simTime)
+{
+  // nobody to send them to, only hold the newest one so the ring never
+  // fills up and the first packet after a reconnect is current
+  ArduPilotImuRing &ring = *this->dataPtr->imuRing;
+  const double simTime = _simTime.Double();
+  const ImuBatchSample *sample;
+  while ((sample = ring.Front()) != nullptr && sample->timestamp <= simTime)
+  {
+    this->dataPtr->imuSample = *sample;
+    this->dataPtr->imuSampleValid = true;
+    ring.Pop();
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::TakeImuSamples(const common::Time &_simTime)
+{
+  ArduPilotImuRing &ring = *this->dataPtr->imuRing;
+  const bool batch = this->dataPtr->imuMode == ImuMode::BATCH;
+  const double simTime = _simTime.Double();
+  this->dataPtr->imuBatchCount = 0;
+
+  // samples measured after this step stay queued for the next packet
+  bool fresh = false;
+  const ImuBatchSample *sample;
+  while ((sample = ring.Front()) != nullptr && sample->timestamp <= simTime)
+  {
+    if (batch)
+    {
+      uint16_t &count = this->dataPtr->imuBatchCount;
+      if (count == kImuBatchMaxSamples)
+      {
+        // keep the newest ones
+        std::memmove(this->dataPtr->imuBatch, this->dataPtr->imuBatch + 1,
+            (count - 1) * sizeof(ImuBatchSample));
+        --count;
+        ++this->dataPtr->imuDropped;
+      }
+      this->dataPtr->imuBatch[count++] = *sample;
+    }
+    this->dataPtr->imuSample = *sample;
+    ring.Pop();
+    fresh = true;
+  }
+
+  if (!fresh)
+  {
+    ++this->dataPtr->imuStale;
+    if (!this->dataPtr->imuSampleValid)
+    {
+      // the sensor has not published yet
+      const ignition::math::Vector3d linearAccel =
+        this->dataPtr->imuSensor->LinearAcceleration();
+      const ignition::math::Vector3d angularVel =
+        this->dataPtr->imuSensor->AngularVelocity();
+      ImuBatchSample &held = this->dataPtr->imuSample;
+      held.timestamp = simTime;
+      held.imuLinearAccelerationXYZ[0] = linearAccel.X();
+      held.imuLinearAccelerationXYZ[1] = linearAccel.Y();
+      held.imuLinearAccelerationXYZ[2] = linearAccel.Z();
+      held.imuAngularVelocityRPY[0] = angularVel.X();
+      held.imuAngularVelocityRPY[1] = angularVel.Y();
+      held.imuAngularVelocityRPY[2] = angularVel.Z();
+    }
+  }
+  else
+  {
+    this->dataPtr->imuSampleValid = true;
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::Record(const ArduPilotRecordType _type,
+    const common::Time &_simTime, const void *_buf, const size_t _size)
+{
+  if (!this->dataPtr->recorder->Write(_type, _simTime.Double(), _buf, _size)
+      && !this->dataPtr->recordFailed)
+  {
+    gzerr << "[" << this->dataPtr->modelName << "] "
+          << "failed to grow the record file at sim time "
+          << _simTime.Double() << " after "
+          << this->dataPtr->recorder->Count()
+          << " packets, the recording is incomplete.\n";
+    this->dataPtr->recordFailed = true;
+  }
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotPlugin::NextRecord(const ArduPilotRecordType _type,
+    const common::Time &_simTime, ArduPilotRecord &_record)
+{
+  if (this->dataPtr->replayDone)
+  {
+    return false;
+  }
+  if (!this->dataPtr->replay->Next(_record))
+  {
+    gzmsg << "[" << this->dataPtr->modelName << "] "
+          << "replay finished after " << this->dataPtr->replay->Position()
+          << " packets, " << this->dataPtr->replayMismatches
+          << " state packets differ from the recording.\n";
+    this->dataPtr->replayDone = true;
+    return false;
+  }
+  if (_record.type != _type)
+  {
+    gzerr << "[" << this->dataPtr->modelName << "] "
+          << "replay out of sync at packet "
+          << this->dataPtr->replay->Position()
+          << ", were fdm_rate or the world changed? replay stopped.\n";
+    this->dataPtr->replayDone = true;
+    return false;
+  }
+  if (std::abs(_record.simTime - _simTime.Double()) >
+        this->dataPtr->replayTimeTolerance &&
+      !this->dataPtr->replayTimeWarned)
+  {
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "sim time " << _simTime.Double()
+           << " differs from the recorded " << _record.simTime
+           << ", the replay may not be deterministic.\n";
+    this->dataPtr->replayTimeWarned = true;
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotPlugin::RecordedTransition(const ConnectionState _state) const
+{
+  ArduPilotRecord record;
+  uint32_t state;
+  if (this->dataPtr->replayDone || !this->dataPtr->replay->Peek(record) ||
+      record.type != ArduPilotRecordType::CONNECTION ||
+      record.size != sizeof(state))
+  {
+    return false;
+  }
+  std::memcpy(&state, record.data, sizeof(state));
+  return state == static_cast<uint32_t>(_state);
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::SetConnectionState(const ConnectionState _state,
+    const common::Time &_simTime)
+{
+  if (_state == this->dataPtr->connectionState)
+  {
+    return;
+  }
+  const uint32_t state = static_cast<uint32_t>(_state);
+  if (this->dataPtr->recorder)
+  {
+    this->Record(ArduPilotRecordType::CONNECTION, _simTime, &state,
+        sizeof(state));
+  }
+  if (this->dataPtr->replay && !this->dataPtr->replayDone)
+  {
+    // the recording must go through the same transition
+    const bool recorded = this->RecordedTransition(_state);
+    ArduPilotRecord record;
+    if (this->NextRecord(ArduPilotRecordType::CONNECTION, _simTime, record) &&
+        !recorded)
+    {
+      gzerr << "[" << this->dataPtr->modelName << "] "
+            << "replay out of sync at packet "
+            << this->dataPtr->replay->Position() << ", the recording went"
+            << " to another connection state. replay stopped.\n";
+      this->dataPtr->replayDone = true;
+    }
+  }
+  gzmsg << "[" << this->dataPtr->modelName << "] "
+        << "ArduPilot connection "
+        << ConnectionStateName(this->dataPtr->connectionState) << " -> "
+        << ConnectionStateName(_state) << ".\n";
+  if (this->dataPtr->connectionState == ConnectionState::OFFLINE)
+  {
+    this->dataPtr->imuReconnectCheck = true;
+  }
+  this->dataPtr->connectionState = _state;
+  this->dataPtr->arduPilotOnline = _state != ConnectionState::OFFLINE;
+  this->dataPtr->connectionTimeoutCount = 0;
+  this->dataPtr->unreportedMisses = 0;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::ServoTimeout(const common::Time &_simTime)
 {
-  // send_fdm
-  fdmPacket pkt;
+  const std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now();
+  bool offline = false;
+  switch (this->dataPtr->connectionState)
+  {
+    case ConnectionState::OFFLINE:
+      return;
+    case ConnectionState::HANDSHAKE:
+      // not confirmed yet, likely a stray packet
+      offline = true;
+      break;
+    case ConnectionState::LOCKSTEP:
+      this->SetConnectionState(ConnectionState::DEGRADED, _simTime);
+      this->dataPtr->degradedWallStart = now;
+      this->dataPtr->degradedSimStart = _simTime;
+      this->dataPtr->lastConnectionWarning = now;
+      gzwarn << "[" << this->dataPtr->modelName << "] "
+             << "Broken ArduPilot connection, running free on the last"
+             << " command.\n";
+      break;
+    case ConnectionState::DEGRADED:
+    default:
+      break;
+  }
 
-  pkt.timestamp = this->dataPtr->model->GetWorld()->SimTime().Double();
+  if (this->dataPtr->connectionState == ConnectionState::DEGRADED)
+  {
+    ++this->dataPtr->connectionTimeoutCount;
+    ++this->dataPtr->unreportedMisses;
+    const double wallElapsed = std::chrono::duration<double>(
+        now - this->dataPtr->degradedWallStart).count();
+    const double simElapsed =
+      (_simTime - this->dataPtr->degradedSimStart).Double();
+    // the wall time of a replay has nothing to do with the recording, take
+    // the wall deadline from the recorded transitions instead
+    const bool wallExpired = this->dataPtr->replay ?
+      this->RecordedTransition(ConnectionState::OFFLINE) :
+      (this->dataPtr->degradedWallTimeout > 0.0 &&
+       wallElapsed >= this->dataPtr->degradedWallTimeout);
+    offline = this->dataPtr->connectionTimeoutCount >
+        this->dataPtr->connectionTimeoutMaxCount || wallExpired ||
+      (this->dataPtr->degradedSimTimeout > 0.0 &&
+       simElapsed >= this->dataPtr->degradedSimTimeout);
+
+    // at most one warning per second of wall time
+    if (!offline &&
+        now - this->dataPtr->lastConnectionWarning >= std::chrono::seconds(1))
+    {
+      gzwarn << "[" << this->dataPtr->modelName << "] "
+             << "Broken ArduPilot connection, count ["
+             << this->dataPtr->connectionTimeoutCount
+             << "/" << this->dataPtr->connectionTimeoutMaxCount
+             << "], " << this->dataPtr->unreportedMisses
+             << " missed since last report.\n";
+      this->dataPtr->unreportedMisses = 0;
+      this->dataPtr->lastConnectionWarning = now;
+    }
+  }
+
+  if (offline)
+  {
+    this->SetConnectionState(ConnectionState::OFFLINE, _simTime);
+    this->dataPtr->link.ResetFrames();
+    gzwarn << "[" << this->dataPtr->modelName << "] "
+           << "Broken ArduPilot connection, resetting motor control.\n";
+    this->ResetPIDs();
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::AccountStallTime(
+    const std::chrono::steady_clock::duration _stall)
+{
+  this->dataPtr->stallTime += _stall;
+  this->dataPtr->stallTimeMax = std::max(this->dataPtr->stallTimeMax, _stall);
+  ++this->dataPtr->stallCount;
+
+  // report every 10 seconds of wall time
+  const std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now();
+  if (now - this->dataPtr->lastStallReport < std::chrono::seconds(10))
+  {
+    return;
+  }
+
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  gzdbg << "[" << this->dataPtr->modelName << "] "
+        << "ArduPilot stall time over " << this->dataPtr->stallCount
+        << " steps: mean "
+        << duration_cast<microseconds>(this->dataPtr->stallTime).count() /
+           this->dataPtr->stallCount
+        << " us, max "
+        << duration_cast<microseconds>(this->dataPtr->stallTimeMax).count()
+        << " us.\n";
+  const ArduPilotLink &link = this->dataPtr->link;
+  if (link.ServoPacketVersion() > 0)
+  {
+    gzdbg << "[" << this->dataPtr->modelName << "] "
+          << "ArduPilot servo frames lost: " << link.FramesLost()
+          << ", out of order: " << link.FramesOutOfOrder()
+          << ", received: " << link.Received() << ".\n";
+  }
+
+  this->dataPtr->stallTime = std::chrono::steady_clock::duration::zero();
+  this->dataPtr->stallTimeMax = std::chrono::steady_clock::duration::zero();
+  this->dataPtr->stallCount = 0;
+  this->dataPtr->lastStallReport = now;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotPlugin::SendState(const common::Time &_simTime)
+{
+  // send_fdm, every field but the extended ones is rewritten below
+  fdmPacketExt &pkt = this->dataPtr->link.State();
+
+  pkt.timestamp = _simTime.Double();
 
   // asssumed that the imu orientation is:
   //   x forward
   //   y right
   //   z down
 
-  // get linear acceleration in body frame
-  const ignition::math::Vector3d linearAccel =
-    this->dataPtr->imuSensor->LinearAcceleration();
-
-  // copy to pkt
-  pkt.imuLinearAccelerationXYZ[0] = linearAccel.X();
-  pkt.imuLinearAccelerationXYZ[1] = linearAccel.Y();
-  pkt.imuLinearAccelerationXYZ[2] = linearAccel.Z();
-  // gzerr << "lin accel [" << linearAccel << "]\n";
-
-  // get angular velocity in body frame
-  const ignition::math::Vector3d angularVel =
-    this->dataPtr->imuSensor->AngularVelocity();
+  if (this->dataPtr->imuMode == ImuMode::SENSOR)
+  {
+    // get linear acceleration in body frame
+    const ignition::math::Vector3d linearAccel =
+      this->dataPtr->imuSensor->LinearAcceleration();
+
+    // copy to pkt
+    pkt.imuLinearAccelerationXYZ[0] = linearAccel.X();
+    pkt.imuLinearAccelerationXYZ[1] = linearAccel.Y();
+    pkt.imuLinearAccelerationXYZ[2] = linearAccel.Z();
+    // gzerr << "lin accel [" << linearAccel << "]\n";
+
+    // get angular velocity in body frame
+    const ignition::math::Vector3d angularVel =
+      this->dataPtr->imuSensor->AngularVelocity();
+
+    // copy to pkt
+    pkt.imuAngularVelocityRPY[0] = angularVel.X();
+    pkt.imuAngularVelocityRPY[1] = angularVel.Y();
+    pkt.imuAngularVelocityRPY[2] = angularVel.Z();
+  }
+  else if (this->dataPtr->imuMode == ImuMode::KINEMATIC)
+  {
+    this->KinematicImu(_simTime, pkt);
+  }
+  else
+  {
+    // newest sample measured by the end of this step
+    this->TakeImuSamples(_simTime);
+    const ImuBatchSample &sample = this->dataPtr->imuSample;
+    if (this->dataPtr->imuReconnectCheck)
+    {
+      // samples queued while offline must not reach ArduPilot
+      const double age = _simTime.Double() - sample.timestamp;
+      if (age > this->dataPtr->imuMaxAge)
+      {
+        gzwarn << "[" << this->dataPtr->modelName << "] "
+               << "first state packet after reconnecting carries an imu "
+               << "sample " << age << " s old.\n";
+      }
+      this->dataPtr->imuReconnectCheck = false;
+    }
+    std::memcpy(pkt.imuLinearAccelerationXYZ,
+        sample.imuLinearAccelerationXYZ, sizeof(pkt.imuLinearAccelerationXYZ));
+    std::memcpy(pkt.imuAngularVelocityRPY,
+        sample.imuAngularVelocityRPY, sizeof(pkt.imuAngularVelocityRPY));
+  }
 
-  // copy to pkt
-  pkt.imuAngularVelocityRPY[0] = angularVel.X();
-  pkt.imuAngularVelocityRPY[1] = angularVel.Y();
-  pkt.imuAngularVelocityRPY[2] = angularVel.Z();
+  if (this->dataPtr->imuErrors.Enabled())
+  {
+    this->ApplyImuErrors(_simTime, pkt);
+  }
 
   // get inertial pose and velocity
   // position of the uav in world frame
@@ -1192,35 +2593,62 @@ void ArduPilotPlugin::SendState() const
   // or...
   // Get model velocity in NED frame
   const ignition::math::Vector3d velGazeboWorldFrame =
-    this->dataPtr->model->GetLink()->WorldLinearVel();
+    this->dataPtr->rootLink->WorldLinearVel();
   const ignition::math::Vector3d velNEDFrame =
     this->gazeboXYZToNED.Rot().RotateVectorReverse(velGazeboWorldFrame);
   pkt.velocityXYZ[0] = velNEDFrame.X();
   pkt.velocityXYZ[1] = velNEDFrame.Y();
   pkt.velocityXYZ[2] = velNEDFrame.Z();
-/* NOT MERGED IN MASTER YET
-  if (!this->dataPtr->gpsSensor)
-    {
 
-    }
-    else {
-        pkt.longitude = this->dataPtr->gpsSensor->Longitude().Degree();
-        pkt.latitude = this->dataPtr->gpsSensor->Latitude().Degree();
-        pkt.altitude = this->dataPtr->gpsSensor->Altitude();
+  if (this->dataPtr->fdmVersion >= 2)
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->dataPtr->sensorMutex);
+      if (this->dataPtr->gpsSensor)
+      {
+        pkt.latitude = this->dataPtr->latitude;
+        pkt.longitude = this->dataPtr->longitude;
+        pkt.altitude = this->dataPtr->altitude;
+      }
+      pkt.rangefinder = this->dataPtr->rangefinder;
     }
 
-    // TODO : make generic enough to accept sonar/gpuray etc. too
-    if (!this->dataPtr->rangefinderSensor)
-    {
+    const ignition::math::Vector3d wind =
+      this->dataPtr->world->Wind().WorldLinearVel(
+          this->dataPtr->rootLink.get());
+    pkt.airspeed = (velGazeboWorldFrame - wind).Length();
+  }
 
-    } else {
-        // Rangefinder value can not be send as Inf to ardupilot
-        const double range = this->dataPtr->rangefinderSensor->Range(0);
-        pkt.rangefinder = std::isinf(range) ? 0.0 : range;
-    }
+  // BATCH appends every sample since the last packet
+  const size_t pktSize = this->dataPtr->link.FinishState(
+      this->dataPtr->fdmVersion,
+      this->dataPtr->imuMode == ImuMode::BATCH ?
+        this->dataPtr->imuBatch : nullptr,
+      this->dataPtr->imuBatchCount);
 
-  // airspeed :     wind = Vector3(environment.wind.x, environment.wind.y, environment.wind.z)
-   // pkt.airspeed = (pkt.velocity - wind).length()
-*/
-  this->dataPtr->socket_out.Send(&pkt, sizeof(pkt));
+  if (this->dataPtr->recorder)
+  {
+    this->Record(ArduPilotRecordType::STATE, _simTime, &pkt, pktSize);
+  }
+
+  if (this->dataPtr->replay)
+  {
+    // nobody to send to, check the physics reproduces the recording
+    ArduPilotRecord record;
+    if (this->NextRecord(ArduPilotRecordType::STATE, _simTime, record) &&
+        (record.size != pktSize ||
+         std::memcmp(record.data, &pkt, pktSize) != 0))
+    {
+      if (this->dataPtr->replayMismatches++ == 0)
+      {
+        gzwarn << "[" << this->dataPtr->modelName << "] "
+               << "state diverges from the recording at sim time "
+               << _simTime.Double() << ".\n";
+      }
+    }
+  }
+  else
+  {
+    this->dataPtr->link.SendState(pktSize);
+  }
 }
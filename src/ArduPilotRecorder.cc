@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include "include/ArduPilotRecorder.hh"
+
+using namespace gazebo;
+
+/// \brief Identifies an ArduPilot log file, "APRL"
+static const uint32_t kRecordMagic = 0x4c525041;
+
+/// \brief Version of the log file layout
+static const uint32_t kRecordVersion = 2;
+
+/// \brief Size the log file starts with, and grows by at least
+static const size_t kRecordChunk = 16 * 1024 * 1024;
+
+/// \brief Beginning of a log file
+struct gazebo::ArduPilotRecordFile
+{
+  /// \brief kRecordMagic
+  uint32_t magic;
+
+  /// \brief kRecordVersion
+  uint32_t version;
+
+  /// \brief Bytes of committed records following this header
+  uint64_t size;
+
+  /// \brief Number of committed records
+  uint64_t count;
+
+  /// \brief Unused, keeps the records 16 bytes aligned
+  uint64_t reserved;
+};
+
+/// \brief Beginning of every record, followed by the packet padded to 8
+/// bytes
+struct gazebo::ArduPilotRecordHeader
+{
+  /// \brief ArduPilotRecordType
+  uint32_t type;
+
+  /// \brief Packet size
+  uint32_t size;
+
+  /// \brief Sim time of the step
+  double simTime;
+};
+
+static_assert(sizeof(ArduPilotRecordFile) == 32, "unexpected padding");
+static_assert(sizeof(ArduPilotRecordHeader) == 16, "unexpected padding");
+
+/// \brief Size of a record in the file.
+/// \param[in] _size Packet size.
+/// \return Record size, a multiple of 8.
+static size_t RecordSize(const size_t _size)
+{
+  return sizeof(ArduPilotRecordHeader) + ((_size + 7) & ~size_t(7));
+}
+
+/////////////////////////////////////////////////
+ArduPilotRecorder::ArduPilotRecorder()
+{
+}
+
+/////////////////////////////////////////////////
+ArduPilotRecorder::~ArduPilotRecorder()
+{
+  #ifdef __linux__
+  size_t used = 0;
+  if (this->file)
+  {
+    used = sizeof(ArduPilotRecordFile) + this->file->size;
+    munmap(this->file, this->capacity);
+  }
+  if (this->fd >= 0)
+  {
+    if (used > 0 && ftruncate(this->fd, used) != 0)
+    {
+      // the preallocated tail stays, readers stop at the committed size
+    }
+    close(this->fd);
+  }
+  #endif
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotRecorder::Open(const std::string &_path)
+{
+  #ifdef __linux__
+  this->fd = open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644);
+  if (this->fd < 0)
+  {
+    return false;
+  }
+  if (!this->Grow(kRecordChunk))
+  {
+    return false;
+  }
+  this->file->magic = kRecordMagic;
+  this->file->version = kRecordVersion;
+  this->file->size = 0;
+  this->file->count = 0;
+  this->file->reserved = 0;
+  return true;
+  #else
+  (void)_path;
+  return false;
+  #endif
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotRecorder::Write(const ArduPilotRecordType _type,
+    const double _simTime, const void *_buf, const size_t _size)
+{
+  if (!this->file)
+  {
+    return false;
+  }
+  const size_t offset = sizeof(ArduPilotRecordFile) + this->file->size;
+  const size_t recordSize = RecordSize(_size);
+  if (offset + recordSize > this->capacity &&
+      !this->Grow(this->capacity + std::max(this->capacity, recordSize)))
+  {
+    return false;
+  }
+
+  uint8_t *record = reinterpret_cast<uint8_t *>(this->file) + offset;
+  ArduPilotRecordHeader *header =
+    reinterpret_cast<ArduPilotRecordHeader *>(record);
+  header->type = static_cast<uint32_t>(_type);
+  header->size = static_cast<uint32_t>(_size);
+  header->simTime = _simTime;
+  if (_size > 0)
+  {
+    std::memcpy(record + sizeof(ArduPilotRecordHeader), _buf, _size);
+  }
+
+  // commit, the pages already belong to the page cache so the record
+  // survives a crash of the process
+  this->file->size += recordSize;
+  ++this->file->count;
+  return true;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotRecorder::Count() const
+{
+  return this->file ? this->file->count : 0;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotRecorder::Grow(const size_t _capacity)
+{
+  #ifdef __linux__
+  // growing the file leaves the current mapping valid, it is only dropped
+  // once the new one is in place so a failure loses no record
+  if (ftruncate(this->fd, _capacity) != 0)
+  {
+    return false;
+  }
+  void *mem = mmap(nullptr, _capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+      this->fd, 0);
+  if (mem == MAP_FAILED)
+  {
+    return false;
+  }
+  if (this->file)
+  {
+    munmap(this->file, this->capacity);
+  }
+  this->file = static_cast<ArduPilotRecordFile *>(mem);
+  this->capacity = _capacity;
+  return true;
+  #else
+  (void)_capacity;
+  return false;
+  #endif
+}
+
+/////////////////////////////////////////////////
+ArduPilotReplay::ArduPilotReplay()
+{
+}
+
+/////////////////////////////////////////////////
+ArduPilotReplay::~ArduPilotReplay()
+{
+  #ifdef __linux__
+  if (this->file)
+  {
+    munmap(const_cast<ArduPilotRecordFile *>(this->file), this->mapped);
+  }
+  #endif
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotReplay::Open(const std::string &_path)
+{
+  #ifdef __linux__
+  const int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ArduPilotRecordFile))
+  {
+    close(fd);
+    return false;
+  }
+  void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    return false;
+  }
+  this->file = static_cast<const ArduPilotRecordFile *>(mem);
+  this->mapped = st.st_size;
+  if (this->file->magic != kRecordMagic ||
+      this->file->version != kRecordVersion)
+  {
+    return false;
+  }
+  this->offset = sizeof(ArduPilotRecordFile);
+  this->end = std::min(this->mapped,
+      static_cast<size_t>(this->offset + this->file->size));
+  madvise(mem, this->mapped, MADV_SEQUENTIAL);
+  return true;
+  #else
+  (void)_path;
+  return false;
+  #endif
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotReplay::Next(ArduPilotRecord &_record)
+{
+  if (!this->Peek(_record))
+  {
+    return false;
+  }
+  this->offset += RecordSize(_record.size);
+  ++this->position;
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotReplay::Peek(ArduPilotRecord &_record) const
+{
+  if (!this->file ||
+      this->offset + sizeof(ArduPilotRecordHeader) > this->end)
+  {
+    return false;
+  }
+  const uint8_t *record =
+    reinterpret_cast<const uint8_t *>(this->file) + this->offset;
+  const ArduPilotRecordHeader *header =
+    reinterpret_cast<const ArduPilotRecordHeader *>(record);
+  if (this->offset + RecordSize(header->size) > this->end)
+  {
+    return false;
+  }
+  _record.type = static_cast<ArduPilotRecordType>(header->type);
+  _record.simTime = header->simTime;
+  _record.data = record + sizeof(ArduPilotRecordHeader);
+  _record.size = header->size;
+  return true;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotReplay::Count() const
+{
+  return this->file ? this->file->count : 0;
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotReplay::Position() const
+{
+  return this->position;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "include/ArduPilotSender.hh"
+
+using namespace gazebo;
+
+/// \brief One snapshot slot of the triple buffer
+struct ArduPilotSenderSlot
+{
+  /// \brief Packet storage
+  std::vector<uint8_t> data;
+
+  /// \brief Size of the packet in data
+  size_t size = 0;
+};
+
+// Private data class
+class gazebo::ArduPilotSenderPrivate
+{
+  /// \brief Bit of pending set when the slot it names holds a snapshot
+  /// the sender thread has not picked up yet
+  public: static const unsigned int kFresh = 4;
+
+  /// \brief Sends the packets
+  public: ArduPilotSender::SendFunction send;
+
+  /// \brief Snapshot slots
+  public: ArduPilotSenderSlot slots[3];
+
+  /// \brief Slot written by the publisher, only touched by the publisher
+  public: unsigned int back = 0;
+
+  /// \brief Slot waiting for the sender thread, plus kFresh
+  public: std::atomic<unsigned int> pending{1};
+
+  /// \brief Slot being sent, only touched by the sender thread
+  public: unsigned int front = 2;
+
+  /// \brief Packets published
+  public: std::atomic<uint64_t> published{0};
+
+  /// \brief Packets replaced before being sent
+  public: std::atomic<uint64_t> coalesced{0};
+
+  /// \brief True while the sender thread sleeps or is about to
+  public: std::atomic<bool> sleeping{false};
+
+  /// \brief Ask the sender thread to quit
+  public: std::atomic<bool> quit{false};
+
+  /// \brief Protects the sender thread sleep
+  public: std::mutex mutex;
+
+  /// \brief Wakes the sender thread
+  public: std::condition_variable cond;
+
+  /// \brief Sender thread
+  public: std::thread thread;
+};
+
+/////////////////////////////////////////////////
+ArduPilotSender::ArduPilotSender(const SendFunction &_send,
+    const size_t _maxSize)
+  : dataPtr(new ArduPilotSenderPrivate)
+{
+  this->dataPtr->send = _send;
+  for (ArduPilotSenderSlot &slot : this->dataPtr->slots)
+  {
+    slot.data.resize(_maxSize);
+  }
+  this->dataPtr->thread = std::thread(&ArduPilotSender::Run, this);
+}
+
+/////////////////////////////////////////////////
+ArduPilotSender::~ArduPilotSender()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+    this->dataPtr->quit = true;
+  }
+  this->dataPtr->cond.notify_one();
+  this->dataPtr->thread.join();
+}
+
+/////////////////////////////////////////////////
+void ArduPilotSender::Publish(const void *_buf, const size_t _size)
+{
+  ArduPilotSenderSlot &slot = this->dataPtr->slots[this->dataPtr->back];
+  slot.size = std::min(_size, slot.data.size());
+  memcpy(slot.data.data(), _buf, slot.size);
+
+  // hand the back slot over, get the previous pending slot back
+  const unsigned int previous = this->dataPtr->pending.exchange(
+      this->dataPtr->back | ArduPilotSenderPrivate::kFresh,
+      std::memory_order_acq_rel);
+  this->dataPtr->back = previous & ~ArduPilotSenderPrivate::kFresh;
+  this->dataPtr->published.fetch_add(1, std::memory_order_relaxed);
+  if (previous & ArduPilotSenderPrivate::kFresh)
+  {
+    this->dataPtr->coalesced.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // seq_cst pairs with the sleeping store of Run, either the sender
+  // thread sees the fresh slot before sleeping or we see it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (this->dataPtr->sleeping.load(std::memory_order_relaxed))
+  {
+    std::lock_guard<std::mutex> lock(this->dataPtr->mutex);
+    this->dataPtr->cond.notify_one();
+  }
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotSender::Published() const
+{
+  return this->dataPtr->published.load(std::memory_order_relaxed);
+}
+
+/////////////////////////////////////////////////
+uint64_t ArduPilotSender::Coalesced() const
+{
+  return this->dataPtr->coalesced.load(std::memory_order_relaxed);
+}
+
+/////////////////////////////////////////////////
+void ArduPilotSender::Run()
+{
+  ArduPilotSenderPrivate &data = *this->dataPtr;
+  const unsigned int kFresh = ArduPilotSenderPrivate::kFresh;
+  while (true)
+  {
+    if (data.pending.load(std::memory_order_acquire) & kFresh)
+    {
+      // take the fresh slot, leave our stale front slot in its place
+      const unsigned int taken = data.pending.exchange(data.front,
+          std::memory_order_acq_rel);
+      data.front = taken & ~kFresh;
+      const ArduPilotSenderSlot &slot = data.slots[data.front];
+      data.send(slot.data.data(), slot.size);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(data.mutex);
+    data.sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    data.cond.wait(lock, [&data, kFresh]()
+        {
+          return data.quit.load(std::memory_order_relaxed) ||
+            (data.pending.load(std::memory_order_relaxed) & kFresh);
+        });
+    data.sleeping.store(false, std::memory_order_relaxed);
+    if (data.quit)
+    {
+      return;
+    }
+  }
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "include/ArduPilotSensorErrors.hh"
+
+using namespace gazebo;
+
+/// \brief Golden ratio increment, spreads the lanes over the hash input
+static const uint32_t kLaneStride = 0x9e3779b9u;
+
+/// \brief 2^-32
+static const double kInv32 = 1.0 / 4294967296.0;
+
+/// \brief Unsigned 32 bit integer to double through a signed conversion,
+/// which has a vector instruction where the unsigned one has not.
+/// \param[in] _x Integer.
+/// \return _x as a double.
+static inline double ToDouble(const uint32_t _x)
+{
+  return static_cast<int32_t>(_x ^ 0x80000000u) + 2147483648.0;
+}
+
+/// \brief Counters of the vibration phases, apart from the batch counters
+static const uint64_t kPhaseCounter = 1ull << 63;
+
+/// \brief Step size change, s, below which the bias discretization is
+/// kept, sim time differences of a fixed step vary by their rounding
+static const double kBiasDtTolerance = 1e-9;
+
+/// \brief Natural logarithm, to about 1e-9, for positive normal numbers.
+/// Branch free so a loop of them vectorizes, unlike std::log.
+/// \param[in] _x Positive number.
+/// \return log(_x)
+static inline double FastLog(const double _x)
+{
+  // _x = 2^e * m with m in [sqrt(0.5), sqrt(2))
+  uint64_t bits;
+  std::memcpy(&bits, &_x, sizeof(bits));
+  const uint64_t shifted = bits - 0x3fe6a09e667f3bcdull;
+  const int32_t e = static_cast<int32_t>(static_cast<int64_t>(shifted) >> 52);
+  bits -= static_cast<uint64_t>(static_cast<int64_t>(e)) << 52;
+  double m;
+  std::memcpy(&m, &bits, sizeof(m));
+
+  // log(m) = 2 atanh(s), |s| < 0.172
+  const double s = (m - 1.0) / (m + 1.0);
+  const double s2 = s * s;
+  const double series = 1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 *
+        (1.0 / 7 + s2 * (1.0 / 9 + s2 * (1.0 / 11)))));
+  return static_cast<double>(e) * M_LN2 + 2.0 * s * series;
+}
+
+/// \brief Sine and cosine, to about 1e-9, for |_x| <= pi / 4.
+/// \param[in] _x Angle, rad.
+/// \param[out] _sin sin(_x)
+/// \param[out] _cos cos(_x)
+static inline void FastSinCosQuarter(const double _x, double &_sin,
+    double &_cos)
+{
+  const double x2 = _x * _x;
+  _sin = _x * (1.0 - x2 / 6 * (1.0 - x2 / 20 * (1.0 - x2 / 42 *
+          (1.0 - x2 / 72 * (1.0 - x2 / 110)))));
+  _cos = 1.0 - x2 / 2 * (1.0 - x2 / 12 * (1.0 - x2 / 30 *
+        (1.0 - x2 / 56 * (1.0 - x2 / 90 * (1.0 - x2 / 132)))));
+}
+
+/// \brief Sine and cosine of any angle of moderate size.
+/// \param[in] _x Angle, rad.
+/// \param[out] _sin sin(_x)
+/// \param[out] _cos cos(_x)
+static inline void FastSinCos(const double _x, double &_sin, double &_cos)
+{
+  // reduce to [-pi / 4, pi / 4] and rotate back by quadrants
+  const double quadrant = std::nearbyint(_x * M_2_PI);
+  double s, c;
+  FastSinCosQuarter(_x - quadrant * M_PI_2, s, c);
+  const int q = static_cast<int>(quadrant) & 3;
+  _sin = q == 0 ? s : q == 1 ? c : q == 2 ? -s : -c;
+  _cos = q == 0 ? c : q == 1 ? -s : q == 2 ? -c : s;
+}
+
+/////////////////////////////////////////////////
+CounterRandom::CounterRandom(const uint32_t _seed)
+  : key(Hash(_seed ^ 0xa511e9b3u))
+{
+}
+
+/////////////////////////////////////////////////
+void CounterRandom::Normals(const uint64_t _counter, double *_normals) const
+{
+  const uint32_t base = Hash(this->key ^
+      Hash(static_cast<uint32_t>(_counter) ^
+        Hash(static_cast<uint32_t>(_counter >> 32))));
+
+  // Box-Muller, each lane turns two uniform numbers into two normal ones.
+  // Fixed size lanes without branches, vectorized by the compiler.
+  for (unsigned int lane = 0; lane < kLanes; ++lane)
+  {
+    const uint32_t h1 = Hash(base ^ ((2 * lane + 1) * kLaneStride));
+    const uint32_t h2 = Hash(base ^ ((2 * lane + 2) * kLaneStride));
+    // u1 in (0, 1) so its log is finite
+    const double u1 = (ToDouble(h1) + 0.5) * kInv32;
+    const double radius = std::sqrt(-2.0 * FastLog(u1));
+
+    // uniform angle: a quadrant from the top 2 bits, rotated in below, and
+    // a position within the quadrant from the others
+    const double x = (static_cast<int32_t>(h2 & 0x3fffffffu) *
+        (kInv32 * 4) - 0.5) * M_PI_2;
+    double s, c;
+    FastSinCosQuarter(x, s, c);
+    const uint32_t q = h2 >> 30;
+    const double sinAngle = (q & 1) ? c : s;
+    const double cosAngle = (q & 1) ? s : c;
+    _normals[lane] = radius * ((q & 2) ? -cosAngle : cosAngle);
+    _normals[kLanes + lane] = radius * ((q & 2) ? -sinAngle : sinAngle);
+  }
+}
+
+/////////////////////////////////////////////////
+double CounterRandom::Uniform(const uint64_t _counter) const
+{
+  return Hash(this->key ^ Hash(static_cast<uint32_t>(_counter) ^
+        Hash(static_cast<uint32_t>(_counter >> 32)))) * kInv32;
+}
+
+/////////////////////////////////////////////////
+ArduPilotSensorErrors::ArduPilotSensorErrors()
+{
+  for (double &value : this->bias)
+  {
+    value = 0.0;
+  }
+}
+
+/////////////////////////////////////////////////
+void ArduPilotSensorErrors::Configure(const ImuErrorModel &_accel,
+    const ImuErrorModel &_gyro, const double _vibrationRefVelocity,
+    const uint32_t _seed)
+{
+  this->models[0] = _accel;
+  this->models[1] = _gyro;
+  this->random = CounterRandom(_seed);
+  this->counter = 0;
+  this->lastTime = -1.0;
+  this->biasDt = -1.0;
+  this->rotorAngle.clear();
+  this->rotorPhase.clear();
+  this->vibrationScale = _vibrationRefVelocity > 0.0 ?
+    1.0 / (_vibrationRefVelocity * _vibrationRefVelocity) : 0.0;
+
+  this->enabled = false;
+  this->vibrates = false;
+  for (const ImuErrorModel &model : this->models)
+  {
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      this->enabled |= std::abs(model.bias[i]) > 0.0;
+      this->vibrates |= std::abs(model.vibration[i]) > 0.0;
+    }
+    this->enabled |= model.noise > 0.0 || model.biasStd > 0.0;
+  }
+  this->vibrates &= this->vibrationScale > 0.0;
+  this->enabled |= this->vibrates;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotSensorErrors::Enabled() const
+{
+  return this->enabled;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotSensorErrors::Vibrates() const
+{
+  return this->vibrates;
+}
+
+/////////////////////////////////////////////////
+void ArduPilotSensorErrors::Apply(const double _time,
+    const double *_rotorVelocity, const size_t _rotorCount,
+    double *_accel, double *_gyro)
+{
+  // white noise of the 6 axes in lanes 0-5, bias drive in lanes 8-13
+  double normals[2 * CounterRandom::kLanes];
+  this->random.Normals(this->counter++, normals);
+  const double *drive = normals + CounterRandom::kLanes;
+
+  const bool first = this->lastTime < 0.0;
+  const double dt = first ? 0.0 : std::max(0.0, _time - this->lastTime);
+  this->lastTime = _time;
+
+  // exact discretization of the first order Gauss-Markov process,
+  // recomputed only when the step size changes, by more than the
+  // rounding of the sim time differences. The first sample is not a step,
+  // it is kept out of the cache so a later dt of 0 holds the bias.
+  if (first || std::abs(dt - this->biasDt) > kBiasDtTolerance)
+  {
+    this->biasDt = first ? -1.0 : dt;
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+      const ImuErrorModel &model = this->models[i];
+      // the first sample starts from the stationary distribution
+      this->biasPhi[i] = first || model.biasTau <= 0.0 ? 0.0 :
+        std::exp(-dt / model.biasTau);
+      this->biasDrive[i] =
+        model.biasStd * std::sqrt(1.0 - this->biasPhi[i] * this->biasPhi[i]);
+    }
+  }
+
+  double error[6];
+  for (unsigned int axis = 0; axis < 6; ++axis)
+  {
+    const ImuErrorModel &model = this->models[axis / 3];
+    this->bias[axis] = this->biasPhi[axis / 3] * this->bias[axis] +
+      this->biasDrive[axis / 3] * drive[axis];
+    error[axis] = model.bias[axis % 3] + this->bias[axis] +
+      model.noise * normals[axis];
+  }
+
+  if (this->vibrates && _rotorCount > 0)
+  {
+    if (this->rotorAngle.size() != _rotorCount)
+    {
+      // a fixed random phase per rotor and axis, so the axes and rotors
+      // do not vibrate in sync, kept as its sine and cosine
+      this->rotorAngle.assign(_rotorCount, 0.0);
+      this->rotorPhase.resize(_rotorCount * 12);
+      for (size_t i = 0; i < _rotorCount * 6; ++i)
+      {
+        const double phase =
+          2.0 * M_PI * this->random.Uniform(kPhaseCounter + i);
+        this->rotorPhase[2 * i] = std::sin(phase);
+        this->rotorPhase[2 * i + 1] = std::cos(phase);
+      }
+    }
+    for (size_t rotor = 0; rotor < _rotorCount; ++rotor)
+    {
+      const double velocity = _rotorVelocity[rotor];
+      double &angle = this->rotorAngle[rotor];
+      angle += velocity * dt;
+      angle -= 2.0 * M_PI * std::floor(angle * (0.5 * M_1_PI));
+      double s, c;
+      FastSinCos(angle, s, c);
+      // imbalance force grows with the square of the rotor velocity
+      const double scale = velocity * velocity * this->vibrationScale;
+      const double *phase = &this->rotorPhase[rotor * 12];
+      for (unsigned int axis = 0; axis < 6; ++axis)
+      {
+        // sin(angle + phase)
+        const double wave = s * phase[2 * axis + 1] + c * phase[2 * axis];
+        error[axis] += scale * this->models[axis / 3].vibration[axis % 3] *
+          wave;
+      }
+    }
+  }
+
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    _accel[i] += error[i];
+    _gyro[i] += error[3 + i];
+  }
+}
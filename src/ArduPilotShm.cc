@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <linux/futex.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include "include/ArduPilotShm.hh"
+
+using namespace gazebo;
+
+/// \brief Identifies a mapped ArduPilotShmLayout, "APSM"
+static const uint32_t kShmMagic = 0x4d535041;
+
+/// \brief Version of ArduPilotShmLayout
+static const uint32_t kShmVersion = 1;
+
+/// \brief A single-producer / single-consumer packet ring
+struct gazebo::ArduPilotShmRing
+{
+  /// \brief Number of packets ever sent, written by the producer
+  alignas(64) std::atomic<uint32_t> head;
+
+  /// \brief Number of packets ever received, written by the consumer
+  alignas(64) std::atomic<uint32_t> tail;
+
+  /// \brief Number of consumers sleeping on head
+  alignas(64) std::atomic<uint32_t> waiters;
+
+  /// \brief Size of each packet
+  uint32_t size[ArduPilotShm::kSlotCount];
+
+  /// \brief Packet data
+  alignas(64) uint8_t data[ArduPilotShm::kSlotCount][ArduPilotShm::kSlotSize];
+};
+
+/// \brief Content of the shared memory object
+struct gazebo::ArduPilotShmLayout
+{
+  /// \brief kShmMagic once initialized
+  std::atomic<uint32_t> magic;
+
+  /// \brief kShmVersion
+  uint32_t version;
+
+  /// \brief Servo packets, from ArduPilot to gazebo
+  ArduPilotShmRing servo;
+
+  /// \brief State packets, from gazebo to ArduPilot
+  ArduPilotShmRing fdm;
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+    "futex needs a plain 32 bit word");
+
+#ifdef __linux__
+/////////////////////////////////////////////////
+/// \brief Sleep while *_addr == _expected, at most _timeout. May return
+/// early on a signal or a spurious wake up, callers loop.
+static void FutexWait(std::atomic<uint32_t> *_addr, const uint32_t _expected,
+    const std::chrono::nanoseconds _timeout)
+{
+  struct timespec ts;
+  ts.tv_sec = static_cast<time_t>(_timeout.count() / 1000000000);
+  ts.tv_nsec = static_cast<long>(_timeout.count() % 1000000000);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(_addr), FUTEX_WAIT,
+      _expected, &ts, nullptr, 0);
+}
+
+/////////////////////////////////////////////////
+/// \brief Wake every thread sleeping on _addr.
+static void FutexWake(std::atomic<uint32_t> *_addr)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(_addr), FUTEX_WAKE,
+      INT_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+/////////////////////////////////////////////////
+ArduPilotShm::ArduPilotShm()
+{
+}
+
+/////////////////////////////////////////////////
+ArduPilotShm::~ArduPilotShm()
+{
+  #ifdef __linux__
+  if (this->layout)
+  {
+    munmap(this->layout, sizeof(ArduPilotShmLayout));
+  }
+  if (!this->unlinkName.empty())
+  {
+    shm_unlink(this->unlinkName.c_str());
+  }
+  #endif
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotShm::Create(const std::string &_name)
+{
+  if (!this->Map(_name, true))
+  {
+    return false;
+  }
+  this->inRing = &this->layout->servo;
+  this->outRing = &this->layout->fdm;
+  this->unlinkName = _name;
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotShm::Open(const std::string &_name)
+{
+  if (!this->Map(_name, false))
+  {
+    return false;
+  }
+  this->inRing = &this->layout->fdm;
+  this->outRing = &this->layout->servo;
+  return true;
+}
+
+/////////////////////////////////////////////////
+bool ArduPilotShm::Map(const std::string &_name, const bool _create)
+{
+  #ifdef __linux__
+  const int flags = _create ? (O_RDWR | O_CREAT) : O_RDWR;
+  const int fd = shm_open(_name.c_str(), flags | O_CLOEXEC, 0600);
+  if (fd == -1)
+  {
+    return false;
+  }
+  if (_create && ftruncate(fd, sizeof(ArduPilotShmLayout)) != 0)
+  {
+    close(fd);
+    return false;
+  }
+  // a truncated or stale object would fault on first access
+  struct stat st;
+  if (!_create && (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(ArduPilotShmLayout)))
+  {
+    close(fd);
+    return false;
+  }
+
+  void *addr = mmap(nullptr, sizeof(ArduPilotShmLayout),
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+  {
+    return false;
+  }
+  this->layout = static_cast<ArduPilotShmLayout *>(addr);
+
+  if (_create)
+  {
+    // start from empty rings, discard whatever a previous run left
+    this->layout->magic.store(0);
+    for (ArduPilotShmRing *ring : {&this->layout->servo, &this->layout->fdm})
+    {
+      ring->head.store(0);
+      ring->tail.store(0);
+      ring->waiters.store(0);
+    }
+    this->layout->version = kShmVersion;
+    this->layout->magic.store(kShmMagic);
+  }
+  else if (this->layout->magic.load() != kShmMagic ||
+           this->layout->version != kShmVersion)
+  {
+    munmap(this->layout, sizeof(ArduPilotShmLayout));
+    this->layout = nullptr;
+    return false;
+  }
+  return true;
+  #else
+  (void)_name;
+  (void)_create;
+  return false;
+  #endif
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotShm::Send(const void *_buf, const size_t _size)
+{
+  if (!this->outRing || _size > kSlotSize)
+  {
+    return -1;
+  }
+  ArduPilotShmRing *ring = this->outRing;
+
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= kSlotCount)
+  {
+    // full, drop the packet like a full socket buffer would
+    return -1;
+  }
+
+  const uint32_t slot = head % kSlotCount;
+  memcpy(ring->data[slot], _buf, _size);
+  ring->size[slot] = static_cast<uint32_t>(_size);
+  ring->head.store(head + 1, std::memory_order_seq_cst);
+
+  #ifdef __linux__
+  if (ring->waiters.load(std::memory_order_seq_cst) > 0)
+  {
+    FutexWake(&ring->head);
+  }
+  #endif
+  return _size;
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotShm::Recv(void *_buf, const size_t _size,
+    const uint32_t _timeoutMs)
+{
+  if (!this->inRing)
+  {
+    return -1;
+  }
+  ArduPilotShmRing *ring = this->inRing;
+
+  const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint32_t head = ring->head.load(std::memory_order_acquire);
+
+  #ifdef __linux__
+  if (head == tail && _timeoutMs > 0)
+  {
+    ring->waiters.fetch_add(1, std::memory_order_seq_cst);
+    head = ring->head.load(std::memory_order_seq_cst);
+    // signals and spurious wake ups end the wait early, keep waiting
+    // until a packet lands or the deadline passes
+    const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(_timeoutMs);
+    while (head == tail)
+    {
+      const std::chrono::nanoseconds left =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0)
+      {
+        break;
+      }
+      FutexWait(&ring->head, tail, left);
+      head = ring->head.load(std::memory_order_acquire);
+    }
+    ring->waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+  #endif
+
+  if (head == tail)
+  {
+    return -1;
+  }
+
+  const uint32_t slot = tail % kSlotCount;
+  const size_t len = std::min(static_cast<size_t>(ring->size[slot]), _size);
+  memcpy(_buf, ring->data[slot], len);
+  ring->tail.store(tail + 1, std::memory_order_release);
+  return len;
+}
+
+/////////////////////////////////////////////////
+ssize_t ArduPilotShm::RecvLatest(void *_buf, const size_t _size,
+    unsigned int &_count)
+{
+  _count = 0;
+  if (!this->inRing)
+  {
+    return -1;
+  }
+  ArduPilotShmRing *ring = this->inRing;
+
+  const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  const uint32_t head = ring->head.load(std::memory_order_acquire);
+  if (head == tail)
+  {
+    return -1;
+  }
+
+  _count = head - tail;
+  const uint32_t slot = (head - 1) % kSlotCount;
+  const size_t len = std::min(static_cast<size_t>(ring->size[slot]), _size);
+  memcpy(_buf, ring->data[slot], len);
+  ring->tail.store(head, std::memory_order_release);
+  return len;
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+#include <cstdint>
+#include <typeinfo>
+#include <unordered_map>
+
+#include <gazebo/rendering/ogre_gazebo.h>
+#include <gazebo/rendering/Visual.hh>
+
+#include "include/FiducialSelectionBuffer.hh"
+
+namespace gazebo
+{
+  namespace rendering
+  {
+    /// \brief Replaces the material of every entity rendered in the id
+    /// pass by the plain color one of gazebo's selection buffer, in the id
+    /// color of the fiducial the entity belongs to, or black.
+    class FiducialMaterialSwitcher : public Ogre::MaterialManager::Listener
+    {
+      // Documentation Inherited.
+      public: virtual Ogre::Technique *handleSchemeNotFound(
+                  unsigned short _schemeIndex, const Ogre::String &_schemeName,
+                  Ogre::Material *_originalMaterial, unsigned short _lodIndex,
+                  const Ogre::Renderable *_rend);
+
+      /// \brief Id color of an entity.
+      /// \param[in] _entity Entity.
+      /// \return Color of the fiducial owning _entity, black for none.
+      private: Ogre::Vector4 ColorOf(const Ogre::Entity *_entity) const;
+
+      /// \brief Forget the entity of the previous renderable, before a
+      /// pass.
+      public: void Reset()
+      {
+        this->lastEntity = nullptr;
+      }
+
+      /// \brief Scene node of the root visual of every fiducial, to its
+      /// index
+      public: std::unordered_map<const Ogre::Node *, uint16_t> fiducialNodes;
+
+      /// \brief Plain color technique
+      private: Ogre::Technique *plainTechnique = nullptr;
+
+      /// \brief Entity of the previous renderable, its sub-entities come
+      /// in a row
+      private: const Ogre::Entity *lastEntity = nullptr;
+
+      /// \brief Color of lastEntity
+      private: Ogre::Vector4 lastColor;
+    };
+
+    /// \brief Enables the material switcher for the id pass only.
+    class FiducialRenderListener : public Ogre::RenderTargetListener
+    {
+      /// \brief Constructor
+      /// \param[in] _switcher Material switcher of the id pass.
+      public: explicit FiducialRenderListener(
+                  FiducialMaterialSwitcher *_switcher)
+        : switcher(_switcher)
+      {
+      }
+
+      // Documentation Inherited.
+      public: virtual void preRenderTargetUpdate(
+                  const Ogre::RenderTargetEvent &/*_evt*/)
+      {
+        Ogre::MaterialManager::getSingleton().addListener(this->switcher);
+      }
+
+      // Documentation Inherited.
+      public: virtual void postRenderTargetUpdate(
+                  const Ogre::RenderTargetEvent &/*_evt*/)
+      {
+        Ogre::MaterialManager::getSingleton().removeListener(this->switcher);
+      }
+
+      /// \brief Material switcher of the id pass
+      private: FiducialMaterialSwitcher *switcher;
+    };
+
+    struct FiducialSelectionBufferPrivate
+    {
+      /// \brief Ogre camera of the pass
+      public: Ogre::Camera *camera = nullptr;
+
+      /// \brief Id pass texture
+      public: Ogre::TexturePtr texture;
+
+      /// \brief Render target of texture
+      public: Ogre::RenderTarget *renderTexture = nullptr;
+
+      /// \brief Pass width in pixels
+      public: unsigned int width = 0;
+
+      /// \brief Pass height in pixels
+      public: unsigned int height = 0;
+
+      /// \brief Pass read back by the last Update, 8 bit RGB
+      public: std::vector<uint8_t> buffer;
+
+      /// \brief Material switcher of the pass
+      public: FiducialMaterialSwitcher switcher;
+
+      /// \brief Enables switcher during the pass
+      public: std::unique_ptr<FiducialRenderListener> listener;
+    };
+  }
+}
+
+using namespace gazebo;
+using namespace rendering;
+
+/////////////////////////////////////////////////
+Ogre::Technique *FiducialMaterialSwitcher::handleSchemeNotFound(
+    unsigned short /*_schemeIndex*/, const Ogre::String &/*_schemeName*/,
+    Ogre::Material * /*_originalMaterial*/, unsigned short /*_lodIndex*/,
+    const Ogre::Renderable *_rend)
+{
+  if (!_rend || typeid(*_rend) != typeid(Ogre::SubEntity))
+  {
+    return nullptr;
+  }
+
+  if (!this->plainTechnique)
+  {
+    // the material gazebo's selection buffer draws with, its color is the
+    // custom parameter 1 of the renderable
+    Ogre::MaterialPtr plainMaterial =
+      Ogre::MaterialManager::getSingleton().load("gazebo/plain_color",
+          Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME)
+      .staticCast<Ogre::Material>();
+    this->plainTechnique = plainMaterial->getTechnique(0);
+    Ogre::Pass *pass = this->plainTechnique->getPass(0);
+    pass->setDepthCheckEnabled(true);
+    pass->setDepthWriteEnabled(true);
+  }
+
+  const Ogre::SubEntity *subEntity =
+    static_cast<const Ogre::SubEntity *>(_rend);
+  const Ogre::Entity *entity = subEntity->getParent();
+  if (entity != this->lastEntity)
+  {
+    this->lastEntity = entity;
+    this->lastColor = this->ColorOf(entity);
+  }
+  const_cast<Ogre::SubEntity *>(subEntity)->setCustomParameter(
+      1, this->lastColor);
+  return this->plainTechnique;
+}
+
+/////////////////////////////////////////////////
+Ogre::Vector4 FiducialMaterialSwitcher::ColorOf(
+    const Ogre::Entity *_entity) const
+{
+  // the fiducial owning an entity is found up its scene node chain
+  for (const Ogre::Node *node = _entity->getParentNode(); node;
+      node = node->getParent())
+  {
+    auto it = this->fiducialNodes.find(node);
+    if (it != this->fiducialNodes.end())
+    {
+      // id 0 is the background, the fiducial index + 1 over red and green
+      const unsigned int id = it->second + 1u;
+      return Ogre::Vector4((id & 0xff) / 255.0f, ((id >> 8) & 0xff) / 255.0f,
+          0.0f, 1.0f);
+    }
+  }
+  return Ogre::Vector4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+/////////////////////////////////////////////////
+FiducialSelectionBuffer::FiducialSelectionBuffer(
+    const std::string &_cameraName, Ogre::SceneManager *_mgr,
+    Ogre::RenderTarget *_renderTarget)
+  : dataPtr(new FiducialSelectionBufferPrivate)
+{
+  this->dataPtr->camera = _mgr->getCamera(_cameraName);
+  this->dataPtr->width = _renderTarget->getWidth();
+  this->dataPtr->height = _renderTarget->getHeight();
+  this->dataPtr->buffer.resize(
+      3 * this->dataPtr->width * this->dataPtr->height);
+
+  this->dataPtr->texture = Ogre::TextureManager::getSingleton().createManual(
+      "FiducialSelectionTex_" + _cameraName,
+      Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+      Ogre::TEX_TYPE_2D, this->dataPtr->width, this->dataPtr->height, 0,
+      Ogre::PF_R8G8B8, Ogre::TU_RENDERTARGET);
+  this->dataPtr->renderTexture =
+    this->dataPtr->texture->getBuffer()->getRenderTarget();
+  this->dataPtr->renderTexture->setAutoUpdated(false);
+  this->dataPtr->renderTexture->setPriority(0);
+
+  Ogre::Viewport *viewport =
+    this->dataPtr->renderTexture->addViewport(this->dataPtr->camera);
+  viewport->setOverlaysEnabled(false);
+  viewport->setClearEveryFrame(true);
+  viewport->setBackgroundColour(Ogre::ColourValue::Black);
+  // a scheme no material has, so every entity goes through the switcher
+  viewport->setMaterialScheme("fiducial_selection");
+  viewport->setVisibilityMask(GZ_VISIBILITY_SELECTABLE);
+
+  this->dataPtr->listener.reset(
+      new FiducialRenderListener(&this->dataPtr->switcher));
+  this->dataPtr->renderTexture->addListener(this->dataPtr->listener.get());
+}
+
+/////////////////////////////////////////////////
+FiducialSelectionBuffer::~FiducialSelectionBuffer()
+{
+  this->dataPtr->renderTexture->removeListener(this->dataPtr->listener.get());
+  this->dataPtr->renderTexture->removeAllViewports();
+  Ogre::TextureManager::getSingleton().remove(
+      this->dataPtr->texture->getName());
+}
+
+/////////////////////////////////////////////////
+void FiducialSelectionBuffer::SetFiducials(
+    const std::vector<VisualPtr> &_visuals)
+{
+  this->dataPtr->switcher.fiducialNodes.clear();
+  for (size_t i = 0; i < _visuals.size(); ++i)
+  {
+    if (_visuals[i])
+    {
+      this->dataPtr->switcher.fiducialNodes[_visuals[i]->GetSceneNode()] =
+        static_cast<uint16_t>(i);
+    }
+  }
+}
+
+/////////////////////////////////////////////////
+void FiducialSelectionBuffer::Update()
+{
+  this->dataPtr->switcher.Reset();
+  this->dataPtr->renderTexture->update();
+
+  // the whole pass in one read back
+  Ogre::PixelBox pixelBox(this->dataPtr->width, this->dataPtr->height, 1,
+      Ogre::PF_BYTE_RGB, this->dataPtr->buffer.data());
+  this->dataPtr->renderTexture->copyContentsToMemory(pixelBox);
+}
+
+/////////////////////////////////////////////////
+int FiducialSelectionBuffer::FiducialAt(const int _x, const int _y) const
+{
+  if (_x < 0 || _y < 0 ||
+      _x >= static_cast<int>(this->dataPtr->width) ||
+      _y >= static_cast<int>(this->dataPtr->height))
+  {
+    return -1;
+  }
+  const uint8_t *pixel = &this->dataPtr->buffer[
+    3 * (static_cast<size_t>(_y) * this->dataPtr->width + _x)];
+  const int id = pixel[0] | (pixel[1] << 8);
+  return id - 1;
+}
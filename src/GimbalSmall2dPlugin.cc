@@ -14,12 +14,15 @@
  * limitations under the License.
  *
 */
+#include <cstdlib>
 #include <string>
 #include <vector>
 
 #include "gazebo/common/PID.hh"
 #include "gazebo/physics/physics.hh"
 #include "gazebo/transport/transport.hh"
+#include "ArduPilotSocket.hh"
+#include "GimbalProtocol.hh"
 #include "GimbalSmall2dPlugin.hh"
 
 using namespace gazebo;
@@ -27,6 +30,10 @@ using namespace std;
 
 GZ_REGISTER_MODEL_PLUGIN(GimbalSmall2dPlugin)
 
+/// \brief Timestamp jump back, us, taken as a restart of the command
+/// sender rather than a late command
+static const uint64_t kCommandRestartUs = 1000000;
+
 /// \brief Private data class
 class gazebo::GimbalSmall2dPluginPrivate
 {
@@ -34,6 +41,14 @@ class gazebo::GimbalSmall2dPluginPrivate
   /// \param[in] _msg Mesage containing the command string
   public: void OnStringMsg(ConstGzStringPtr &_msg);
 
+  /// \brief Apply the commands queued on the UDP socket.
+  public: void ReceiveCommands();
+
+  /// \brief Send the status.
+  /// \param[in] _time Sim time of the measurement.
+  /// \param[in] _angle Measured tilt angle.
+  public: void PublishStatus(const common::Time &_time, const double _angle);
+
   /// \brief A list of event connections
   public: std::vector<event::ConnectionPtr> connections;
 
@@ -60,6 +75,50 @@ class gazebo::GimbalSmall2dPluginPrivate
 
   /// \brief Last update sim time
   public: common::Time lastUpdateTime;
+
+  /// \brief Exchange binary packets over UDP rather than strings over
+  /// gazebo topics
+  public: bool udp = false;
+
+  /// \brief Address of the status receiver and of the command socket
+  public: std::string udpAddress = "127.0.0.1";
+
+  /// \brief Port commands are received on
+  public: uint16_t udpPortIn = 9010;
+
+  /// \brief Port status is sent to
+  public: uint16_t udpPortOut = 9011;
+
+  /// \brief Socket commands are received on
+  public: ArduPilotSocketPrivate commandSocket;
+
+  /// \brief Socket status is sent on
+  public: ArduPilotSocketPrivate statusSocket;
+
+  /// \brief Roll and yaw targets of the last UDP command, reported back
+  /// only as the gimbal tilts
+  public: float targetRoll = 0.0f;
+
+  /// \brief Yaw target of the last UDP command
+  public: float targetYaw = 0.0f;
+
+  /// \brief True once a UDP command was applied
+  public: bool commandValid = false;
+
+  /// \brief Sequence number of the last applied UDP command
+  public: uint32_t commandSequence = 0;
+
+  /// \brief Timestamp of the last applied UDP command, us
+  public: uint64_t commandTimestamp = 0;
+
+  /// \brief Sim time between status messages
+  public: common::Time statusPeriod = common::Time(0.1);
+
+  /// \brief Sim time of the last status message
+  public: common::Time lastStatusTime;
+
+  /// \brief Status string message, reused
+  public: gazebo::msgs::GzString statusMsg;
 };
 
 /////////////////////////////////////////////////
@@ -94,25 +153,72 @@ void GimbalSmall2dPlugin::Load(physics::ModelPtr _model,
     gzerr << "GimbalSmall2dPlugin::Load ERROR! Can't get joint '"
           << jointName << "' " << endl;
   }
+
+  if (_sdf->HasElement("protocol"))
+  {
+    const std::string protocol = _sdf->Get<std::string>("protocol");
+    this->dataPtr->udp = protocol == "udp";
+    if (!this->dataPtr->udp && protocol != "string")
+    {
+      gzwarn << "protocol [" << protocol << "] not recognized, must be"
+             << " string or udp. default to string.\n";
+    }
+  }
+  if (_sdf->HasElement("udp_addr"))
+  {
+    this->dataPtr->udpAddress = _sdf->Get<std::string>("udp_addr");
+  }
+  if (_sdf->HasElement("udp_port_in"))
+  {
+    this->dataPtr->udpPortIn = _sdf->Get<unsigned int>("udp_port_in");
+  }
+  if (_sdf->HasElement("udp_port_out"))
+  {
+    this->dataPtr->udpPortOut = _sdf->Get<unsigned int>("udp_port_out");
+  }
+  if (_sdf->HasElement("status_rate"))
+  {
+    const double rate = _sdf->Get<double>("status_rate");
+    this->dataPtr->statusPeriod = common::Time(rate > 0 ? 1.0 / rate : 0.0);
+  }
 }
 
 /////////////////////////////////////////////////
 void GimbalSmall2dPlugin::Init()
 {
-  this->dataPtr->node = transport::NodePtr(new transport::Node());
-  this->dataPtr->node->Init(this->dataPtr->model->GetWorld()->GetName());
-
   this->dataPtr->lastUpdateTime =
-    this->dataPtr->model->GetWorld()->GetSimTime();
+    this->dataPtr->model->GetWorld()->SimTime();
+
+  this->dataPtr->connections.push_back(event::Events::ConnectWorldUpdateBegin(
+          std::bind(&GimbalSmall2dPlugin::OnUpdate, this)));
+
+  if (this->dataPtr->udp)
+  {
+    if (!this->dataPtr->commandSocket.Bind(
+          this->dataPtr->udpAddress.c_str(), this->dataPtr->udpPortIn))
+    {
+      gzerr << "GimbalSmall2dPlugin failed to bind with "
+            << this->dataPtr->udpAddress << ":" << this->dataPtr->udpPortIn
+            << ", no command will be received.\n";
+    }
+    if (!this->dataPtr->statusSocket.Connect(
+          this->dataPtr->udpAddress.c_str(), this->dataPtr->udpPortOut))
+    {
+      gzerr << "GimbalSmall2dPlugin failed to connect with "
+            << this->dataPtr->udpAddress << ":" << this->dataPtr->udpPortOut
+            << ", no status will be sent.\n";
+    }
+    return;
+  }
+
+  this->dataPtr->node = transport::NodePtr(new transport::Node());
+  this->dataPtr->node->Init(this->dataPtr->model->GetWorld()->Name());
 
   std::string topic = std::string("~/") +  this->dataPtr->model->GetName() +
     "/gimbal_tilt_cmd";
   this->dataPtr->sub = this->dataPtr->node->Subscribe(topic,
       &GimbalSmall2dPluginPrivate::OnStringMsg, this->dataPtr.get());
 
-  this->dataPtr->connections.push_back(event::Events::ConnectWorldUpdateBegin(
-          std::bind(&GimbalSmall2dPlugin::OnUpdate, this)));
-
   topic = std::string("~/") +
     this->dataPtr->model->GetName() + "/gimbal_tilt_status";
 
@@ -126,15 +232,78 @@ void GimbalSmall2dPluginPrivate::OnStringMsg(ConstGzStringPtr &_msg)
   this->command = atof(_msg->data().c_str());
 }
 
+/////////////////////////////////////////////////
+void GimbalSmall2dPluginPrivate::ReceiveCommands()
+{
+  GimbalCommandPacket pkt;
+  while (this->commandSocket.RecvNoWait(&pkt, sizeof(pkt)) ==
+      static_cast<ssize_t>(sizeof(pkt)))
+  {
+    if (pkt.magic != kGimbalPacketMagic ||
+        pkt.version != kGimbalPacketVersion)
+    {
+      continue;
+    }
+    // ordered by sequence number, with wraparound, unless the sender
+    // restarted and its clock and sequence started over
+    const bool newer =
+      static_cast<int32_t>(pkt.sequence - this->commandSequence) > 0;
+    const bool restarted =
+      pkt.timestamp + kCommandRestartUs < this->commandTimestamp;
+    if (this->commandValid && !newer && !restarted)
+    {
+      continue;
+    }
+    this->commandValid = true;
+    this->commandSequence = pkt.sequence;
+    this->commandTimestamp = pkt.timestamp;
+    this->command = pkt.pitch;
+    this->targetRoll = pkt.roll;
+    this->targetYaw = pkt.yaw;
+  }
+}
+
+/////////////////////////////////////////////////
+void GimbalSmall2dPluginPrivate::PublishStatus(const common::Time &_time,
+    const double _angle)
+{
+  if (this->udp)
+  {
+    GimbalStatusPacket pkt;
+    pkt.magic = kGimbalPacketMagic;
+    pkt.version = kGimbalPacketVersion;
+    pkt.reserved = 0;
+    pkt.timestamp = static_cast<uint64_t>(_time.sec) * 1000000 +
+      _time.nsec / 1000;
+    // the gimbal only tilts
+    pkt.roll = 0.0f;
+    pkt.pitch = static_cast<float>(_angle);
+    pkt.yaw = 0.0f;
+    pkt.targetRoll = this->targetRoll;
+    pkt.targetPitch = static_cast<float>(this->command);
+    pkt.targetYaw = this->targetYaw;
+    this->statusSocket.Send(&pkt, sizeof(pkt));
+    return;
+  }
+
+  this->statusMsg.set_data(std::to_string(_angle));
+  this->pub->Publish(this->statusMsg);
+}
+
 /////////////////////////////////////////////////
 void GimbalSmall2dPlugin::OnUpdate()
 {
   if (!this->dataPtr->tiltJoint)
     return;
 
-  double angle = this->dataPtr->tiltJoint->GetAngle(0).Radian();
+  if (this->dataPtr->udp)
+  {
+    this->dataPtr->ReceiveCommands();
+  }
+
+  double angle = this->dataPtr->tiltJoint->Position(0);
 
-  common::Time time = this->dataPtr->model->GetWorld()->GetSimTime();
+  common::Time time = this->dataPtr->model->GetWorld()->SimTime();
   if (time < this->dataPtr->lastUpdateTime)
   {
     this->dataPtr->lastUpdateTime = time;
@@ -149,14 +318,10 @@ void GimbalSmall2dPlugin::OnUpdate()
     this->dataPtr->lastUpdateTime = time;
   }
 
-  static int i = 1000;
-  if (++i > 100)
+  if (time - this->dataPtr->lastStatusTime >= this->dataPtr->statusPeriod ||
+      time < this->dataPtr->lastStatusTime)
   {
-    i = 0;
-    std::stringstream ss;
-    ss << angle;
-    gazebo::msgs::GzString m;
-    m.set_data(ss.str());
-    this->dataPtr->pub->Publish(m);
+    this->dataPtr->lastStatusTime = time;
+    this->dataPtr->PublishStatus(time, angle);
   }
 }
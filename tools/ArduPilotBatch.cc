@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+// Runs many headless simulation episodes in parallel on one host.
+//
+// Every run is a shell command, typically starting gzserver and ArduPilot
+// SITL and flying a mission. At most -j runs execute at once, each in an
+// instance slot. The slot decides:
+//   - the CPUs the run is pinned to, -c per slot,
+//   - ARDUPILOT_GAZEBO_INSTANCE, the instance offset ArduPilotPlugin adds
+//     to the <instance> of every vehicle to shift its fdm ports, like
+//     SITL -I,
+//   - GAZEBO_MASTER_URI, so every gzserver has its own master.
+// In the command, {i} is replaced by the instance and {r} by the run
+// number, e.g. "sim_vehicle.py -I{i} ...".
+//
+// A run taking longer than -t seconds is killed with its whole process
+// group. Per run timing (wall, user and system CPU time, exit status) is
+// written as csv, and a summary is printed at the end.
+//
+// usage: ArduPilotBatch [-n runs] [-j parallel] [-c cpus_per_run]
+//                       [-t timeout] [-o results.csv] [-l log_dir]
+//                       [-m master_port] command ...
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// \brief Batch settings
+struct BatchOptions
+{
+  /// \brief Number of runs
+  unsigned int runs = 1;
+
+  /// \brief Runs executing at once, 0 for one per cpus
+  unsigned int parallel = 0;
+
+  /// \brief CPUs per run, 0 to share the CPUs evenly between the slots
+  unsigned int cpus = 0;
+
+  /// \brief Seconds before a run is killed, 0 for no limit
+  double timeout = 0.0;
+
+  /// \brief Csv output, stdout if empty
+  std::string output;
+
+  /// \brief Directory receiving the output of every run, none if empty
+  std::string logDir;
+
+  /// \brief Gazebo master port of instance 0, instance i uses
+  /// masterPort + i
+  unsigned int masterPort = 11345;
+
+  /// \brief Command template
+  std::string command;
+};
+
+/// \brief A run being executed
+struct Run
+{
+  /// \brief Run number
+  unsigned int number = 0;
+
+  /// \brief Process id of the shell, also its process group, 0 if the
+  /// slot is free
+  pid_t pid = 0;
+
+  /// \brief Start time
+  std::chrono::steady_clock::time_point start;
+
+  /// \brief True if the run took longer than the timeout
+  bool timedOut = false;
+
+  /// \brief True once the run was sent SIGTERM
+  bool terminated = false;
+
+  /// \brief Time SIGTERM was sent
+  std::chrono::steady_clock::time_point terminateTime;
+
+  /// \brief True once the run was sent SIGKILL
+  bool killed = false;
+};
+
+/// \brief Set by SIGINT and SIGTERM
+static volatile sig_atomic_t stopRequested = 0;
+
+/// \brief Signal handler asking the batch to stop.
+/// \param[in] _signal Signal number.
+static void RequestStop(int /*_signal*/)
+{
+  stopRequested = 1;
+}
+
+/// \brief Replace every occurence of a pattern.
+/// \param[in] _text Text to search.
+/// \param[in] _pattern Pattern to replace.
+/// \param[in] _value Replacement.
+/// \return Text with the pattern replaced.
+static std::string Substitute(std::string _text, const std::string &_pattern,
+    const std::string &_value)
+{
+  size_t pos = 0;
+  while ((pos = _text.find(_pattern, pos)) != std::string::npos)
+  {
+    _text.replace(pos, _pattern.size(), _value);
+    pos += _value.size();
+  }
+  return _text;
+}
+
+/// \brief Start a run in a child process, in its own process group.
+/// \param[in] _options Batch settings.
+/// \param[in] _number Run number.
+/// \param[in] _instance Instance slot.
+/// \param[in] _cpus CPUs the run is pinned to.
+/// \return Child process id, -1 on failure.
+static pid_t StartRun(const BatchOptions &_options, const unsigned int _number,
+    const unsigned int _instance, const std::vector<int> &_cpus)
+{
+  const std::string command = Substitute(Substitute(_options.command,
+        "{i}", std::to_string(_instance)), "{r}", std::to_string(_number));
+  const std::string masterUri = "http://127.0.0.1:" +
+    std::to_string(_options.masterPort + _instance);
+
+  const pid_t pid = fork();
+  if (pid != 0)
+  {
+    return pid;
+  }
+
+  // child, killed with its descendants as one process group
+  setpgid(0, 0);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : _cpus)
+  {
+    CPU_SET(cpu, &set);
+  }
+  if (!_cpus.empty() && sched_setaffinity(0, sizeof(set), &set) != 0)
+  {
+    perror("sched_setaffinity");
+  }
+
+  setenv("ARDUPILOT_GAZEBO_INSTANCE", std::to_string(_instance).c_str(), 1);
+  setenv("ARDUPILOT_BATCH_RUN", std::to_string(_number).c_str(), 1);
+  setenv("GAZEBO_MASTER_URI", masterUri.c_str(), 1);
+
+  if (!_options.logDir.empty())
+  {
+    const std::string log =
+      _options.logDir + "/run_" + std::to_string(_number) + ".log";
+    const int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+  }
+
+  execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+  perror("execl");
+  _exit(127);
+}
+
+/// \brief Seconds in a timeval.
+/// \param[in] _tv Time.
+/// \return Seconds.
+static double Seconds(const struct timeval &_tv)
+{
+  return _tv.tv_sec + _tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char **argv)
+{
+  BatchOptions options;
+  int opt;
+  while ((opt = getopt(argc, argv, "+n:j:c:t:o:l:m:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        options.runs = static_cast<unsigned int>(atoi(optarg));
+        break;
+      case 'j':
+        options.parallel = static_cast<unsigned int>(atoi(optarg));
+        break;
+      case 'c':
+        options.cpus = static_cast<unsigned int>(atoi(optarg));
+        break;
+      case 't':
+        options.timeout = atof(optarg);
+        break;
+      case 'o':
+        options.output = optarg;
+        break;
+      case 'l':
+        options.logDir = optarg;
+        break;
+      case 'm':
+        options.masterPort = static_cast<unsigned int>(atoi(optarg));
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n runs] [-j parallel] [-c cpus_per_run]"
+            " [-t timeout] [-o results.csv] [-l log_dir] [-m master_port]"
+            " command ...\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  for (int i = optind; i < argc; ++i)
+  {
+    options.command += (i > optind ? " " : "") + std::string(argv[i]);
+  }
+  if (options.command.empty())
+  {
+    fprintf(stderr, "no command given\n");
+    return 1;
+  }
+
+  // CPUs this batch may use
+  std::vector<int> available;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+      if (CPU_ISSET(cpu, &set))
+      {
+        available.push_back(cpu);
+      }
+    }
+  }
+  if (available.empty())
+  {
+    available.push_back(0);
+  }
+  const unsigned int cpuCount = static_cast<unsigned int>(available.size());
+  if (options.parallel == 0)
+  {
+    options.parallel = std::max(1u, cpuCount / std::max(1u, options.cpus));
+  }
+  options.parallel = std::max(1u, std::min(options.parallel, options.runs));
+  if (options.cpus == 0)
+  {
+    options.cpus = std::max(1u, cpuCount / options.parallel);
+  }
+  if (options.parallel * options.cpus > cpuCount)
+  {
+    fprintf(stderr, "warning: %u runs x %u cpus oversubscribe %u cpus\n",
+        options.parallel, options.cpus, cpuCount);
+  }
+
+  // CPUs of every slot, wrapping around when oversubscribed
+  std::vector<std::vector<int>> slotCpus(options.parallel);
+  for (unsigned int slot = 0; slot < options.parallel; ++slot)
+  {
+    for (unsigned int c = 0; c < options.cpus; ++c)
+    {
+      slotCpus[slot].push_back(
+          available[(slot * options.cpus + c) % cpuCount]);
+    }
+  }
+
+  FILE *csv = stdout;
+  if (!options.output.empty())
+  {
+    csv = fopen(options.output.c_str(), "w");
+    if (!csv)
+    {
+      perror(options.output.c_str());
+      return 1;
+    }
+  }
+  fprintf(csv, "run,instance,first_cpu,cpus,status,timed_out,"
+      "wall_s,user_s,sys_s\n");
+  fflush(csv);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RequestStop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  const std::chrono::steady_clock::time_point batchStart =
+    std::chrono::steady_clock::now();
+  std::vector<Run> slots(options.parallel);
+  std::vector<double> walls;
+  unsigned int started = 0;
+  unsigned int running = 0;
+  unsigned int failed = 0;
+  const std::chrono::seconds killGrace(5);
+
+  while (running > 0 || (started < options.runs && !stopRequested))
+  {
+    // fill the free slots
+    for (unsigned int slot = 0; slot < options.parallel && !stopRequested &&
+        started < options.runs; ++slot)
+    {
+      Run &run = slots[slot];
+      if (run.pid != 0)
+      {
+        continue;
+      }
+      run = Run();
+      run.number = started++;
+      run.start = std::chrono::steady_clock::now();
+      run.pid = StartRun(options, run.number, slot, slotCpus[slot]);
+      if (run.pid < 0)
+      {
+        perror("fork");
+        run.pid = 0;
+        ++failed;
+        continue;
+      }
+      ++running;
+    }
+
+    // reap the finished runs
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    {
+      for (unsigned int slot = 0; slot < options.parallel; ++slot)
+      {
+        Run &run = slots[slot];
+        if (run.pid != pid)
+        {
+          continue;
+        }
+        // leftovers of the run, e.g. a gzserver started in background
+        kill(-pid, SIGKILL);
+        const double wall = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - run.start).count();
+        const int code = WIFEXITED(status) ? WEXITSTATUS(status) :
+          128 + WTERMSIG(status);
+        fprintf(csv, "%u,%u,%d,%u,%d,%d,%.3f,%.3f,%.3f\n", run.number, slot,
+            slotCpus[slot].front(), options.cpus, code, run.timedOut ? 1 : 0,
+            wall, Seconds(usage.ru_utime), Seconds(usage.ru_stime));
+        fflush(csv);
+        walls.push_back(wall);
+        if (code != 0 || run.timedOut)
+        {
+          ++failed;
+        }
+        run.pid = 0;
+        --running;
+        break;
+      }
+    }
+
+    // enforce the timeout, or stop everything on request
+    const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+    for (Run &run : slots)
+    {
+      if (run.pid == 0)
+      {
+        continue;
+      }
+      const bool expired = options.timeout > 0.0 &&
+        now - run.start > std::chrono::duration<double>(options.timeout);
+      if ((expired || stopRequested) && !run.terminated)
+      {
+        kill(-run.pid, SIGTERM);
+        run.timedOut = expired;
+        run.terminated = true;
+        run.terminateTime = now;
+      }
+      else if (run.terminated && !run.killed &&
+          now - run.terminateTime > killGrace)
+      {
+        kill(-run.pid, SIGKILL);
+        run.killed = true;
+      }
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  const double batchWall = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - batchStart).count();
+  if (csv != stdout)
+  {
+    fclose(csv);
+  }
+
+  std::sort(walls.begin(), walls.end());
+  double sum = 0.0;
+  for (const double wall : walls)
+  {
+    sum += wall;
+  }
+  fprintf(stderr, "%zu/%u runs in %.1f s, %u parallel x %u cpus,"
+      " %.1f runs/h, %u failed\n", walls.size(), options.runs, batchWall,
+      options.parallel, options.cpus,
+      batchWall > 0.0 ? walls.size() * 3600.0 / batchWall : 0.0, failed);
+  if (!walls.empty())
+  {
+    fprintf(stderr, "run wall time: mean %.1f s, p50 %.1f s, max %.1f s\n",
+        sum / walls.size(), walls[walls.size() / 2], walls.back());
+  }
+  return failed == 0 && !stopRequested ? 0 : 1;
+}
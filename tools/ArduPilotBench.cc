@@ -0,0 +1,551 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+// Benchmark of the ArduPilotPlugin servo receive / state send cycle.
+//
+// Every vehicle runs two threads: a plugin side driving the same
+// ArduPilotLink as ArduPilotPlugin (wait for the servo packet, drain the
+// backlog, parse it and check its frame number, build and send the state
+// packet), and a fake SITL peer sending versioned servo packets in
+// lockstep. No Gazebo and no network are involved, only loopback UDP or
+// shared memory, optionally with the shared bridge thread receiving and
+// the sender thread sending.
+//
+// For every vehicle count it prints the total and per vehicle exchange
+// rate, the plugin side step latency distribution and the plugin side
+// CPU time per step.
+//
+// usage: ArduPilotBench [-t udp|shm] [-d seconds] [-c channels]
+//                       [-f fdm_version] [-p base_port] [-b] [-a] [-m]
+//                       [vehicles ...]
+// -b receives on the shared ArduPilotBridge (sharedBridge, udp only),
+// -a sends from an ArduPilotSender thread (asyncSend).
+//
+// With -m it instead times the in-process part of a step on a single
+// ArduPilotLink, without any I/O or peer: servo packet parse and frame
+// check, command mapping and state packet layout. The Gazebo side of
+// OnUpdate is not included, use the plugin <statsPeriod> report for it.
+// vehicles defaults to 1 2 4 8 16 32 64.
+
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/ArduPilotLink.hh"
+#include "include/ArduPilotProtocol.hh"
+#include "include/ArduPilotShm.hh"
+#include "include/ArduPilotSocket.hh"
+#include "include/ArduPilotStats.hh"
+
+using namespace gazebo;
+
+/// \brief Benchmark settings
+struct BenchOptions
+{
+  /// \brief Use shared memory instead of loopback UDP
+  bool shm = false;
+
+  /// \brief Measured seconds per vehicle count
+  double seconds = 3.0;
+
+  /// \brief Servo channels per packet
+  unsigned int channels = 4;
+
+  /// \brief State packet version, 1 or 2
+  int fdmVersion = 1;
+
+  /// \brief First vehicle fdm_port_in, vehicle i uses basePort + 10 * i
+  uint16_t basePort = 19002;
+
+  /// \brief Receive on the shared ArduPilotBridge
+  bool bridge = false;
+
+  /// \brief Send from an ArduPilotSender thread
+  bool async = false;
+
+  /// \brief Time the in-process step only, no I/O
+  bool micro = false;
+};
+
+/// \brief Shared memory object name of a vehicle.
+/// \param[in] _vehicle Vehicle index.
+/// \return Name.
+static std::string ShmName(const unsigned int _vehicle)
+{
+  return "/ardupilot_bench_" + std::to_string(getpid()) + "_" +
+    std::to_string(_vehicle);
+}
+
+/// \brief SITL end of a vehicle link, UDP or shared memory
+class BenchLink
+{
+  /// \brief Open the link, after the plugin side.
+  /// \param[in] _options Benchmark settings.
+  /// \param[in] _vehicle Vehicle index.
+  /// \return True on success.
+  public: bool Init(const BenchOptions &_options, const unsigned int _vehicle)
+  {
+    if (_options.shm)
+    {
+      this->shm.reset(new ArduPilotShm);
+      return this->shm->Open(ShmName(_vehicle));
+    }
+
+    const uint16_t portIn = _options.basePort + 10 * _vehicle;
+    return this->socketIn.Bind("127.0.0.1", portIn + 1) &&
+      this->socketOut.Connect("127.0.0.1", portIn);
+  }
+
+  /// \brief Send a packet.
+  public: void Send(const void *_buf, const size_t _size)
+  {
+    if (this->shm)
+    {
+      this->shm->Send(_buf, _size);
+    }
+    else
+    {
+      this->socketOut.Send(_buf, _size);
+    }
+  }
+
+  /// \brief Wait for a packet.
+  public: ssize_t Recv(void *_buf, const size_t _size,
+      const uint32_t _timeoutMs)
+  {
+    return this->shm ? this->shm->Recv(_buf, _size, _timeoutMs) :
+      this->socketIn.Recv(_buf, _size, _timeoutMs);
+  }
+
+  /// \brief Shared memory transport, null for UDP
+  private: std::unique_ptr<ArduPilotShm> shm;
+
+  /// \brief Socket receiving packets
+  private: ArduPilotSocketPrivate socketIn;
+
+  /// \brief Socket sending packets
+  private: ArduPilotSocketPrivate socketOut;
+};
+
+/// \brief Counters of one vehicle
+struct BenchVehicle
+{
+  /// \brief Plugin side link
+  ArduPilotLink plugin;
+
+  /// \brief SITL side link
+  BenchLink sitl;
+
+  /// \brief Plugin side step latency, servo wait included
+  LatencyHistogram step;
+
+  /// \brief SITL side servo to state round trip
+  LatencyHistogram roundTrip;
+
+  /// \brief Steps completed by the plugin side while measuring
+  uint64_t steps = 0;
+
+  /// \brief Servo packets the plugin side had to drop
+  uint64_t dropped = 0;
+
+  /// \brief Servo packets SITL never got an answer for
+  uint64_t timeouts = 0;
+
+  /// \brief Plugin thread CPU time while measuring, nanoseconds
+  uint64_t cpuNs = 0;
+};
+
+/// \brief CPU time of the calling thread.
+/// \return Nanoseconds.
+static uint64_t ThreadCpuNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/// \brief Open the plugin side of a vehicle the way
+/// ArduPilotPlugin::InitArduPilotSockets does.
+/// \return True on success.
+static bool InitPlugin(const BenchOptions &_options,
+    const unsigned int _vehicle, ArduPilotLink &_link)
+{
+  if (_options.shm)
+  {
+    if (!_link.OpenShm(ShmName(_vehicle)))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    const uint16_t portIn = _options.basePort + 10 * _vehicle;
+    if (!_link.OpenUdp("127.0.0.1", portIn, "127.0.0.1", portIn + 1) ||
+        (_options.bridge && !_link.UseBridge()))
+    {
+      return false;
+    }
+  }
+  if (_options.async)
+  {
+    _link.UseSender();
+  }
+  return true;
+}
+
+/// \brief Plugin side of a vehicle, the ArduPilotLink calls of
+/// ArduPilotPlugin::ReceiveMotorCommand and ArduPilotPlugin::SendState.
+static void PluginLoop(const BenchOptions &_options, BenchVehicle &_vehicle,
+    const std::atomic<int> &_phase)
+{
+  ArduPilotLink &link = _vehicle.plugin;
+  fdmPacketExt &pkt = link.State();
+  pkt.imuOrientationQuat[0] = 1.0;
+
+  uint64_t cpuStart = 0;
+  bool measuring = false;
+  while (_phase.load(std::memory_order_relaxed) < 2)
+  {
+    if (!measuring && _phase.load(std::memory_order_relaxed) == 1)
+    {
+      measuring = true;
+      cpuStart = ThreadCpuNs();
+    }
+
+    const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+    const ssize_t recvSize = link.Receive(100);
+    if (recvSize == -1)
+    {
+      continue;
+    }
+
+    ServoCommand servo;
+    if (!link.Parse(recvSize, servo) || !link.Accept(servo))
+    {
+      continue;
+    }
+
+    // stand-in for ApplyMotorForces, keeps the parse from being elided
+    double command = 0.0;
+    for (unsigned int i = 0; i < servo.channelCount; ++i)
+    {
+      command += servo.Channel(i);
+    }
+
+    pkt.timestamp += 0.001;
+    pkt.velocityXYZ[2] = command;
+    pkt.positionXYZ[0] = static_cast<double>(servo.frameCount);
+    link.SendState(link.FinishState(_options.fdmVersion, nullptr, 0));
+
+    if (measuring)
+    {
+      _vehicle.step.Add(std::chrono::steady_clock::now() - start);
+      ++_vehicle.steps;
+      _vehicle.dropped += link.Drained();
+    }
+  }
+
+  if (measuring)
+  {
+    _vehicle.cpuNs = ThreadCpuNs() - cpuStart;
+  }
+}
+
+/// \brief Fake SITL side of a vehicle, one servo packet per state packet.
+static void SitlLoop(const BenchOptions &_options, BenchVehicle &_vehicle,
+    const std::atomic<int> &_phase)
+{
+  ServoPacketHeader header;
+  header.magic = kServoPacketMagic;
+  header.version = kServoPacketVersion;
+  header.channelCount = static_cast<uint16_t>(_options.channels);
+  header.frameCount = 0;
+
+  std::vector<uint8_t> servo(
+      sizeof(header) + _options.channels * sizeof(float));
+  for (unsigned int i = 0; i < _options.channels; ++i)
+  {
+    const float command = 0.5f;
+    memcpy(&servo[sizeof(header) + i * sizeof(float)], &command,
+        sizeof(command));
+  }
+  uint8_t fdm[sizeof(fdmPacketExt)];
+
+  while (_phase.load(std::memory_order_relaxed) < 2)
+  {
+    const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    ++header.frameCount;
+    memcpy(servo.data(), &header, sizeof(header));
+    _vehicle.sitl.Send(servo.data(), servo.size());
+
+    const bool answered = _vehicle.sitl.Recv(fdm, sizeof(fdm), 100) != -1;
+    if (_phase.load(std::memory_order_relaxed) != 1)
+    {
+      continue;
+    }
+    if (answered)
+    {
+      _vehicle.roundTrip.Add(std::chrono::steady_clock::now() - start);
+    }
+    else
+    {
+      ++_vehicle.timeouts;
+    }
+  }
+}
+
+/// \brief Time the in-process part of a step and print its result line,
+/// see -m.
+static void RunMicroBench(const BenchOptions &_options)
+{
+  ServoPacketHeader header;
+  header.magic = kServoPacketMagic;
+  header.version = kServoPacketVersion;
+  header.channelCount = static_cast<uint16_t>(_options.channels);
+  header.frameCount = 0;
+
+  std::vector<uint8_t> packet(
+      sizeof(header) + _options.channels * sizeof(float));
+  for (unsigned int i = 0; i < _options.channels; ++i)
+  {
+    const float command = 0.5f;
+    memcpy(&packet[sizeof(header) + i * sizeof(float)], &command,
+        sizeof(command));
+  }
+
+  ArduPilotLink link;
+  fdmPacketExt &pkt = link.State();
+  std::vector<double> cmd(_options.channels, 0.0);
+
+  // one sample per batch of steps, a clock read per step would dominate
+  const unsigned int kBatch = 1000;
+  LatencyHistogram batch;
+  uint64_t steps = 0;
+  size_t pktSize = 0;
+  const uint64_t cpuStart = ThreadCpuNs();
+  const std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  const std::chrono::steady_clock::time_point end = start +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(_options.seconds));
+  std::chrono::steady_clock::time_point now = start;
+  while (now < end)
+  {
+    for (unsigned int n = 0; n < kBatch; ++n)
+    {
+      ++header.frameCount;
+      memcpy(packet.data(), &header, sizeof(header));
+      const ssize_t recvSize = link.Inject(packet.data(), packet.size());
+
+      ServoCommand servo;
+      if (!link.Parse(recvSize, servo) || !link.Accept(servo))
+      {
+        continue;
+      }
+      for (unsigned int i = 0; i < cmd.size() && i < servo.channelCount; ++i)
+      {
+        cmd[i] = std::min(std::max(servo.Channel(i), -1.0f), 1.0f);
+      }
+
+      pkt.timestamp += 0.001;
+      pkt.velocityXYZ[2] = cmd[0];
+      pkt.positionXYZ[0] = static_cast<double>(servo.frameCount);
+      pktSize = link.FinishState(_options.fdmVersion, nullptr, 0);
+    }
+    const std::chrono::steady_clock::time_point last = now;
+    now = std::chrono::steady_clock::now();
+    batch.Add((now - last) / kBatch);
+    steps += kBatch;
+  }
+  const double seconds =
+    std::chrono::duration<double>(now - start).count();
+  const uint64_t cpuNs = ThreadCpuNs() - cpuStart;
+
+  printf("in-process step, %u channels, fdm_version %d (%zu bytes)\n",
+      _options.channels, _options.fdmVersion, pktSize);
+  printf("   steps/s   mean(ns)    p50(ns)    p99(ns)  cpu(ns)"
+      "  frames lost\n");
+  printf("%10.0f %10.1f %10lu %10lu %8.1f %12lu\n", steps / seconds,
+      seconds * 1e9 / steps, static_cast<unsigned long>(batch.Percentile(0.5)),
+      static_cast<unsigned long>(batch.Percentile(0.99)),
+      static_cast<double>(cpuNs) / steps,
+      static_cast<unsigned long>(link.FramesLost()));
+}
+
+/// \brief Run one vehicle count and print its result line.
+/// \return False if a link could not be opened.
+static bool RunBench(const BenchOptions &_options,
+    const unsigned int _vehicles)
+{
+  std::vector<std::unique_ptr<BenchVehicle>> vehicles;
+  for (unsigned int i = 0; i < _vehicles; ++i)
+  {
+    vehicles.emplace_back(new BenchVehicle);
+    if (!InitPlugin(_options, i, vehicles.back()->plugin) ||
+        !vehicles.back()->sitl.Init(_options, i))
+    {
+      fprintf(stderr, "failed to open link of vehicle %u\n", i);
+      return false;
+    }
+  }
+
+  // 0: warm up, 1: measure, 2: stop
+  std::atomic<int> phase(0);
+  std::vector<std::thread> threads;
+  for (auto &vehicle : vehicles)
+  {
+    threads.emplace_back(PluginLoop, std::cref(_options),
+        std::ref(*vehicle), std::cref(phase));
+    threads.emplace_back(SitlLoop, std::cref(_options),
+        std::ref(*vehicle), std::cref(phase));
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  const std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  phase = 1;
+  std::this_thread::sleep_for(std::chrono::duration<double>(_options.seconds));
+  phase = 2;
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+
+  LatencyHistogram step;
+  LatencyHistogram roundTrip;
+  uint64_t steps = 0;
+  uint64_t dropped = 0;
+  uint64_t timeouts = 0;
+  uint64_t cpuNs = 0;
+  for (const auto &vehicle : vehicles)
+  {
+    step.Merge(vehicle->step);
+    roundTrip.Merge(vehicle->roundTrip);
+    steps += vehicle->steps;
+    dropped += vehicle->dropped;
+    timeouts += vehicle->timeouts;
+    cpuNs += vehicle->cpuNs;
+  }
+
+  printf("%8u %10.0f %10.0f %9.2f %9.2f %9.2f %9.2f %8.2f %8.1f %7lu %7lu\n",
+      _vehicles, steps / seconds, steps / seconds / _vehicles,
+      step.Percentile(0.5) * 1e-3, step.Percentile(0.99) * 1e-3,
+      step.Max() * 1e-3, roundTrip.Percentile(0.99) * 1e-3,
+      steps == 0 ? 0.0 : cpuNs * 1e-3 / steps,
+      cpuNs * 1e-7 / seconds / _vehicles,
+      static_cast<unsigned long>(dropped),
+      static_cast<unsigned long>(timeouts));
+  fflush(stdout);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions options;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:c:f:p:bamh")) != -1)
+  {
+    switch (opt)
+    {
+      case 't':
+        options.shm = std::string(optarg) == "shm";
+        break;
+      case 'd':
+        options.seconds = atof(optarg);
+        break;
+      case 'c':
+        options.channels = static_cast<unsigned int>(atoi(optarg));
+        break;
+      case 'f':
+        options.fdmVersion = atoi(optarg);
+        break;
+      case 'p':
+        options.basePort = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 'b':
+        options.bridge = true;
+        break;
+      case 'a':
+        options.async = true;
+        break;
+      case 'm':
+        options.micro = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-t udp|shm] [-d seconds] [-c channels]"
+            " [-f fdm_version] [-p base_port] [-b] [-a] [-m]"
+            " [vehicles ...]\n",
+            argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (options.channels == 0 || options.channels > MAX_MOTORS)
+  {
+    fprintf(stderr, "channels must be between 1 and %d\n", MAX_MOTORS);
+    return 1;
+  }
+
+  if (options.micro)
+  {
+    RunMicroBench(options);
+    return 0;
+  }
+
+  std::vector<unsigned int> counts;
+  for (int i = optind; i < argc; ++i)
+  {
+    counts.push_back(static_cast<unsigned int>(atoi(argv[i])));
+  }
+  if (counts.empty())
+  {
+    counts = {1, 2, 4, 8, 16, 32, 64};
+  }
+
+  if (options.shm && options.bridge)
+  {
+    fprintf(stderr, "the shared bridge only receives udp\n");
+    return 1;
+  }
+
+  printf("transport %s%s%s, %u channels, fdm_version %d, %.1f s per run\n",
+      options.shm ? "shm" : "udp", options.bridge ? " bridge" : "",
+      options.async ? " async" : "", options.channels, options.fdmVersion,
+      options.seconds);
+  printf("vehicles    steps/s  per veh/s   p50(us)   p99(us)   max(us)"
+      "   rtt p99  cpu(us)   cpu(%%) dropped timeout\n");
+  for (const unsigned int count : counts)
+  {
+    if (count == 0 || !RunBench(options, count))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
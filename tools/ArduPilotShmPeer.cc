@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 Open Source Robotics Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+// Stand-in for ArduPilot SITL on the shared memory transport.
+// Sends a constant servo command as a versioned servo packet, waits for
+// the state packet and prints the exchange rate and round trip time every
+// second.
+//
+// usage: ArduPilotShmPeer [shm name] [channels] [command]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "include/ArduPilotProtocol.hh"
+#include "include/ArduPilotShm.hh"
+
+int main(int argc, char **argv)
+{
+  const std::string name = argc > 1 ? argv[1] : "/ardupilot_gazebo_9002";
+  const int channels = argc > 2 ? atoi(argv[2]) : 4;
+  const float command = argc > 3 ? static_cast<float>(atof(argv[3])) : 0.0f;
+
+  gazebo::ArduPilotShm shm;
+  while (!shm.Open(name))
+  {
+    printf("waiting for %s\n", name.c_str());
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  printf("connected to %s, sending %d channels at %f\n",
+      name.c_str(), channels, command);
+
+  gazebo::ServoPacketHeader header;
+  header.magic = gazebo::kServoPacketMagic;
+  header.version = gazebo::kServoPacketVersion;
+  header.channelCount = static_cast<uint16_t>(channels);
+  header.frameCount = 0;
+
+  std::vector<unsigned char> servo(
+      sizeof(header) + channels * sizeof(float));
+  for (int i = 0; i < channels; ++i)
+  {
+    memcpy(&servo[sizeof(header) + i * sizeof(float)], &command,
+        sizeof(command));
+  }
+  std::vector<unsigned char> fdm(gazebo::ArduPilotShm::kSlotSize);
+
+  unsigned int steps = 0;
+  unsigned int missed = 0;
+  std::chrono::steady_clock::duration rtt =
+    std::chrono::steady_clock::duration::zero();
+  std::chrono::steady_clock::time_point lastReport =
+    std::chrono::steady_clock::now();
+
+  while (true)
+  {
+    const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    memcpy(servo.data(), &header, sizeof(header));
+    ++header.frameCount;
+    shm.Send(servo.data(), servo.size());
+    if (shm.Recv(fdm.data(), fdm.size(), 1000) == -1)
+    {
+      ++missed;
+    }
+    else
+    {
+      ++steps;
+      rtt += std::chrono::steady_clock::now() - start;
+    }
+
+    const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+    if (now - lastReport >= std::chrono::seconds(1))
+    {
+      const double seconds =
+        std::chrono::duration<double>(now - lastReport).count();
+      const double rttUs = steps == 0 ? 0.0 :
+        std::chrono::duration<double, std::micro>(rtt).count() / steps;
+      printf("%.0f steps/s, round trip %.2f us, missed %u\n",
+          steps / seconds, rttUs, missed);
+      steps = 0;
+      missed = 0;
+      rtt = std::chrono::steady_clock::duration::zero();
+      lastReport = now;
+    }
+  }
+  return 0;
+}